@@ -22,9 +22,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "imageRef.h"
 
 // The data structure
 //
@@ -33,7 +44,8 @@
 // The other field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
-// top to bottom.
+// top to bottom.  (Lazy views and sparse images, described below, keep
+// their pixels elsewhere until needed.)
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
@@ -45,12 +57,32 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// A rectangle of pixels: [x0, x1) x [y0, y1)
+typedef struct {
+  int x0, y0, x1, y1;
+} Rect;
+
+#define DIRTYMAX 8   // dirty rectangles kept per image
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  void* shared; // shared memory mapping holding pixel, or NULL if not shared
+  size_t sharedSize;  // size of the mapping (if not shared, of a private
+                      // mapping that is pixel, or 0 if pixel is malloc'ed)
+  uint8** tiles;  // tiles of a sparse image, or NULL (see below)
+  Image base;   // image whose pixels a lazy view shows, or NULL (see below)
+  int orient;   // orientation of the view relative to base
+  Image views;  // first lazy view of this image
+  Image next;   // next lazy view of the same base
+  Rect dirty[DIRTYMAX];  // pixels modified since last filtered (see below)
+  int ndirty;
+  Image filtered;      // image last blurred from this one, or NULL
+  Image filteredFrom;  // image this one was last blurred from, or NULL
+  int filterDx, filterDy;  // the window of that blur
 };
 
 
@@ -74,10 +106,11 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+// (One per thread, so that images may be loaded and saved concurrently.)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -148,7 +181,192 @@ void ImageInit(void) { ///
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   InstrName[1] = "comparisons";  // Contador para comparações
-  
+  const char* verify = getenv("IMAGE_VERIFY");
+  if (verify != NULL && atoi(verify) != 0) ImageSetVerify(1);
+}
+
+// Parallel execution
+//
+// Operations on large images split their rows into chunks, which are
+// shared out among the threads of a pool.  The pool threads are created
+// on first use and then wait for work, so a parallel loop costs a wakeup,
+// not a thread creation.  There are ImageThreads() participants in a loop,
+// the caller being one of them: each starts with an equal range of the
+// chunks and takes chunks from its front; when it runs out, it steals
+// from the back of the largest remaining range.  So uneven loads (a layer
+// blended into one corner, a rotation that leaves most rows black) still
+// keep every thread busy.  A range is packed in a single 64-bit word, so
+// taking and stealing a chunk are each one compare-and-swap.
+// A loop started while the pool is busy (from inside a range function, or
+// from another thread) just runs in its caller.
+// Range functions must not touch the instrumentation counters (they are
+// per thread, and pool threads never report theirs); callers count for them.
+
+#define MAXTHREADS 16
+#define PARMIN (1 << 20)      // pixels below which one thread does it all
+#define CHUNKPIX (1 << 16)    // pixels per chunk, ideally
+
+// Chunks [lo, hi) of one participant, as hi << 32 | lo,
+// each in its own cache line.
+typedef struct {
+  _Alignas(64) uint64_t range;
+} Slot;
+
+static struct {
+  pthread_once_t once;
+  pthread_mutex_t busy;     // held by the caller of a parallel loop
+  pthread_mutex_t mutex;    // protects the fields below
+  pthread_cond_t start;     // a new loop was started
+  pthread_cond_t done;      // a participant finished
+  int threads;              // participants wanted, caller included
+  int started;              // threads created
+  unsigned long gen;        // number of loops started
+  unsigned long born[MAXTHREADS];  // value of gen when each was created
+  int active;               // threads still working on the current loop
+  // The current loop
+  int n, grain, parts;
+  ImageRangeFn fn;
+  void* arg;
+  Slot slot[MAXTHREADS];
+} pool = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// The default number of threads: IMAGE_THREADS, if set, or the CPU count.
+static int defaultThreads(void) {
+  const char* env = getenv("IMAGE_THREADS");
+  long n = env != NULL ? strtol(env, NULL, 10) : 0;
+  if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > MAXTHREADS ? MAXTHREADS : (int)n;
+}
+
+static void poolInit(void) {
+  pool.threads = defaultThreads();
+}
+
+// Run chunks for participant id until there are none left anywhere.
+static void poolWork(int id) {
+  int parts = pool.parts;
+  for (;;) {
+    // Take the first chunk of our range, or else steal the last one of
+    // the largest other range
+    Slot* s = &pool.slot[id];
+    uint64_t r = __atomic_load_n(&s->range, __ATOMIC_ACQUIRE);
+    int take = 1;
+    if ((uint32_t)r >= r >> 32) {
+      take = 0;
+      s = NULL;
+      uint32_t most = 0;
+      for (int i = 0; i < parts; i++) {
+        uint64_t v = __atomic_load_n(&pool.slot[i].range, __ATOMIC_ACQUIRE);
+        uint32_t left = (uint32_t)(v >> 32) - (uint32_t)v;
+        if ((uint32_t)v < v >> 32 && left > most) { most = left; s = &pool.slot[i]; r = v; }
+      }
+      if (s == NULL) return;   // all done
+    }
+    uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+    if (lo >= hi) continue;
+    uint32_t c = take ? lo : hi - 1;
+    uint64_t next = take ? r + 1 : r - ((uint64_t)1 << 32);
+    if (!__atomic_compare_exchange_n(&s->range, &r, next, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+    long long i0 = (long long)c*pool.grain;
+    long long i1 = i0 + pool.grain < pool.n ? i0 + pool.grain : pool.n;
+    pool.fn((int)i0, (int)i1, id, pool.arg);
+  }
+}
+
+static void* poolMain(void* arg) {
+  int id = (int)(intptr_t)arg;
+  pthread_mutex_lock(&pool.mutex);
+  unsigned long seen = pool.born[id];
+  for (;;) {
+    while (pool.gen == seen) pthread_cond_wait(&pool.start, &pool.mutex);
+    seen = pool.gen;
+    if (id >= pool.parts) continue;   // not needed for this one
+    pthread_mutex_unlock(&pool.mutex);
+    poolWork(id);
+    pthread_mutex_lock(&pool.mutex);
+    if (--pool.active == 0) pthread_cond_signal(&pool.done);
+  }
+  return NULL;
+}
+
+/// Number of threads used by parallel image operations.
+int ImageThreads(void) { ///
+  pthread_once(&pool.once, poolInit);
+  return pool.threads;
+}
+
+/// Set the number of threads used by parallel image operations.
+void ImageSetThreads(int n) { ///
+  pthread_once(&pool.once, poolInit);
+  pthread_mutex_lock(&pool.busy);
+  pool.threads = n < 1 ? defaultThreads() : n > MAXTHREADS ? MAXTHREADS : n;
+  pthread_mutex_unlock(&pool.busy);
+}
+
+/// Run fn over [0, n) in chunks of grain, in parallel.
+void ImageParallelFor(int n, int grain, ImageRangeFn fn, void* arg) { ///
+  assert (n >= 0);
+  assert (fn != NULL);
+  if (n == 0) return;
+  if (grain < 1) grain = 1;
+  int chunks = (int)(((long long)n + grain - 1) / grain);
+  pthread_once(&pool.once, poolInit);
+  if (chunks == 1 || pool.threads == 1 || pthread_mutex_trylock(&pool.busy) != 0) {
+    fn(0, n, 0, arg);
+    return;
+  }
+  // Create the threads still missing (if that fails, make do with fewer)
+  int parts = pool.threads < chunks ? pool.threads : chunks;
+  while (pool.started < parts - 1) {
+    int id = pool.started + 1;
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pool.born[id] = pool.gen;
+    int ok = pthread_create(&tid, &attr, poolMain, (void*)(intptr_t)id) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) break;
+    pool.started++;
+  }
+  if (parts > pool.started + 1) parts = pool.started + 1;
+  if (parts == 1) {
+    pthread_mutex_unlock(&pool.busy);
+    fn(0, n, 0, arg);
+    return;
+  }
+  pthread_mutex_lock(&pool.mutex);
+  pool.n = n;
+  pool.grain = grain;
+  pool.parts = parts;
+  pool.fn = fn;
+  pool.arg = arg;
+  for (int i = 0; i < parts; i++) {
+    uint64_t lo = (uint64_t)chunks*i/parts, hi = (uint64_t)chunks*(i + 1)/parts;
+    pool.slot[i].range = hi << 32 | lo;
+  }
+  pool.active = parts - 1;
+  pool.gen++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.mutex);
+  poolWork(0);
+  pthread_mutex_lock(&pool.mutex);
+  while (pool.active > 0) pthread_cond_wait(&pool.done, &pool.mutex);
+  pthread_mutex_unlock(&pool.mutex);
+  pthread_mutex_unlock(&pool.busy);
+}
+
+// Rows per chunk, for a parallel loop over the rows of a w x h image:
+// about CHUNKPIX pixels, but small enough for 4 chunks per thread, so
+// that there is something left to steal.  Small images make one chunk.
+static int rowGrain(int w, int h) {
+  if ((size_t)w*h < PARMIN) return h > 0 ? h : 1;
+  int g = (CHUNKPIX + w - 1) / w;
+  int most = h / (4*ImageThreads());
+  if (g > most) g = most;
+  return g < 1 ? 1 : g;
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -158,6 +376,447 @@ void ImageInit(void) { ///
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+// Verification
+//
+// In verification mode, each operation first runs its reference version
+// (from imageRef.c) on a copy of its image, then runs itself and compares
+// the results.  The operations just call the verifyX function instead of
+// doing their job, when verifying() says so; verifyX then calls them back
+// with verifyDepth set, so that they (and the operations they use) do
+// their job unchecked.  The counters are restored after the reference
+// work, so they only count the operation itself.
+
+static int verifyOn = 0;
+static size_t verifyFails = 0;
+static _Thread_local int verifyDepth = 0;
+
+static inline int verifying(void) {
+  return verifyOn && verifyDepth == 0;
+}
+
+/// Turn verification mode on or off.
+void ImageSetVerify(int on) { ///
+  verifyOn = on != 0;
+}
+
+/// Number of operations that did not match the reference so far.
+size_t ImageVerifyMismatches(void) { ///
+  return __atomic_load_n(&verifyFails, __ATOMIC_RELAXED);
+}
+
+// Report that operation op (with its parameters) did not match the
+// reference, because of what.
+static void verifyReport(const char* op, const char* what) {
+  __atomic_add_fetch(&verifyFails, 1, __ATOMIC_RELAXED);
+  fprintf(stderr, "IMAGE_VERIFY: %s: %s\n", op, what);
+}
+
+// Start verifying an operation: save the counters in count, to be
+// restored by verifyResume once the reference result is computed.
+static void verifyPause(unsigned long long count[NUMCOUNTERS]) {
+  memcpy(count, InstrCount, sizeof(InstrCount));
+  verifyDepth++;
+}
+
+static void verifyResume(const unsigned long long count[NUMCOUNTERS]) {
+  memcpy(InstrCount, count, sizeof(InstrCount));
+}
+
+// A dense copy of img, to run a reference operation on (or NULL).
+static Image verifyCopy(Image img) {
+  Image copy = ImageCreate(img->width, img->height, (uint8)img->maxval);
+  for (int y = 0; copy != NULL && y < img->height; y++) {
+    ImageGetRow(img, 0, y, img->width, copy->pixel + (size_t)y*img->width);
+  }
+  return copy;
+}
+
+// Finish verifying an operation: check that each pixel of its result out
+// is within tol of the range given by the reference results lo and hi (if
+// they all exist), and report the first one that is not, with the
+// operation described by format op and the arguments in args.  Destroys
+// lo and hi (which may be the same image).
+static void verifyCompare(Image out, Image lo, Image hi, int tol, const char* op, va_list args) {
+  unsigned long long count[NUMCOUNTERS];
+  int errsave = errno;
+  char* cause = errCause;
+  memcpy(count, InstrCount, sizeof(InstrCount));
+  char what[128] = "";
+  if (out == NULL || lo == NULL || hi == NULL) {
+    // (The operation or the reference failed: nothing to compare.)
+  } else if (out->width != lo->width || out->height != lo->height ||
+             out->maxval != lo->maxval) {
+    snprintf(what, sizeof(what), "result is %dx%d, maxval %d; reference %dx%d, maxval %d",
+             out->width, out->height, out->maxval, lo->width, lo->height, lo->maxval);
+  } else {
+    uint8* row = malloc((size_t)out->width + 1);
+    size_t differ = 0;
+    int fx = 0, fy = 0;
+    uint8 fout = 0;
+    for (int y = 0; row != NULL && y < out->height; y++) {
+      ImageGetRow(out, 0, y, out->width, row);
+      const uint8* l = lo->pixel + (size_t)y*lo->width;
+      const uint8* h = hi->pixel + (size_t)y*hi->width;
+      for (int x = 0; x < out->width; x++) {
+        if ((row[x] + tol < l[x] || row[x] > h[x] + tol) && differ++ == 0) {
+          fx = x; fy = y; fout = row[x];
+        }
+      }
+    }
+    free(row);
+    size_t i = (size_t)fy*lo->width + fx;
+    if (differ > 0 && lo == hi && tol == 0) {
+      snprintf(what, sizeof(what), "pixel (%d,%d) is %d, reference %d (%zu of %dx%d pixels differ)",
+               fx, fy, fout, lo->pixel[i], differ, out->width, out->height);
+    } else if (differ > 0) {
+      snprintf(what, sizeof(what), "pixel (%d,%d) is %d, reference %d..%d +-%d (%zu of %dx%d pixels differ)",
+               fx, fy, fout, lo->pixel[i], hi->pixel[i], tol, differ, out->width, out->height);
+    }
+  }
+  if (what[0] != '\0') {
+    char desc[256];
+    vsnprintf(desc, sizeof(desc), op, args);
+    verifyReport(desc, what);
+  }
+  if (hi != lo) ImageDestroy(&hi);
+  ImageDestroy(&lo);
+  verifyDepth--;
+  memcpy(InstrCount, count, sizeof(InstrCount));
+  errCause = cause;
+  errno = errsave;
+}
+
+// Finish verifying an operation: compare its result out with the
+// reference result ref, which must match exactly (see verifyCompare).
+static void verifyImage(Image out, Image ref, const char* op, ...) {
+  va_list args;
+  va_start(args, op);
+  verifyCompare(out, ref, ref, 0, op, args);
+  va_end(args);
+}
+
+// Finish verifying a fixed point operation: its result out must be within
+// one level of the reference range [lo, hi] (see verifyCompare).
+static void verifyNear(Image out, Image lo, Image hi, const char* op, ...) {
+  va_list args;
+  va_start(args, op);
+  verifyCompare(out, lo, hi, 1, op, args);
+  va_end(args);
+}
+
+static void verifyStats(Image img, uint8* min, uint8* max) {
+  unsigned long long count[NUMCOUNTERS];
+  uint8 rmin, rmax;
+  verifyPause(count);
+  RefStats(img, &rmin, &rmax);
+  verifyResume(count);
+  ImageStats(img, min, max);
+  verifyDepth--;
+  if (*min != rmin || *max != rmax) {
+    char what[64];
+    snprintf(what, sizeof(what), "range is [%d, %d], reference [%d, %d]", *min, *max, rmin, rmax);
+    verifyReport("ImageStats()", what);
+  }
+}
+
+static void verifyHistogram(Image img, size_t hist[256]) {
+  unsigned long long count[NUMCOUNTERS];
+  size_t ref[256];
+  verifyPause(count);
+  RefHistogram(img, ref);
+  verifyResume(count);
+  ImageHistogram(img, hist);
+  verifyDepth--;
+  for (int v = 0; v < 256; v++) {
+    if (hist[v] == ref[v]) continue;
+    char what[96];
+    snprintf(what, sizeof(what), "hist[%d] is %zu, reference %zu", v, hist[v], ref[v]);
+    verifyReport("ImageHistogram()", what);
+    break;
+  }
+}
+
+static void verifyStatsFull(Image img, ImageStatistics* st) {
+  unsigned long long count[NUMCOUNTERS];
+  ImageStatistics ref;
+  verifyPause(count);
+  RefStatsFull(img, &ref);
+  verifyResume(count);
+  ImageStatsFull(img, st);
+  verifyDepth--;
+  char what[160] = "";
+  if (st->count != ref.count || st->min != ref.min || st->max != ref.max ||
+      st->mean != ref.mean) {
+    snprintf(what, sizeof(what), "%zu pixels in [%d, %d], mean %.17g; reference %zu in [%d, %d], mean %.17g",
+             st->count, st->min, st->max, st->mean, ref.count, ref.min, ref.max, ref.mean);
+  } else if (fabs(st->variance - ref.variance) > 1e-9*ref.variance) {
+    // (The sums are in a different order: allow for rounding.)
+    snprintf(what, sizeof(what), "variance is %.17g, reference %.17g", st->variance, ref.variance);
+  }
+  for (int v = 0; what[0] == '\0' && v < 256; v++) {
+    if (st->hist[v] != ref.hist[v]) {
+      snprintf(what, sizeof(what), "hist[%d] is %zu, reference %zu", v, st->hist[v], ref.hist[v]);
+    }
+  }
+  if (what[0] != '\0') verifyReport("ImageStatsFull()", what);
+}
+
+static uint64_t verifyHash(Image img, uint64_t seed) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  uint64_t ref = RefHash(img, seed);
+  verifyResume(count);
+  uint64_t hash = ImageHash(img, seed);
+  verifyDepth--;
+  if (hash != ref) {
+    char desc[96], what[64];
+    snprintf(desc, sizeof(desc), "ImageHash(%dx%d, seed=%#" PRIx64 ")", img->width, img->height, seed);
+    snprintf(what, sizeof(what), "result is %#" PRIx64 ", reference %#" PRIx64, hash, ref);
+    verifyReport(desc, what);
+  }
+  return hash;
+}
+
+static void verifyNegative(Image img) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL) RefNegative(ref);
+  verifyResume(count);
+  ImageNegative(img);
+  verifyImage(img, ref, "ImageNegative()");
+}
+
+static void verifyThreshold(Image img, uint8 thr) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL) RefThreshold(ref, thr);
+  verifyResume(count);
+  ImageThreshold(img, thr);
+  verifyImage(img, ref, "ImageThreshold(thr=%d)", thr);
+}
+
+static void verifyBrighten(Image img, double factor) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL) RefBrighten(ref, factor);
+  verifyResume(count);
+  ImageBrighten(img, factor);
+  verifyImage(img, ref, "ImageBrighten(factor=%.17g)", factor);
+}
+
+static void verifyEqualize(Image img) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL) RefEqualize(ref);
+  verifyResume(count);
+  ImageEqualize(img);
+  verifyImage(img, ref, "ImageEqualize()");
+}
+
+static void verifyStretch(Image img) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL) RefStretch(ref);
+  verifyResume(count);
+  ImageStretch(img);
+  verifyImage(img, ref, "ImageStretch()");
+}
+
+static Image verifyRotate(Image img) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = RefRotate(img);
+  verifyResume(count);
+  Image res = ImageRotate(img);
+  verifyImage(res, ref, "ImageRotate()");
+  return res;
+}
+
+static Image verifyMirror(Image img) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = RefMirror(img);
+  verifyResume(count);
+  Image res = ImageMirror(img);
+  verifyImage(res, ref, "ImageMirror()");
+  return res;
+}
+
+static Image verifyCrop(Image img, int x, int y, int w, int h) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = RefCrop(img, x, y, w, h);
+  verifyResume(count);
+  Image res = ImageCrop(img, x, y, w, h);
+  verifyImage(res, ref, "ImageCrop(x=%d, y=%d, w=%d, h=%d)", x, y, w, h);
+  return res;
+}
+
+// Black images lo and hi of size w x h, for a reference range (or NULLs).
+static void verifyRange(Image img, int w, int h, Image* lo, Image* hi) {
+  *lo = ImageCreate(w, h, (uint8)img->maxval);
+  *hi = ImageCreate(w, h, (uint8)img->maxval);
+  if (*lo == NULL || *hi == NULL) {
+    ImageDestroy(lo);
+    ImageDestroy(hi);
+  }
+}
+
+static Image verifyResize(Image img, int w, int h, ResizeMode mode) {
+  unsigned long long count[NUMCOUNTERS];
+  Image lo, hi;
+  verifyPause(count);
+  verifyRange(img, w, h, &lo, &hi);
+  if (lo != NULL) RefResize(img, mode, lo, hi);
+  verifyResume(count);
+  Image res = ImageResize(img, w, h, mode);
+  verifyNear(res, lo, hi, "ImageResize(%dx%d to %dx%d, mode=%d)",
+             img->width, img->height, w, h, mode);
+  return res;
+}
+
+static Image verifyRotateAngle(Image img, double degrees, ResizeMode interp) {
+  unsigned long long count[NUMCOUNTERS];
+  Image lo, hi;
+  verifyPause(count);
+  verifyRange(img, img->width, img->height, &lo, &hi);
+  if (lo != NULL) RefRotateAngle(img, degrees, interp, lo, hi);
+  verifyResume(count);
+  Image res = ImageRotateAngle(img, degrees, interp);
+  verifyNear(res, lo, hi, "ImageRotateAngle(%dx%d, degrees=%.17g, interp=%d)",
+             img->width, img->height, degrees, interp);
+  return res;
+}
+
+static void verifyPaste(Image img1, int x, int y, Image img2) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img1);
+  if (ref != NULL) RefPaste(ref, x, y, img2);
+  verifyResume(count);
+  ImagePaste(img1, x, y, img2);
+  verifyImage(img1, ref, "ImagePaste(x=%d, y=%d, %dx%d)", x, y, img2->width, img2->height);
+}
+
+static void verifyPasteMasked(Image img1, int x, int y, Image img2, Image mask) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img1);
+  if (ref != NULL) RefPasteMasked(ref, x, y, img2, mask);
+  verifyResume(count);
+  ImagePasteMasked(img1, x, y, img2, mask);
+  verifyImage(img1, ref, "ImagePasteMasked(x=%d, y=%d, %dx%d)", x, y, img2->width, img2->height);
+}
+
+static void verifyPasteKeyed(Image img1, int x, int y, Image img2, uint8 key) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img1);
+  if (ref != NULL) RefPasteKeyed(ref, x, y, img2, key);
+  verifyResume(count);
+  ImagePasteKeyed(img1, x, y, img2, key);
+  verifyImage(img1, ref, "ImagePasteKeyed(x=%d, y=%d, %dx%d, key=%d)",
+              x, y, img2->width, img2->height, key);
+}
+
+static void verifyBlend(Image img1, int x, int y, Image img2, double alpha) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img1);
+  if (ref != NULL) RefBlend(ref, x, y, img2, alpha);
+  verifyResume(count);
+  ImageBlend(img1, x, y, img2, alpha);
+  verifyImage(img1, ref, "ImageBlend(x=%d, y=%d, %dx%d, alpha=%.17g)",
+              x, y, img2->width, img2->height, alpha);
+}
+
+static void verifyBlendMany(Image img, const ImageLayer* layers, int n) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  for (int i = 0; ref != NULL && i < n; i++) {
+    RefBlend(ref, layers[i].x, layers[i].y, layers[i].img, layers[i].alpha);
+  }
+  verifyResume(count);
+  ImageBlendMany(img, layers, n);
+  verifyImage(img, ref, "ImageBlendMany(%d layers, first at x=%d, y=%d, alpha=%.17g)",
+              n, n > 0 ? layers[0].x : 0, n > 0 ? layers[0].y : 0, n > 0 ? layers[0].alpha : 0.0);
+}
+
+static int verifyMatchSubImage(Image img1, int x, int y, Image img2) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  int ref = RefMatchSubImage(img1, x, y, img2);
+  verifyResume(count);
+  int match = ImageMatchSubImage(img1, x, y, img2);
+  verifyDepth--;
+  if (match != ref) {
+    char desc[96], what[64];
+    snprintf(desc, sizeof(desc), "ImageMatchSubImage(x=%d, y=%d, %dx%d in %dx%d)",
+             x, y, img2->width, img2->height, img1->width, img1->height);
+    snprintf(what, sizeof(what), "result is %d, reference %d", match, ref);
+    verifyReport(desc, what);
+  }
+  return match;
+}
+
+static int verifyLocateSubImage(Image img1, int* px, int* py, Image img2) {
+  unsigned long long count[NUMCOUNTERS];
+  int rx = -1, ry = -1;
+  verifyPause(count);
+  int ref = RefLocateSubImage(img1, &rx, &ry, img2);
+  verifyResume(count);
+  int found = ImageLocateSubImage(img1, px, py, img2);
+  verifyDepth--;
+  if (found != ref || (found && (*px != rx || *py != ry))) {
+    char desc[96], what[96];
+    snprintf(desc, sizeof(desc), "ImageLocateSubImage(%dx%d in %dx%d)",
+             img2->width, img2->height, img1->width, img1->height);
+    snprintf(what, sizeof(what), "result is %d at (%d,%d), reference %d at (%d,%d)",
+             found, found ? *px : -1, found ? *py : -1, ref, rx, ry);
+    verifyReport(desc, what);
+  }
+  return found;
+}
+
+// Verify in-place filter fn, with reference ref, called name.
+static int verifyFilter(int (*fn)(Image, int, int), int (*ref)(Image, int, int),
+                        const char* name, Image img, int dx, int dy) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image copy = verifyCopy(img);
+  if (copy != NULL && !ref(copy, dx, dy)) ImageDestroy(&copy);
+  verifyResume(count);
+  int ok = fn(img, dx, dy);
+  verifyImage(ok ? img : NULL, copy, "%s(dx=%d, dy=%d)", name, dx, dy);
+  return ok;
+}
+
+// Reference opening and closing
+static int refOpen(Image img, int dx, int dy) {
+  return RefErode(img, dx, dy) && RefDilate(img, dx, dy);
+}
+
+static int refClose(Image img, int dx, int dy) {
+  return RefDilate(img, dx, dy) && RefErode(img, dx, dy);
+}
+
+static int verifyBlurUpdate(Image img, Image out, int dx, int dy) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL && !RefBlur(ref, dx, dy)) ImageDestroy(&ref);
+  verifyResume(count);
+  int ok = ImageBlurUpdate(img, out, dx, dy);
+  verifyImage(ok ? out : NULL, ref, "ImageBlurUpdate(dx=%d, dy=%d)", dx, dy);
+  return ok;
+}
+
 
 /// Image management functions
 
@@ -170,11 +829,13 @@ void ImageInit(void) { ///
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly-.
 
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
+// How imageNew allocates the pixels.
+enum { PixUndefined, PixBlack, PixReserved };
 
+// Allocate a new image, as ImageCreate, but with pixels as given by how:
+// undefined, black, or black in a private mapping without swap space
+// reserved (for sparse images, that may never use most of it).
+static Image imageNew(int width, int height, uint8 maxval, int how) {
   //alocar memoria para nova imagem
   Image img = malloc(sizeof(struct image));
   //erro ao criar
@@ -182,12 +843,34 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
     errno = ENOMEM;
     return NULL;}
 
+  //numero de pixeis tem de caber em size_t
+  if (height > 0 && (size_t)width > SIZE_MAX / (size_t)height) {
+    free(img);
+    errno = ENOMEM;
+    return NULL;
+  }
+
   //iniciar valores da imagem
   img -> width = width;
   img -> height = height;
   img -> maxval = (int) maxval;
-  //alocar memoria pixeis
-  img -> pixel = (uint8*)malloc(sizeof(uint8)*width*height);
+  img -> shared = NULL;
+  img -> sharedSize = 0;
+  img -> tiles = NULL;
+  img -> base = img -> views = img -> next = NULL;
+  img -> orient = 0;
+  img -> ndirty = 0;
+  img -> filtered = img -> filteredFrom = NULL;
+  //alocar memoria pixeis (calloc e mmap obtêm páginas a zero do sistema, sem as percorrer)
+  size_t n = (size_t)width*height;
+  if (how == PixReserved) {
+    void* m = mmap(NULL, n + 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    img -> pixel = m != MAP_FAILED ? m : NULL;
+    img -> sharedSize = n + 1;
+  } else {
+    img -> pixel = (uint8*)(how == PixBlack ? calloc(n, sizeof(uint8)) : malloc(sizeof(uint8)*n));
+  }
 
   //erro ao criar
   if (img -> pixel == NULL) {
@@ -195,17 +878,321 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
     errno = ENOMEM;
     return NULL;
   }
+  return img;
+}
+
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  return imageNew(width, height, maxval, PixBlack);
+}
+
+// Sparse images
+//
+// A sparse image keeps its pixels in STILE x STILE tiles (a 4 KiB page
+// each), allocated when first written; a missing tile is all black.
+// Pasting and blending into it, saving it, and single pixel and row access
+// work tile by tile, and skip the missing ones, so a large canvas with
+// a few images pasted costs memory in proportion to them.  Any other
+// operation turns it into an ordinary image first (see materialize):
+// its raster was mapped when it was created, without reserving memory
+// (the system provides pages as they are written), so that never fails.
+
+#define STILE 64
+
+// Number of tiles to cover n pixels.
+static inline int tileCount(int n) {
+  return n / STILE + (n % STILE != 0);
+}
+
+// Tile (tx, ty) of sparse image img; a missing one is allocated (black)
+// if alloc is nonzero.  Returns NULL if missing or out of memory.
+static uint8* sparseTile(Image img, int tx, int ty, int alloc) {
+  uint8** t = &img->tiles[(size_t)ty*tileCount(img->width) + tx];
+  if (*t == NULL && alloc) *t = calloc(STILE*STILE, sizeof(uint8));
+  return *t;
+}
+
+// Copy the w x h rectangle at (x, y) of sparse image img to dst (with the
+// given row stride).
+static void sparseCopy(Image img, int x, int y, int w, int h, uint8* dst, size_t stride) {
+  for (int j = 0; j < h; j++) {
+    int yy = y + j;
+    uint8* d = dst + (size_t)j*stride;
+    for (int x0 = x; x0 < x + w; ) {
+      int tx = x0 / STILE;
+      int x1 = (tx + 1)*STILE < x + w ? (tx + 1)*STILE : x + w;
+      const uint8* t = sparseTile(img, tx, yy / STILE, 0);
+      if (t == NULL) memset(d + (x0 - x), 0, (size_t)(x1 - x0));
+      else memcpy(d + (x0 - x), t + (yy % STILE)*STILE + x0 % STILE, (size_t)(x1 - x0));
+      x0 = x1;
+    }
+  }
+}
+
+// What to do with each row segment in sparseApply.
+typedef void (*SpanFn)(uint8* d, const uint8* s, int n, const void* arg);
+
+// Call fn(d, s, n, arg) for every row segment d of the w x h rectangle at
+// (x, y) of sparse image img that lies in one tile, with s the segment at
+// the same place in src (a raster with the given row stride).
+// All the tiles needed are allocated first, so that on failure (out of
+// memory) nothing is done, and 0 is returned.
+static int sparseApply(Image img, int x, int y, int w, int h,
+                       const uint8* src, size_t stride, SpanFn fn, const void* arg) {
+  if (w == 0 || h == 0) return 1;
+  int tx0 = x / STILE, tx1 = (x + w - 1) / STILE;
+  int ty0 = y / STILE, ty1 = (y + h - 1) / STILE;
+  for (int ty = ty0; ty <= ty1; ty++) {
+    for (int tx = tx0; tx <= tx1; tx++) {
+      if (sparseTile(img, tx, ty, 1) == NULL) return 0;
+    }
+  }
+  for (int ty = ty0; ty <= ty1; ty++) {
+    int ya = ty*STILE > y ? ty*STILE : y;
+    int yb = ty < ty1 ? (ty + 1)*STILE : y + h;
+    for (int tx = tx0; tx <= tx1; tx++) {
+      int xa = tx*STILE > x ? tx*STILE : x;
+      int xb = tx < tx1 ? (tx + 1)*STILE : x + w;
+      uint8* t = sparseTile(img, tx, ty, 0);
+      for (int yy = ya; yy < yb; yy++) {
+        fn(t + (yy - ty*STILE)*STILE + (xa - tx*STILE),
+           src + (size_t)(yy - y)*stride + (xa - x), xb - xa, arg);
+      }
+    }
+  }
+  return 1;
+}
+
+// Free the tiles of img, if any, making it an ordinary (black) image.
+static void sparseFree(Image img) {
+  if (img->tiles == NULL) return;
+  size_t ntiles = (size_t)tileCount(img->width)*tileCount(img->height);
+  for (size_t i = 0; i < ntiles; i++) free(img->tiles[i]);
+  free(img->tiles);
+  img->tiles = NULL;
+}
+
+// Move the pixels of sparse image img to its raster.
+static void sparseDensify(Image img) {
+  TraceBegin("densify", "kernel");
+  int w = img->width;
+  size_t n = 0;
+  for (int ty = 0; ty < tileCount(img->height); ty++) {
+    for (int tx = 0; tx < tileCount(w); tx++) {
+      const uint8* t = sparseTile(img, tx, ty, 0);
+      if (t == NULL) continue;   // the raster is black already
+      int tw = w - tx*STILE < STILE ? w - tx*STILE : STILE;
+      int th = img->height - ty*STILE < STILE ? img->height - ty*STILE : STILE;
+      for (int j = 0; j < th; j++) {
+        memcpy(img->pixel + (size_t)(ty*STILE + j)*w + tx*STILE, t + j*STILE, (size_t)tw);
+      }
+      n += (size_t)tw*th;
+    }
+  }
+  sparseFree(img);
+  PIXMEM += 2*n;  // count pixel reads and writes
+  TraceEnd(2*n);
+}
 
-  //iniciar os pixeis com valor 0
-  for (int i = 0;i < width*height;i++){ 
-    img->pixel[i]=0;
+/// Create a new black sparse image.
+Image ImageCreateSparse(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  Image img = imageNew(width, height, maxval, PixReserved);
+  size_t ntiles = (size_t)tileCount(width)*tileCount(height);
+  if (img != NULL && (img->tiles = calloc(ntiles + 1, sizeof(uint8*))) == NULL) {
+    ImageDestroy(&img);
+    errno = ENOMEM;
   }
   return img;
+}
+
+// Lazy views
+//
+// ImageRotate and ImageMirror do not move any pixels: they return a lazy
+// view, that shows the pixels of another image (its base) in one of the
+// 8 orientations of a rectangle.  Orientation o maps position (x, y) of
+// the view to a base position: (x, y) is transposed if o has OTRANSPOSE,
+// then the base x coordinate is reversed if o has bit 0 set, and the base
+// y coordinate if o has bit 1 set.  A view of a view is a view of the same
+// base, with the orientations composed, so these transformations are O(1).
+//
+// Operations that need a view in raster order materialize it first: the
+// pixels are remapped from the base, in cache-sized blocks, to the view's
+// own buffer.  That buffer is allocated, but not filled, with the view, so
+// materializing never fails.  Before a base is modified or destroyed, its
+// views are materialized too.  (Bases keep a list of their views.)
+// Since reading a view may thus modify its base's list, images that share
+// pixels this way must not be used by different threads at the same time.
+
+#define OTRANSPOSE 4
+#define OBLOCK 32
+
+// Orientation of a view with orientation p of a view with orientation o.
+static int orientCompose(int o, int p) {
+  int t = o & OTRANSPOSE;
+  int fx = (o ^ (t ? p >> 1 : p)) & 1;
+  int fy = (o >> 1 ^ (t ? p : p >> 1)) & 1;
+  return (t ^ (p & OTRANSPOSE)) | fy << 1 | fx;
+}
+
+// Where the pixels of view img are: pixel (x, y) is
+// img->base->pixel[*off + x*(*sx) + y*(*sy)].
+static void viewLayout(Image img, ptrdiff_t* off, ptrdiff_t* sx, ptrdiff_t* sy) {
+  Image base = img->base;
+  int o = img->orient;
+  ptrdiff_t bw = base->width;
+  ptrdiff_t ax = o & 1 ? -1 : 1;     // step of base x
+  ptrdiff_t ay = o & 2 ? -bw : bw;   // step of base y
+  *off = (o & 2 ? (ptrdiff_t)(base->height - 1)*bw : 0) + (o & 1 ? bw - 1 : 0);
+  *sx = o & OTRANSPOSE ? ay : ax;
+  *sy = o & OTRANSPOSE ? ax : ay;
+}
+
+// Copy the w x h pixels src[x*sx + y*sy] to dst[y*stride + x].
+// Transposing orientations are copied in OBLOCK x OBLOCK blocks, so that
+// the source lines and the destination rows of a block stay in cache.
+static void remap(uint8* dst, size_t stride, const uint8* src,
+                  ptrdiff_t sx, ptrdiff_t sy, int w, int h) {
+  if (sx == 1 || sx == -1) {
+    for (int y = 0; y < h; y++) {
+      const uint8* s = src + y*sy;
+      uint8* d = dst + (size_t)y*stride;
+      if (sx == 1) memcpy(d, s, (size_t)w);
+      else for (int x = 0; x < w; x++) d[x] = s[-x];
+    }
+    return;
+  }
+  for (int y0 = 0; y0 < h; y0 += OBLOCK) {
+    int y1 = h - y0 < OBLOCK ? h : y0 + OBLOCK;
+    for (int x0 = 0; x0 < w; x0 += OBLOCK) {
+      int x1 = w - x0 < OBLOCK ? w : x0 + OBLOCK;
+      for (int y = y0; y < y1; y++) {
+        const uint8* s = src + y*sy;
+        uint8* d = dst + (size_t)y*stride;
+        for (int x = x0; x < x1; x++) d[x] = s[x*sx];
+      }
+    }
+  }
+}
+
+// Copy the w x h rectangle at (x, y) of view img to dst (with the given
+// row stride), without materializing img.
+static void viewCopy(Image img, int x, int y, int w, int h, uint8* dst, size_t stride) {
+  if (w == 0 || h == 0) return;
+  ptrdiff_t off, sx, sy;
+  viewLayout(img, &off, &sx, &sy);
+  remap(dst, stride, img->base->pixel + off + x*sx + y*sy, sx, sy, w, h);
+}
+
+// Remove view img from its base's list of views.
+static void viewUnlink(Image img) {
+  if (img->base == NULL) return;
+  Image* p = &img->base->views;
+  while (*p != img) p = &(*p)->next;
+  *p = img->next;
+  img->base = img->next = NULL;
+  img->orient = 0;
+}
+
+// Make view or sparse image img an ordinary image, with its own pixels in
+// raster order.  (Does nothing to other images.)
+static void materialize(Image img) {
+  if (img->tiles != NULL) sparseDensify(img);
+  if (img->base == NULL) return;
+  TraceBegin("materialize", "kernel");
+  size_t n = (size_t)img->width*img->height;
+  viewCopy(img, 0, 0, img->width, img->height, img->pixel, (size_t)img->width);
+  viewUnlink(img);
+  PIXMEM += 2*n;  // count pixel reads and writes
+  TraceEnd(2*n);
+}
 
+// Prepare img to have its pixels modified: materialize it and its views.
+static void makeWritable(Image img) {
+  materialize(img);
+  while (img->views != NULL) materialize(img->views);
 }
 
+// Create a lazy view of img with orientation o.
+// Returns the view, or NULL (errno set).
+static Image viewCreate(Image img, int o) {
+  int w = o & OTRANSPOSE ? img->height : img->width;
+  int h = o & OTRANSPOSE ? img->width : img->height;
+  if (img->tiles != NULL) materialize(img);
+  Image res = imageNew(w, h, (uint8)img->maxval, PixUndefined);
+  if (res == NULL) return NULL;
+  Image base = img->base != NULL ? img->base : img;
+  res->orient = img->base != NULL ? orientCompose(img->orient, o) : o;
+  res->base = base;
+  res->next = base->views;
+  base->views = res;
+  // Another process may change shared memory at any time: copy it now.
+  if (base->shared != NULL) materialize(res);
+  return res;
+}
+
+// Dirty rectangles
+//
+// Each image keeps up to DIRTYMAX rectangles that cover every pixel
+// written since they were last cleared, by ImageBlurUpdate, which then
+// recomputes only the blurred pixels near them.  Every operation that
+// modifies pixels in-place calls touch first.  A new rectangle is merged
+// into one it overlaps or adjoins, when the union is no larger than both,
+// so runs of single pixel or row writes build up into one rectangle; when
+// all DIRTYMAX are in use, it is merged into the one that grows least.
+
+// Area of rectangle r.
+static inline long long rectArea(Rect r) {
+  return (long long)(r.x1 - r.x0)*(r.y1 - r.y0);
+}
+
+// Smallest rectangle holding rectangles a and b.
+static inline Rect rectUnion(Rect a, Rect b) {
+  Rect u = { a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+             a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1 };
+  return u;
+}
+
+// Add rectangle r to the dirty rectangles of img.
+static void dirtyAdd(Image img, Rect r) {
+  if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+  int best = -1;
+  long long grow = LLONG_MAX;
+  for (int i = 0; i < img->ndirty; i++) {
+    Rect* d = &img->dirty[i];
+    long long u = rectArea(rectUnion(*d, r));
+    if (u <= rectArea(*d) + rectArea(r)) {   // overlapping or adjoining
+      *d = rectUnion(*d, r);
+      return;
+    }
+    if (u - rectArea(*d) < grow) {
+      grow = u - rectArea(*d);
+      best = i;
+    }
+  }
+  if (img->ndirty < DIRTYMAX) img->dirty[img->ndirty++] = r;
+  else img->dirty[best] = rectUnion(img->dirty[best], r);
+}
 
+// Record that the w x h rectangle at (x, y) of img is about to be
+// modified.  If img was blurred from another image, it no longer is.
+static void touch(Image img, int x, int y, int w, int h) {
+  Rect r = { x, y, x + w, y + h };
+  dirtyAdd(img, r);
+  if (img->filteredFrom != NULL) {
+    img->filteredFrom->filtered = NULL;
+    img->filteredFrom = NULL;
+  }
+}
 
+// touch all the pixels of img.
+static void touchAll(Image img) {
+  touch(img, 0, 0, img->width, img->height);
+}
 
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
@@ -213,12 +1200,29 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause?????.
 void ImageDestroy(Image* imgp) { ///
-  assert (*imgp != NULL);
+  assert (imgp != NULL);
   // Insert your code here!-----
 
   Image image = *imgp;
+  if (image == NULL) return;
+  // Views of it need its pixels, and it may be a view itself
+  while (image -> views != NULL) materialize(image -> views);
+  viewUnlink(image);
+  sparseFree(image);
+  if (image -> filtered != NULL) image -> filtered -> filteredFrom = NULL;
+  if (image -> filteredFrom != NULL) image -> filteredFrom -> filtered = NULL;
   // Libera a memória dos pixels
-  free(image -> pixel);
+  if (image -> shared != NULL) {
+    errsave = errno;
+    munmap(image -> shared, image -> sharedSize);
+    errno = errsave;
+  } else if (image -> sharedSize > 0) {
+    errsave = errno;
+    munmap(image -> pixel, image -> sharedSize);
+    errno = errsave;
+  } else {
+    free(image -> pixel);
+  }
   // Libera a memória da estrutura Image
   free(image);
   *imgp = NULL;
@@ -230,16 +1234,65 @@ void ImageDestroy(Image* imgp) { ///
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
+// The PGM header is parsed by hand, one character at a time, straight out
+// of the stdio buffer (getc_unlocked), instead of through several fscanf
+// calls.  The parser stops right after the single whitespace character that
+// ends the header, so the same stream may hold several concatenated images.
+
+// Skip whitespace and comments in file f.
 // Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Returns the first character after them (already consumed), or EOF.
+static int skipSpace(FILE* f) {
+  int c = getc_unlocked(f);
+  while (c == '#' || isspace(c)) {
+    if (c == '#') {
+      do { c = getc_unlocked(f); } while (c != '\n' && c != EOF);
+    }
+    c = getc_unlocked(f);
   }
-  return i;
+  return c;
+}
+
+// Parse a decimal number in [0, max], after whitespace and comments.
+// The character that ends the number is consumed and stored in *next.
+// Returns 1 on success, 0 on failure.
+static int readLong(FILE* f, long long max, long long* value, int* next) {
+  int c = skipSpace(f);
+  if (!isdigit(c)) return 0;
+  long long v = 0;
+  do {
+    if (v > (max - (c - '0')) / 10) return 0;
+    v = 10*v + (c - '0');
+    c = getc_unlocked(f);
+  } while (isdigit(c));
+  *value = v;
+  *next = c;
+  return 1;
+}
+
+// Parse a decimal number in [0, INT_MAX], as readLong.
+static int readNumber(FILE* f, int* value, int* next) {
+  long long v;
+  if (!readLong(f, INT_MAX, &v, next)) return 0;
+  *value = (int)v;
+  return 1;
+}
+
+// Parse a header with the given magic number ("P5" for PGM) from f,
+// leaving f at the first pixel.
+// Returns 1 on success; on failure, returns 0 and sets errCause.
+static int readHeader(FILE* f, const char* magic, int* w, int* h, int* maxval) {
+  int c;
+  TraceBegin("parse", "io");
+  // A comment may follow width or height immediately: push it back.
+  int success =
+  check( getc_unlocked(f) == magic[0] && getc_unlocked(f) == magic[1] , "Invalid file format" ) &&
+  check( readNumber(f, w, &c) && ungetc(c, f) == c , "Invalid width" ) &&
+  check( readNumber(f, h, &c) && ungetc(c, f) == c , "Invalid height" ) &&
+  check( readNumber(f, maxval, &c) && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( isspace(c) , "Whitespace expected" );
+  TraceEnd(0);
+  return success;
 }
 
 /// Load a raw PGM file.
@@ -248,36 +1301,21 @@ static int skipComments(FILE* f) {
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  (img = ImageLoadFrame(f)) != NULL;
 
   // Cleanup
   if (!success) {
     errsave = errno;
-    ImageDestroy(&img);
+    if (f != NULL) fclose(f);
     errno = errsave;
+    return NULL;
   }
-  if (f != NULL) fclose(f);
+  fclose(f);
   return img;
 }
 
@@ -287,37 +1325,524 @@ Image ImageLoad(const char* filename) { ///
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  ImageSaveFrame(img, f);
 
   // Cleanup
-  if (f != NULL) fclose(f);
+  if (f != NULL) {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+  }
   return success;
 }
 
+// Read exactly n bytes from file descriptor fd at offset off into buf.
+// Returns 1 on success, 0 on failure (errno set, or 0 on premature EOF).
+static int preadFull(int fd, uint8* buf, size_t n, off_t off) {
+  while (n > 0) {
+    ssize_t r = pread(fd, buf, n, off);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    buf += r;
+    off += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
 
-/// Information queries
+/// Load a rectangular region of a raw PGM file.
+/// The region is specified by the top left corner coords (x, y) and
+/// width w and height h, as in ImageCrop.
+/// Only the header and the pixels inside the region are read from the file
+/// (with positioned reads), so the cost depends on the region size only.
+/// On success, a new w x h image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a region that does not fit inside the image),
+/// returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) { ///
+  int fw = 0, fh = 0;
+  int maxval;
+  off_t start = -1;   // file offset of the first pixel
+  FILE* f = NULL;
+  Image img = NULL;
+  TraceBegin("load region", "io");
 
-/// These functions do not modify the image and never fail.
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, "P5", &fw, &fh, &maxval) &&
+  check( (start = ftello(f)) >= 0, "Seek failed" ) &&
+  check( x >= 0 && y >= 0 && w >= 0 && h >= 0 &&
+         x <= fw - w && y <= fh - h, "Invalid region" ) &&
+  check( (img = ImageCreate(w, h, (uint8)maxval)) != NULL, "Out of memory" );
+
+  // Read the region rows straight into place, skipping the columns outside.
+  // Full-width regions are contiguous in the file: read them at once.
+  int fd = success ? fileno(f) : -1;
+  int rows = (w == fw) ? 1 : h;
+  size_t len = (w == fw) ? (size_t)w*h : (size_t)w;
+  for (int j = 0; success && j < rows; j++) {
+    off_t off = start + ((off_t)(y + j)*fw + x);
+    success = check( preadFull(fd, img->pixel + (size_t)j*w, len, off), "Reading pixels" );
+  }
+  PIXMEM += (size_t)w*h;  // count pixel memory accesses
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  TraceEnd(success ? (size_t)w*h : 0);
+  return img;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+
+/// Shared memory images
+
+// A shared memory segment holds a small header with the image dimensions,
+// followed by the pixels (a raster scan, as in struct image).
+// The header takes a whole cache line so that the pixels are aligned.
+
+#define SHMMAGIC "AEDIMG1"
+
+struct shmHeader {
+  char magic[8];
+  int32_t width;
+  int32_t height;
+  int32_t maxval;
+  char pad[44];
+};
+
+// Build the shared memory object name for name in buf, adding a leading /.
+static const char* shmName(const char* name, char* buf, size_t size) {
+  if (name[0] == '/') return name;
+  snprintf(buf, size, "/%s", name);
+  return buf;
+}
+
+// Map the segment open in fd, with the given size, into an image.
+// Returns the new image, or NULL (errno/errCause set).
+static Image mapShared(int fd, size_t size) {
+  void* base = MAP_FAILED;
+  Image img = NULL;
+  struct shmHeader* hdr;
+
+  int success =
+  check( (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED,
+         "Mapping shared memory failed" ) &&
+  check( (img = malloc(sizeof(struct image))) != NULL, "Out of memory" );
+  if (!success) {
+    errsave = errno;
+    if (base != MAP_FAILED) munmap(base, size);
+    errno = errsave;
+    return NULL;
+  }
+  hdr = base;
+  img->width = hdr->width;
+  img->height = hdr->height;
+  img->maxval = hdr->maxval;
+  img->pixel = (uint8*)base + sizeof(struct shmHeader);
+  img->shared = base;
+  img->sharedSize = size;
+  img->tiles = NULL;
+  img->base = img->views = img->next = NULL;
+  img->orient = 0;
+  img->ndirty = 0;
+  img->filtered = img->filteredFrom = NULL;
+  return img;
+}
+
+/// Create a new black image in shared memory segment name.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) { ///
+  assert (name != NULL);
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  char buf[256];
+  const char* shm = shmName(name, buf, sizeof(buf));
+  size_t size = sizeof(struct shmHeader) + (size_t)width*height;
+  int fd = -1;
+  Image img = NULL;
+
+  // Unlink any old segment first, instead of truncating it, so that images
+  // already open on it stay intact.
+  errsave = errno;
+  if (shm_unlink(shm) != 0 && errno == ENOENT) errno = errsave;  // none yet
+
+  // A new segment (ftruncate) is zero-filled: the image is black already.
+  int success =
+  check( (fd = shm_open(shm, O_RDWR | O_CREAT | O_EXCL, 0666)) >= 0,
+         "Opening shared memory failed" ) &&
+  check( ftruncate(fd, (off_t)size) == 0, "Resizing shared memory failed" ) &&
+  (img = mapShared(fd, size)) != NULL;
+
+  if (success) {
+    struct shmHeader* hdr = img->shared;
+    memcpy(hdr->magic, SHMMAGIC, sizeof(hdr->magic));
+    hdr->width = img->width = width;
+    hdr->height = img->height = height;
+    hdr->maxval = img->maxval = maxval;
+  }
+  if (fd >= 0) {
+    errsave = errno;
+    close(fd);  // the mapping stays valid
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Open the image in shared memory segment name (without copying it).
+Image ImageOpenShared(const char* name) { ///
+  assert (name != NULL);
+  char buf[256];
+  struct stat st;
+  struct shmHeader hdr;
+  int fd = -1;
+  Image img = NULL;
+
+  int success =
+  check( (fd = shm_open(shmName(name, buf, sizeof(buf)), O_RDWR, 0)) >= 0,
+         "Opening shared memory failed" ) &&
+  check( fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr) &&
+         pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+         memcmp(hdr.magic, SHMMAGIC, sizeof(hdr.magic)) == 0,
+         "Invalid shared image" ) &&
+  check( hdr.width >= 0 && hdr.height >= 0 &&
+         0 < hdr.maxval && hdr.maxval <= (int)PixMax &&
+         (size_t)st.st_size >= sizeof(hdr) + (size_t)hdr.width*hdr.height,
+         "Invalid shared image" ) &&
+  (img = mapShared(fd, (size_t)st.st_size)) != NULL;
+
+  if (fd >= 0) {
+    errsave = errno;
+    close(fd);
+    errno = errsave;
+  }
+  return success ? img : NULL;
+}
+
+/// Remove shared memory segment name.
+int ImageRemoveShared(const char* name) { ///
+  assert (name != NULL);
+  char buf[256];
+  return check( shm_unlink(shmName(name, buf, sizeof(buf))) == 0,
+                "Removing shared memory failed" );
+}
+
+
+/// Multi-frame PGM streams
+
+/// Check if there are no more frames in stream f.
+/// Skips whitespace between frames.
+/// Returns nonzero at end-of-stream, 0 if another frame follows.
+int ImageEndOfStream(FILE* f) { ///
+  assert (f != NULL);
+  int c;
+  do { c = getc_unlocked(f); } while (isspace(c));
+  if (c == EOF) return 1;
+  ungetc(c, f);
+  return 0;
+}
+
+/// Load the next frame from PGM stream f.
+/// The stream is left positioned right after the frame's last pixel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadFrame(FILE* f) { ///
+  assert (f != NULL);
+  int w, h;
+  int maxval;
+  Image img = NULL;
+  TraceBegin("load", "io");
+
+  int success =
+  readHeader(f, "P5", &w, &h, &maxval) &&
+  // Allocate image
+  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  // Read pixels
+  check( fread(img->pixel, sizeof(uint8), (size_t)w*h, f) == (size_t)w*h , "Reading pixels" );
+  PIXMEM += (size_t)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  TraceEnd(success ? (size_t)w*h : 0);
+  return img;
+}
+
+/// Append image img as a new frame to PGM stream f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFrame(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  TraceBegin("save", "io");
+
+  // A lazy view or sparse image is copied a block of rows at a time,
+  // through buf (or materialized, if there is no memory for buf).
+  uint8* buf = NULL;
+  if ((img->base != NULL || img->tiles != NULL) &&
+      (buf = malloc((size_t)w*OBLOCK)) == NULL) materialize(img);
+
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" );
+  if (buf == NULL) {
+    success = success &&
+    check( fwrite(img->pixel, sizeof(uint8), (size_t)w*h, f) == (size_t)w*h, "Writing pixels failed" ); 
+  }
+  for (int y = 0; buf != NULL && success && y < h; y += OBLOCK) {
+    int n = h - y < OBLOCK ? h - y : OBLOCK;
+    if (img->tiles != NULL) sparseCopy(img, 0, y, w, n, buf, (size_t)w);
+    else viewCopy(img, 0, y, w, n, buf, (size_t)w);
+    success = check( fwrite(buf, sizeof(uint8), (size_t)w*n, f) == (size_t)w*n, "Writing pixels failed" );
+  }
+  free(buf);
+  PIXMEM += (size_t)w*h;  // count pixel memory accesses
+
+  TraceEnd((size_t)w*h);
+  return success;
+}
+
+
+/// Compressed graymap files
+
+// Compressed graymap (ZGM) files use a PGM-like text header with magic
+// number "Z5" and one extra field, the size in bytes of the compressed
+// data that follows:
+//   Z5
+//   width height
+//   maxval
+//   size
+// The pixels, in raster order, are coded as differences to the previous
+// pixel (initially 0), in a byte stream of chunks:
+//   00rrrrrr           run: repeat previous pixel r+1 times (1..64)
+//   01rrrrrr rrrrrrrr  long run: repeat previous pixel r+65 times
+//   10aaabbb           two pixels with differences a-4 and b-4 (-4..3)
+//   11nnnnnn ...       n+1 literal pixels follow (1..64)
+// Flat areas and masks collapse into runs, smooth gradients take half a
+// byte per pixel, and noise costs at most 1/64 more than raw.
+// Decoding only does memset, memcpy and byte adds, so it is much faster
+// than reading the raw pixels from disk.
+
+#define ZRUN   0x00
+#define ZLRUN  0x40
+#define ZDIFF2 0x80
+#define ZLIT   0xC0
+#define ZLRUNMAX (65 + 0x3FFF)
+
+// Worst case compressed size for n pixels.
+static size_t zBound(size_t n) {
+  return n + n/64 + 2;
+}
+
+// Is d a difference that fits in a ZDIFF2 chunk?
+static inline int zSmall(int d) {
+  return -4 <= d && d <= 3;
+}
+
+// Compress n pixels from src into dst (with room for zBound(n) bytes).
+// Returns the compressed size.
+static size_t zEncode(const uint8* src, size_t n, uint8* dst) {
+  TraceBegin("encode", "kernel");
+  uint8* out = dst;
+  int prev = 0;
+  size_t i = 0;
+  while (i < n) {
+    // Run of pixels equal to the previous one?  (A run of one is only
+    // taken if it does not start a ZDIFF2 pair, which covers two pixels.)
+    size_t r = i;
+    while (r < n && src[r] == prev) r++;
+    int pair = i + 1 < n && zSmall(src[i] - prev) && zSmall(src[i+1] - src[i]);
+    if (r > i + 1 || (r > i && !pair)) {
+      size_t len = r - i;
+      while (len >= 65) {
+        size_t l = len < ZLRUNMAX ? len : ZLRUNMAX;
+        *out++ = (uint8)(ZLRUN | (l - 65) >> 8);
+        *out++ = (uint8)(l - 65);
+        len -= l;
+      }
+      if (len > 0) *out++ = (uint8)(ZRUN | (len - 1));
+      i = r;
+      continue;
+    }
+    // Two small differences?
+    if (pair) {
+      *out++ = (uint8)(ZDIFF2 | (src[i] - prev + 4) << 3 | (src[i+1] - src[i] + 4));
+      prev = src[i+1];
+      i += 2;
+      continue;
+    }
+    // Literals, until a run of 2 or a ZDIFF2 pair comes along.  The chunk
+    // that follows takes one byte for two pixels or more, so it pays for
+    // the literal chunk header: only the headers of full (64 pixel) chunks
+    // and of the last one are extra, hence zBound.
+    size_t l = i + 1;
+    while (l < n && l - i < 64 &&
+           !(l + 1 < n && src[l] == src[l-1] && src[l+1] == src[l]) &&
+           !(l + 1 < n && zSmall(src[l] - src[l-1]) && zSmall(src[l+1] - src[l]))) {
+      l++;
+    }
+    *out++ = (uint8)(ZLIT | (l - i - 1));
+    memcpy(out, src + i, l - i);
+    out += l - i;
+    prev = src[l-1];
+    i = l;
+  }
+  assert ((size_t)(out - dst) <= zBound(n));
+  TraceEnd(n + (size_t)(out - dst));
+  return (size_t)(out - dst);
+}
+
+// Decompress exactly n pixels into dst from the size bytes in src.
+// Returns 1 on success, 0 if the data is corrupt.
+static int zDecodeChunks(const uint8* src, size_t size, uint8* dst, size_t n) {
+  const uint8* end = src + size;
+  size_t i = 0;
+  uint8 prev = 0;
+  while (i < n && src < end) {
+    int tag = *src++;
+    size_t len;
+    switch (tag & 0xC0) {
+    case ZRUN:
+      len = (size_t)(tag & 0x3F) + 1;
+      if (len > n - i) return 0;
+      memset(dst + i, prev, len);
+      i += len;
+      break;
+    case ZLRUN:
+      if (src == end) return 0;
+      len = ((size_t)(tag & 0x3F) << 8 | *src++) + 65;
+      if (len > n - i) return 0;
+      memset(dst + i, prev, len);
+      i += len;
+      break;
+    case ZDIFF2:
+      if (n - i < 2) return 0;
+      dst[i] = prev = (uint8)(prev + ((tag >> 3) & 7) - 4);
+      dst[i+1] = prev = (uint8)(prev + (tag & 7) - 4);
+      i += 2;
+      break;
+    default:  // ZLIT
+      len = (size_t)(tag & 0x3F) + 1;
+      if (len > n - i || len > (size_t)(end - src)) return 0;
+      memcpy(dst + i, src, len);
+      src += len;
+      i += len;
+      prev = dst[i-1];
+      break;
+    }
+  }
+  return i == n && src == end;
+}
+
+// zDecodeChunks, traced.
+static int zDecode(const uint8* src, size_t size, uint8* dst, size_t n) {
+  TraceBegin("decode", "kernel");
+  int success = zDecodeChunks(src, size, dst, n);
+  TraceEnd(size + n);
+  return success;
+}
+
+/// Load a compressed graymap (ZGM) file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) { ///
+  int w, h;
+  int maxval;
+  long long size;
+  int c;
+  FILE* f = NULL;
+  uint8* data = NULL;
+  Image img = NULL;
+  TraceBegin("load compressed", "io");
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, "Z5", &w, &h, &maxval) &&
+  check( readLong(f, LLONG_MAX, &size, &c) && isspace(c) &&
+         (unsigned long long)size <= SIZE_MAX , "Invalid size" ) &&
+  check( (data = malloc((size_t)size)) != NULL || size == 0 , "Out of memory" ) &&
+  check( fread(data, 1, (size_t)size, f) == (size_t)size , "Reading data" ) &&
+  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  check( zDecode(data, (size_t)size, img->pixel, (size_t)w*h) , "Corrupt data" );
+  PIXMEM += (size_t)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  free(data);
+  if (f != NULL) fclose(f);
+  TraceEnd(success ? (size_t)size : 0);
+  return img;
+}
+
+/// Save image to a compressed graymap (ZGM) file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  size_t n = (size_t)w*h;
+  size_t size = 0;
+  FILE* f = NULL;
+  uint8* data = NULL;
+  TraceBegin("save compressed", "io");
+  materialize(img);
+
+  int success =
+  check( (data = malloc(zBound(n))) != NULL , "Out of memory" ) &&
+  (size = zEncode(img->pixel, n, data), 1) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "Z5\n%d %d\n%u\n%zu\n", w, h, maxval, size) > 0, "Writing header failed" ) &&
+  check( fwrite(data, 1, size, f) == size, "Writing data failed" );
+  PIXMEM += n;  // count pixel memory accesses
+
+  // Cleanup
+  errsave = errno;
+  free(data);
+  if (f != NULL && fclose(f) != 0 && success) {
+    success = check( 0, "Writing data failed" );
+    errsave = errno;
+  }
+  errno = errsave;
+  TraceEnd(success ? (size_t)size : 0);
+  return success;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
 }
 
 /// Get image maximum gray level
@@ -326,29 +1851,347 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+// mn[i] = min(mn[i], p[i]) and mx[i] = max(mx[i], p[i]), for i in [0, 32).
+static inline void minMax32(uint8* restrict mn, uint8* restrict mx, const uint8* restrict p) {
+  for (int i = 0; i < 32; i++) {
+    mn[i] = p[i] < mn[i] ? p[i] : mn[i];
+    mx[i] = p[i] > mx[i] ? p[i] : mx[i];
+  }
+}
+
+// Update *lo and *hi with the minimum and maximum of p[0..n-1].
+// Works on 32 pixels at a time, in a loop that the compiler vectorizes.
+static void rowMinMax(const uint8* p, int n, uint8* lo, uint8* hi) {
+  uint8 mn[32], mx[32];
+  memset(mn, *lo, sizeof(mn));
+  memset(mx, *hi, sizeof(mx));
+  int x = 0;
+  for (; x + 32 <= n; x += 32) minMax32(mn, mx, p + x);
+  for (; x < n; x++) {
+    mn[0] = p[x] < mn[0] ? p[x] : mn[0];
+    mx[0] = p[x] > mx[0] ? p[x] : mx[0];
+  }
+  for (int i = 0; i < 32; i++) {
+    if (mn[i] < *lo) *lo = mn[i];
+    if (mx[i] > *hi) *hi = mx[i];
+  }
+}
+
+// Partial ranges of the rows of an image.
+typedef struct {
+  Image img;
+  uint8 lo[MAXTHREADS], hi[MAXTHREADS];
+} StatsJob;
+
+// Update job->lo[worker] and job->hi[worker] with rows [y0, y1).
+static void statsBand(int y0, int y1, int worker, void* arg) {
+  StatsJob* job = arg;
+  Image img = job->img;
+  for (int y = y0; y < y1; y++) {
+    rowMinMax(img->pixel + (size_t)y*img->width, img->width, &job->lo[worker], &job->hi[worker]);
+  }
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (For an empty image, both are set to 0.)
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
-  // Insert your code here!---
-  // Variável para armazenar o valor do pixel
-  uint8 pix;
+  if (verifying()) { verifyStats(img, min, max); return; }
+  TraceBegin("ImageStats", "kernel");
+  // (The range does not depend on the orientation: scan a view's base.)
+  Image src = img->base != NULL ? img->base : img;
+  uint8 lo = PixMax, hi = 0;
+  if (src->tiles == NULL) {
+    StatsJob job;
+    job.img = src;
+    memset(job.lo, PixMax, sizeof(job.lo));
+    memset(job.hi, 0, sizeof(job.hi));
+    ImageParallelFor(src->height, rowGrain(src->width, src->height), statsBand, &job);
+    for (int i = 0; i < MAXTHREADS; i++) {
+      if (job.lo[i] < lo) lo = job.lo[i];
+      if (job.hi[i] > hi) hi = job.hi[i];
+    }
+  }
+  for (int ty = 0; src->tiles != NULL && ty < tileCount(src->height); ty++) {
+    for (int tx = 0; tx < tileCount(src->width); tx++) {
+      const uint8* t = sparseTile(src, tx, ty, 0);
+      int tw = src->width - tx*STILE < STILE ? src->width - tx*STILE : STILE;
+      int th = src->height - ty*STILE < STILE ? src->height - ty*STILE : STILE;
+      if (t == NULL) lo = 0;   // black
+      for (int j = 0; t != NULL && j < th; j++) rowMinMax(t + j*STILE, tw, &lo, &hi);
+    }
+  }
+  if (lo > hi) lo = hi = 0;   // empty image
+  *min = lo;
+  *max = hi;
+  PIXMEM += (size_t)img->width*img->height;  // count pixel reads
+  TraceEnd((size_t)img->width*img->height);
+}
+
+// Partial histograms of the rows of an image.
+typedef struct {
+  Image img;
+  size_t hist[MAXTHREADS][256];
+} HistJob;
+
+// Add the pixels of rows [y0, y1) to job->hist[worker].
+// Consecutive pixels go to different partial histograms, so that runs of
+// equal pixels (which are common) do not wait on each other's increments.
+static void histBand(int y0, int y1, int worker, void* arg) {
+  HistJob* job = arg;
+  uint32_t part[4][256];
+  memset(part, 0, sizeof(part));
+  int w = job->img->width;
+  size_t* hist = job->hist[worker];
+  size_t pending = 0;   // pixels in part since the last flush
+  for (int y = y0; y < y1; y++) {
+    const uint8* p = job->img->pixel + (size_t)y*w;
+    int x = 0;
+    for (; x + 4 <= w; x += 4) {
+      part[0][p[x]]++;
+      part[1][p[x+1]]++;
+      part[2][p[x+2]]++;
+      part[3][p[x+3]]++;
+    }
+    for (; x < w; x++) part[0][p[x]]++;
+    // Flush at the end, or before a 32-bit count might overflow
+    pending += w;
+    if (y == y1 - 1 || pending + w > UINT32_MAX) {
+      for (int v = 0; v < 256; v++) {
+        hist[v] += (size_t)part[0][v] + part[1][v] + part[2][v] + part[3][v];
+      }
+      memset(part, 0, sizeof(part));
+      pending = 0;
+    }
+  }
+}
 
-  // Percorre cada pixel na imagem
-  for (int x = 0;x <img -> width;x++){
-    for(int y = 0;y<img->height;y++){
-      // Valor do pixel na posição (x, y)
-      pix = ImageGetPixel(img, x, y);
-      // Atualiza o valor mínimo ou maior
-      if (pix > *max) {*max = pix;}
-      if (pix < *min) {*min = pix;}
+// Compute the histogram of sparse image img, tile by tile.
+static void sparseHistogram(Image img, size_t hist[256]) {
+  memset(hist, 0, 256*sizeof(size_t));
+  for (int ty = 0; ty < tileCount(img->height); ty++) {
+    for (int tx = 0; tx < tileCount(img->width); tx++) {
+      const uint8* t = sparseTile(img, tx, ty, 0);
+      int tw = img->width - tx*STILE < STILE ? img->width - tx*STILE : STILE;
+      int th = img->height - ty*STILE < STILE ? img->height - ty*STILE : STILE;
+      if (t == NULL) hist[0] += (size_t)tw*th;   // black
+      for (int j = 0; t != NULL && j < th; j++) {
+        for (int i = 0; i < tw; i++) hist[t[j*STILE + i]]++;
+      }
     }
   }
 }
 
+/// Compute the histogram of img.
+void ImageHistogram(Image img, size_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  if (verifying()) { verifyHistogram(img, hist); return; }
+  TraceBegin("ImageHistogram", "kernel");
+  // (The histogram does not depend on the orientation: count a view's base.)
+  Image src = img->base != NULL ? img->base : img;
+  if (src->tiles != NULL) {
+    sparseHistogram(src, hist);
+    PIXMEM += (size_t)img->width*img->height;  // count pixel reads
+    TraceEnd((size_t)img->width*img->height);
+    return;
+  }
+  HistJob* job = calloc(1, sizeof(HistJob));
+  if (job != NULL) {   // (if there is no room for partials, count directly)
+    job->img = src;
+    ImageParallelFor(src->height, rowGrain(src->width, src->height), histBand, job);
+  }
+  memset(hist, 0, 256*sizeof(size_t));
+  for (int i = 0; job != NULL && i < MAXTHREADS; i++) {
+    for (int v = 0; v < 256; v++) hist[v] += job->hist[i][v];
+  }
+  if (job == NULL) {
+    size_t n = (size_t)img->width*img->height;
+    for (size_t i = 0; i < n; i++) hist[src->pixel[i]]++;
+  }
+  free(job);
+  PIXMEM += (size_t)img->width*img->height;  // count pixel reads
+  TraceEnd((size_t)img->width*img->height);
+}
+
+/// Compute the statistics of img in one pass.
+void ImageStatsFull(Image img, ImageStatistics* st) { ///
+  assert (img != NULL);
+  assert (st != NULL);
+  if (verifying()) { verifyStatsFull(img, st); return; }
+  ImageHistogram(img, st->hist);
+  // Everything else follows from the histogram, exactly
+  size_t n = 0;
+  uint64_t sum = 0;
+  int lo = -1, hi = 0;
+  for (int v = 0; v < 256; v++) {
+    if (st->hist[v] == 0) continue;
+    if (lo < 0) lo = v;
+    hi = v;
+    n += st->hist[v];
+    sum += (uint64_t)v*st->hist[v];
+  }
+  st->count = n;
+  st->min = (uint8)(lo < 0 ? 0 : lo);
+  st->max = (uint8)hi;
+  st->mean = n > 0 ? (double)sum / n : 0.0;
+  double var = 0.0;
+  for (int v = lo < 0 ? 256 : lo; v <= hi; v++) {
+    var += (v - st->mean)*(v - st->mean)*st->hist[v];
+  }
+  st->variance = n > 0 ? var / n : 0.0;
+}
+
+// Content hash
+//
+// ImageHash is XXH64 (see github.com/Cyan4973/xxHash) of the pixels in
+// raster order, seeded with the seed and the image geometry.  The state
+// is kept between blocks of rows, so views and sparse images are hashed
+// through a small buffer, with the same result as their dense copies.
+
+#define XPRIME1 0x9E3779B185EBCA87ull
+#define XPRIME2 0xC2B2AE3D27D4EB4Full
+#define XPRIME3 0x165667B19E3779F9ull
+#define XPRIME4 0x85EBCA77C2B2AE63ull
+#define XPRIME5 0x27D4EB2F165667C5ull
+
+typedef struct {
+  uint64_t acc[4];
+  uint8 buf[32];    // bytes not yet in a full stripe
+  size_t nbuf;
+  uint64_t total;   // bytes hashed
+  uint64_t seed;
+} XXH64State;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));   // (little-endian hosts only)
+  return v;
+}
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t in) {
+  return rotl64(acc + in*XPRIME2, 31) * XPRIME1;
+}
+
+static inline uint64_t xxMerge(uint64_t h, uint64_t acc) {
+  return (h ^ xxRound(0, acc))*XPRIME1 + XPRIME4;
+}
+
+static void xxInit(XXH64State* s, uint64_t seed) {
+  s->acc[0] = seed + XPRIME1 + XPRIME2;
+  s->acc[1] = seed + XPRIME2;
+  s->acc[2] = seed;
+  s->acc[3] = seed - XPRIME1;
+  s->nbuf = 0;
+  s->total = 0;
+  s->seed = seed;
+}
+
+// Hash 32-byte stripes of p[0..n-1]; returns the number of bytes used.
+static size_t xxStripes(uint64_t acc[4], const uint8* p, size_t n) {
+  uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    a0 = xxRound(a0, read64(p + i));
+    a1 = xxRound(a1, read64(p + i + 8));
+    a2 = xxRound(a2, read64(p + i + 16));
+    a3 = xxRound(a3, read64(p + i + 24));
+  }
+  acc[0] = a0; acc[1] = a1; acc[2] = a2; acc[3] = a3;
+  return i;
+}
+
+static void xxUpdate(XXH64State* s, const uint8* p, size_t n) {
+  s->total += n;
+  if (s->nbuf > 0) {   // complete the buffered stripe first
+    size_t m = 32 - s->nbuf < n ? 32 - s->nbuf : n;
+    memcpy(s->buf + s->nbuf, p, m);
+    s->nbuf += m;
+    p += m;
+    n -= m;
+    if (s->nbuf < 32) return;
+    xxStripes(s->acc, s->buf, 32);
+    s->nbuf = 0;
+  }
+  size_t used = xxStripes(s->acc, p, n);
+  memcpy(s->buf, p + used, n - used);
+  s->nbuf = n - used;
+}
+
+static uint64_t xxDigest(const XXH64State* s) {
+  uint64_t h;
+  if (s->total >= 32) {
+    h = rotl64(s->acc[0], 1) + rotl64(s->acc[1], 7) +
+        rotl64(s->acc[2], 12) + rotl64(s->acc[3], 18);
+    for (int i = 0; i < 4; i++) h = xxMerge(h, s->acc[i]);
+  } else {
+    h = s->seed + XPRIME5;
+  }
+  h += s->total;
+  const uint8* p = s->buf;
+  size_t n = s->nbuf;
+  for (; n >= 8; p += 8, n -= 8) {
+    h ^= xxRound(0, read64(p));
+    h = rotl64(h, 27)*XPRIME1 + XPRIME4;
+  }
+  if (n >= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    h ^= (uint64_t)v*XPRIME1;
+    h = rotl64(h, 23)*XPRIME2 + XPRIME3;
+    p += 4;
+    n -= 4;
+  }
+  for (; n > 0; p++, n--) {
+    h ^= *p*XPRIME5;
+    h = rotl64(h, 11)*XPRIME1;
+  }
+  h ^= h >> 33;
+  h *= XPRIME2;
+  h ^= h >> 29;
+  h *= XPRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+/// Compute a 64-bit hash of the contents of img (its size, maxval and
+/// pixels), starting from seed.
+uint64_t ImageHash(Image img, uint64_t seed) { ///
+  assert (img != NULL);
+  if (verifying()) return verifyHash(img, seed);
+  TraceBegin("ImageHash", "kernel");
+  int w = img->width, h = img->height;
+  // (Geometry goes in the seed, so that equal pixels in other shapes differ.)
+  seed ^= ((uint64_t)w << 40 ^ (uint64_t)h << 8 ^ (uint64_t)img->maxval)*XPRIME3;
+  XXH64State s;
+  xxInit(&s, seed);
+
+  uint8* buf = NULL;
+  if ((img->base != NULL || img->tiles != NULL) &&
+      (buf = malloc((size_t)w*OBLOCK)) == NULL) materialize(img);
+  if (buf == NULL) {
+    xxUpdate(&s, img->pixel, (size_t)w*h);
+  }
+  for (int y = 0; buf != NULL && y < h; y += OBLOCK) {
+    int n = h - y < OBLOCK ? h - y : OBLOCK;
+    if (img->tiles != NULL) sparseCopy(img, 0, y, w, n, buf, (size_t)w);
+    else viewCopy(img, 0, y, w, n, buf, (size_t)w);
+    xxUpdate(&s, buf, (size_t)w*n);
+  }
+  free(buf);
+  PIXMEM += (size_t)w*h;  // count pixel reads
+  TraceEnd((size_t)w*h);
+  return xxDigest(&s);
+}
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) { ///
   assert (img != NULL);
@@ -368,7 +2211,8 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   // Variável para indicar se a área retangular é válida
   int valid_rect = 0;
 
-  if (x + w <= img -> width && y + h <= img -> height){valid_rect = 1;}
+  // (subtrair evita overflow de x + w junto a INT_MAX)
+  if (w <= img -> width - x && h <= img -> height - y){valid_rect = 1;}
   return valid_rect; // 1 se a área retangular é válida, 0 caso contrário
 
 }
@@ -383,17 +2227,17 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
 // The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   // Insert your code here! -------
 
 //For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
 
-  index = y * img -> width + x;
+  index = (size_t)y * img -> width + x;
 
-  assert (0 <= index && index < img->width*img->height);
+  assert (index < (size_t)img->width*img->height);
   return index;
 }
 
@@ -402,6 +2246,15 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (read)
+  if (img->base != NULL) {  // a lazy view: read through its orientation
+    ptrdiff_t off, sx, sy;
+    viewLayout(img, &off, &sx, &sy);
+    return img->base->pixel[off + x*sx + y*sy];
+  }
+  if (img->tiles != NULL) {  // a sparse image: read its tile, if any
+    const uint8* t = sparseTile(img, x / STILE, y / STILE, 0);
+    return t != NULL ? t[(y % STILE)*STILE + x % STILE] : 0;
+  }
   return img->pixel[G(img, x, y)];
 } 
 
@@ -410,10 +2263,66 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
+  touch(img, x, y, 1, 1);
+  if (img->tiles != NULL) {  // a sparse image: write its tile
+    uint8* t = sparseTile(img, x / STILE, y / STILE, level != 0);
+    if (t != NULL) t[(y % STILE)*STILE + x % STILE] = level;
+    if (t != NULL || level == 0) return;   // (a missing tile is black)
+  }
+  makeWritable(img);   // (or no memory for the tile: use the raster)
   img->pixel[G(img, x, y)] = level;
 } 
 
 
+/// Row access operations
+
+/// Get a pointer to the first pixel of row y.
+uint8* ImageRowPtr(Image img, int y) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  PIXMEM += (size_t)img->width;  // count one access per pixel
+  makeWritable(img);   // (the caller may write through the pointer)
+  touch(img, 0, y, img->width, 1);
+  return img->pixel + (size_t)y*img->width;
+}
+
+/// Copy the w pixels from (x,y) to (x+w-1,y) into buf.
+void ImageGetRow(Image img, int x, int y, int w, uint8* buf) { ///
+  assert (img != NULL);
+  assert (buf != NULL || w == 0);
+  assert (0 <= x && 0 <= w && x <= img->width - w);
+  assert (0 <= y && y < img->height);
+  PIXMEM += (size_t)w;  // count w pixel reads
+  if (img->base != NULL) viewCopy(img, x, y, w, 1, buf, (size_t)w);
+  else if (img->tiles != NULL) sparseCopy(img, x, y, w, 1, buf, (size_t)w);
+  else memcpy(buf, img->pixel + (size_t)y*img->width + x, (size_t)w);
+}
+
+/// Copy the w pixels in buf to positions (x,y) to (x+w-1,y).
+void ImageSetRow(Image img, int x, int y, int w, const uint8* buf) { ///
+  assert (img != NULL);
+  assert (buf != NULL || w == 0);
+  assert (0 <= x && 0 <= w && x <= img->width - w);
+  assert (0 <= y && y < img->height);
+  PIXMEM += (size_t)w;  // count w pixel writes
+  makeWritable(img);
+  touch(img, x, y, w, 1);
+  memcpy(img->pixel + (size_t)y*img->width + x, buf, (size_t)w);
+}
+
+/// Call fn for every row of img, from top to bottom.
+void ImageForEachRow(Image img, ImageRowFn fn, void* arg) { ///
+  assert (img != NULL);
+  assert (fn != NULL);
+  makeWritable(img);
+  touchAll(img);
+  for (int y = 0; y < img->height; y++) {
+    fn(y, img->pixel + (size_t)y*img->width, img->width, arg);
+  }
+  PIXMEM += (size_t)img->width*img->height;  // one access per pixel
+}
+
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -421,41 +2330,118 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+// Negative and threshold work on NCHUNK pixels at a time, in loops that
+// the compiler vectorizes, over chunks of rows in parallel.
 
-/// Transform image to negative image.
-/// This transforms dark pixels to light pixels and vice-versa,
-/// resulting in a "photographic negative" effect.
+#define NCHUNK 64
 
-void ImageNegative(Image img) { ///
-  assert (img != NULL);
-  uint8 pix_og;// Variável para armazenar o valor original do pixel
-  // Insert your code here!----
-  for (int x = 0;x <img -> width;x++){
-    for(int y = 0;y<img->height;y++){
-      pix_og = ImageGetPixel(img,x,y);// Valor original do pixel na posição (x, y)
-      ImageSetPixel(img,x,y,img -> maxval - pix_og); // Define o valor do pixel como o complemento em relação ao valor máximo
-      }
+typedef struct {
+  Image img;
+  int negative;   // or else, threshold at thr
+  uint8 thr;
+} PointJob;
+
+// p[i] = maxval - p[i], for i in [0, NCHUNK).
+static inline void negChunk(uint8* restrict p, uint8 maxval) {
+  for (int i = 0; i < NCHUNK; i++) p[i] = maxval - p[i];
+}
+
+// p[i] = p[i] >= thr ? maxval : 0, for i in [0, NCHUNK).
+static inline void thrChunk(uint8* restrict p, uint8 thr, uint8 maxval) {
+  for (int i = 0; i < NCHUNK; i++) p[i] = p[i] >= thr ? maxval : 0;
+}
+
+// Transform rows [y0, y1) of job->img.
+static void pointBand(int y0, int y1, int worker, void* arg) {
+  PointJob* job = arg;
+  Image img = job->img;
+  uint8 maxval = (uint8)img->maxval, thr = job->thr;
+  for (int y = y0; y < y1; y++) {
+    uint8* p = img->pixel + (size_t)y*img->width;
+    int n = img->width, x = 0;
+    if (job->negative) {
+      for (; x + NCHUNK <= n; x += NCHUNK) negChunk(p + x, maxval);
+      for (; x < n; x++) p[x] = maxval - p[x];
+    } else {
+      for (; x + NCHUNK <= n; x += NCHUNK) thrChunk(p + x, thr, maxval);
+      for (; x < n; x++) p[x] = p[x] >= thr ? maxval : 0;
+    }
   }
 }
 
-/// Apply threshold to image.
-/// Transform all pixels with level<thr to black (0) and
-/// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
+// Apply a negative or threshold job to its image.
+static void pointApply(PointJob* job) {
+  Image img = job->img;
+  makeWritable(img);
+  touchAll(img);
+  ImageParallelFor(img->height, rowGrain(img->width, img->height), pointBand, job);
+  PIXMEM += 2*(size_t)img->width*img->height;  // count pixel reads and writes
+}
+
+// Lookup tables
+//
+// Level-to-level transformations are tabulated in a 256-entry LUT, built
+// from their parameters or from one statistics pass, and applied in one pass over the rows.
+// Table lookups do not vectorize, but the LUT stays in L1 and the row loop
+// is unrolled so that independent loads overlap.
+
+typedef struct {
+  Image img;
+  const uint8* lut;
+} LutJob;
+
+// p[x] = lut[p[x]], for x in [0, n).
+static void rowLUT(uint8* restrict p, int n, const uint8* restrict lut) {
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    uint8 a = lut[p[x]],   b = lut[p[x+1]], c = lut[p[x+2]], d = lut[p[x+3]];
+    uint8 e = lut[p[x+4]], f = lut[p[x+5]], g = lut[p[x+6]], h = lut[p[x+7]];
+    p[x] = a;   p[x+1] = b; p[x+2] = c; p[x+3] = d;
+    p[x+4] = e; p[x+5] = f; p[x+6] = g; p[x+7] = h;
+  }
+  for (; x < n; x++) p[x] = lut[p[x]];
+}
+
+static void lutBand(int y0, int y1, int worker, void* arg) {
+  LutJob* job = arg;
+  int w = job->img->width;
+  for (int y = y0; y < y1; y++) {
+    rowLUT(job->img->pixel + (size_t)y*w, w, job->lut);
+  }
+}
+
+// Replace every pixel level v of img by lut[v].
+static void applyLUT(Image img, const uint8 lut[256]) {
+  makeWritable(img);
+  touchAll(img);
+  LutJob job = { img, lut };
+  ImageParallelFor(img->height, rowGrain(img->width, img->height), lutBand, &job);
+  PIXMEM += 2*(size_t)img->width*img->height;  // count pixel reads and writes
+}
+
+/// Transform image to negative image.
+/// This transforms dark pixels to light pixels and vice-versa,
+/// resulting in a "photographic negative" effect.
+
+void ImageNegative(Image img) { ///
   assert (img != NULL);
-// Insert your code here!----------
-  for (int x = 0;x < img -> width;x++){
-    for(int y = 0;y < img->height;y++){
-      
-      if (ImageGetPixel(img,x,y) >= thr){
-        ImageSetPixel(img,x,y,img -> maxval);// Define o pixel como branco (maxval) se o valor for maior ou igual ao thr
-      }
-      else {
-        ImageSetPixel(img,x,y,0);// Define o pixel como preto (0) se o valor for menor que thr
-      }
-    }
-  
+  if (verifying()) { verifyNegative(img); return; }
+  TraceBegin("ImageNegative", "kernel");
+  PointJob job = { img, 1, 0 };
+  pointApply(&job);
+  TraceEnd(2*(size_t)img->width*img->height);
 }
+
+/// Apply threshold to image.
+/// Transform all pixels with level<thr to black (0) and
+/// all pixels with level>=thr to white (maxval).
+void ImageThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  if (verifying()) { verifyThreshold(img, thr); return; }
+  TraceBegin("ImageThreshold", "kernel");
+  PointJob job = { img, 0, thr };
+  pointApply(&job);
+  TraceEnd(2*(size_t)img->width*img->height);
 }
 
 //pixmen pixops calltime time 
@@ -468,16 +2454,59 @@ void ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
   assert (factor >= 0.0);
   assert (factor <= 1.0);
-  // Insert your code here!---------
-  uint8 pix_og,pix_new;// Variáveis para armazenar o valor original e o novo valor do pixel
-  for (int x = 0;x < img -> width;x++){
-    for(int y = 0;y < img->height;y++){
-      pix_og = ImageGetPixel(img,x,y);// Valor original do pixel na posição (x, y)
-      pix_new = pix_og * factor + 0.5;// Calcula o novo valor do pixel multiplicando pelo fator e adicionando 0.5 para arredondamento
-      
-      ImageSetPixel(img,x,y,(pix_new > img->maxval) ? img->maxval : pix_new);// Satura o novo valor do pixel em maxval, se for maior que maxval
+  if (verifying()) { verifyBrighten(img, factor); return; }
+  TraceBegin("ImageBrighten", "kernel");
+  // Tabulate the new level of each level, then apply the table
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    uint8 level = v*factor + 0.5;
+    lut[v] = level > img->maxval ? img->maxval : level;
+  }
+  applyLUT(img, lut);
+  TraceEnd(2*(size_t)img->width*img->height);
+}
+
+/// Equalize the histogram of an image.
+void ImageEqualize(Image img) { ///
+  assert (img != NULL);
+  if (verifying()) { verifyEqualize(img); return; }
+  TraceBegin("ImageEqualize", "kernel");
+  size_t hist[256];
+  ImageHistogram(img, hist);
+  // Map each level to its cumulative frequency, counted from the lowest
+  // level present, which maps to 0; the highest one maps to maxval.
+  size_t n = 0, first = 0;
+  for (int v = 0; v < 256; v++) {
+    n += hist[v];
+    if (first == 0) first = hist[v];
+  }
+  uint8 lut[256];
+  size_t cum = 0;
+  for (int v = 0; v < 256; v++) {
+    cum += hist[v];
+    lut[v] = (uint8)(n > first ?
+        ((double)(cum > first ? cum - first : 0)*img->maxval / (n - first) + 0.5) : v);
+  }
+  if (n > first) applyLUT(img, lut);   // else: a single level, nothing to do
+  TraceEnd(3*(size_t)img->width*img->height);
+}
+
+/// Stretch the contrast of an image to the full range.
+void ImageStretch(Image img) { ///
+  assert (img != NULL);
+  if (verifying()) { verifyStretch(img); return; }
+  TraceBegin("ImageStretch", "kernel");
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+  if (max > min && (min > 0 || max < img->maxval)) {
+    uint8 lut[256];
+    for (int v = 0; v < 256; v++) {
+      int d = v < min ? 0 : v > max ? max - min : v - min;
+      lut[v] = (uint8)((2*d*img->maxval + (max - min)) / (2*(max - min)));
     }
+    applyLUT(img, lut);
   }
+  TraceEnd(3*(size_t)img->width*img->height);
 }
 
 
@@ -510,27 +2539,14 @@ void ImageBrighten(Image img, double factor) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!-----------
-
-    // Cria uma nova imagem com largura e altura trocadas
-  Image img_new = ImageCreate(img->height, img->width, img->maxval);
-  if(img_new == NULL){
-    errno = ENOMEM;
-    return NULL;
-    }
-
-  for (int x = 0; x < img->width; x++) {
-    for (int y = 0; y < img->height; y++) {
-      uint8 pix_og = ImageGetPixel(img, x, y);   // Valor original do pixel na posição (x, y)
-      ImageSetPixel(img_new, y, img->width - 1 - x, pix_og);// Define o pixel na nova imagem trocando as coordenadas x e y e invertendo a direção
-    }
-  }
+  if (verifying()) return verifyRotate(img);
+  TraceBegin("ImageRotate", "kernel");
+  // A lazy view: (x, y) shows (w-1-y, x) of img
+  Image img_new = viewCreate(img, OTRANSPOSE | 1);
+  TraceEnd(0);
   return img_new;
 }
 
-
-
-
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -540,21 +2556,11 @@ Image ImageRotate(Image img) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly-FALTA.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!-----------
-
-  // Cria uma nova imagem com as mesmas dimensões
-  Image img_new = ImageCreate(img -> width,img -> height,img -> maxval);
-  if (img_new == NULL) { 
-    errno = ENOMEM;
-    return NULL;}
-
-  uint8 pix_og;// Variável para armazenar o valor original do pixel
-  for (int x = 0;x < img -> width;x++){
-    for(int y = 0;y < img->height;y++){
-      pix_og = ImageGetPixel(img,x,y);
-      ImageSetPixel(img_new,img -> width - x - 1,y,pix_og);// Define o pixel na nova imagem refletindo em relação ao eixo vertical
-    }
-  }
+  if (verifying()) return verifyMirror(img);
+  TraceBegin("ImageMirror", "kernel");
+  // A lazy view: (x, y) shows (w-1-x, y) of img
+  Image img_new = viewCreate(img, 1);
+  TraceEnd(0);
   return img_new;
 }
 
@@ -573,29 +2579,409 @@ Image ImageMirror(Image img) { ///
 Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
+  if (verifying()) return verifyCrop(img, x, y, w, h);
   // Insert your code here!------
 
 // Cria uma nova imagem para armazenar a região recortada
-  Image img_new = ImageCreate(w,h,img -> maxval);
+  Image img_new = imageNew(w,h,img -> maxval,PixUndefined);
   if (img_new == NULL) { 
     errno = ENOMEM;
     return NULL;}
 
-  uint8 pix_og;// Variável para armazenar o valor original do pixel
+  TraceBegin("ImageCrop", "kernel");
 
-  // Itera sobre a região especificada na imagem original
-  for (int i = 0;i < w;i++){
-    for(int j = 0;j < h;j++){
-      pix_og = ImageGetPixel(img,i + x,j + y);// Obtém o valor original do pixel na posição (i + x, j + y)
-      ImageSetPixel(img_new,i,j,pix_og);// Define o pixel na nova imagem
+  // Copia a região linha a linha (de uma vista, pela sua orientação)
+  if (img->base != NULL) {
+    viewCopy(img, x, y, w, h, img_new->pixel, (size_t)w);
+  } else if (img->tiles != NULL) {
+    sparseCopy(img, x, y, w, h, img_new->pixel, (size_t)w);
+  } else {
+    for (int j = 0; j < h; j++) {
+      memcpy(img_new->pixel + (size_t)j*w, img->pixel + (size_t)(y + j)*img->width + x, (size_t)w);
     }
   }
+  PIXMEM += 2*(size_t)w*h;  // count pixel reads and writes
+  TraceEnd(2*(size_t)w*h);
   return img_new;
 }
 
+// Resizing
+//
+// Each output column (row) is a weighted sum of a few consecutive source
+// columns (rows).  The weights depend on the mode and on the column only,
+// so they are tabulated once per call, in fixed point with RBITS
+// fractional bits (each column's weights add to exactly 1).
+// The horizontal pass turns the source rows a chunk of output rows needs
+// into intermediate rows with RFRAC extra fractional bits; the vertical
+// pass then adds whole intermediate rows, in strips of RSTRIP columns that
+// the compiler vectorizes.  Chunks of output rows may run on several threads.
+
+#define RBITS 14
+#define RFRAC 7
+#define RSTRIP 256
+
+typedef struct {
+  int taps;         // maximum number of weights per output
+  int* start;       // first source index of each output
+  int* count;       // number of weights of each output
+  int16_t* weight;  // taps weights per output
+} Coefs;
+
+// Tabulate the weights to resize sn source pixels into dn (both > 0).
+// Returns 0 if out of memory.
+static int coefsBuild(Coefs* c, int dn, int sn, ResizeMode mode) {
+  double scale = (double)sn / dn;
+  c->taps = mode == ResizeArea ? (int)ceil(scale) + 1 : mode == ResizeBilinear ? 2 : 1;
+  c->start = malloc(sizeof(int)*2*dn + sizeof(int16_t)*c->taps*dn);
+  if (c->start == NULL) return 0;
+  c->count = c->start + dn;
+  c->weight = (int16_t*)(c->count + dn);
+  double w[c->taps];
+  for (int i = 0; i < dn; i++) {
+    int first, n;
+    if (mode == ResizeNearest) {
+      first = (int)((i + 0.5)*scale);
+      if (first > sn - 1) first = sn - 1;
+      n = 1;
+      w[0] = 1.0;
+    } else if (mode == ResizeBilinear) {
+      double s = (i + 0.5)*scale - 0.5;   // source position of the center
+      if (s < 0.0) s = 0.0;
+      if (s > sn - 1) s = sn - 1;
+      first = (int)s;
+      n = first < sn - 1 ? 2 : 1;
+      w[0] = 1.0 - (s - first);
+      w[1] = s - first;
+    } else {   // ResizeArea: overlap of [a, b) with each source pixel
+      double a = i*scale, b = (i + 1)*scale;
+      first = (int)a;
+      int last = (int)ceil(b) - 1;
+      if (last > sn - 1) last = sn - 1;
+      n = last - first + 1;
+      for (int j = 0; j < n; j++) {
+        double lo = a > first + j ? a : first + j;
+        double hi = b < first + j + 1 ? b : first + j + 1;
+        w[j] = (hi - lo) / scale;
+      }
+    }
+    assert (0 <= first && n <= c->taps && first + n <= sn);
+    // Round to fixed point the partial sums of the weights, so that each
+    // weight is within one unit of exact and not negative, and they add to
+    // exactly 1 (rounding each one, the residue grows with their number)
+    int16_t* q = c->weight + (size_t)i*c->taps;
+    double partial = 0.0;
+    int sum = 0;
+    for (int j = 0; j < c->taps; j++) {
+      partial += j < n ? w[j] : 0.0;
+      int next = j < n - 1 ? (int)lround(ldexp(partial, RBITS)) : 1 << RBITS;
+      q[j] = (int16_t)(next - sum);
+      sum = next;
+    }
+    c->start[i] = first;
+    c->count[i] = n;
+  }
+  return 1;
+}
+
+typedef struct {
+  Image src, dst;
+  ResizeMode mode;
+  Coefs cx, cy;
+  int failed[MAXTHREADS];  // errno of a failure of each worker, or 0
+} ResizeJob;
+
+// acc[x] += c*t[x], for x in [0, RSTRIP).
+static void resizeTaps(int32_t* restrict acc, const uint16_t* restrict t, int32_t c) {
+  for (int x = 0; x < RSTRIP; x++) acc[x] += c*t[x];
+}
+
+// out[x] = acc[x] rounded down to an integer level, for x in [0, RSTRIP).
+static void resizeStore(uint8* restrict out, const int32_t* restrict acc, int32_t maxval) {
+  for (int x = 0; x < RSTRIP; x++) {
+    int32_t v = acc[x] >> (RBITS + RFRAC);
+    out[x] = (uint8)(v < maxval ? v : maxval);
+  }
+}
+
+// Compute rows [y0, y1) of job->dst.
+static void resizeBand(int y0, int y1, int worker, void* arg) {
+  ResizeJob* job = arg;
+  Image src = job->src, dst = job->dst;
+  int dw = dst->width;
+  if (y0 >= y1) return;
+  if (job->mode == ResizeNearest) {   // just pick pixels
+    for (int y = y0; y < y1; y++) {
+      const uint8* s = src->pixel + (size_t)job->cy.start[y]*src->width;
+      uint8* d = dst->pixel + (size_t)y*dw;
+      for (int x = 0; x < dw; x++) d[x] = s[job->cx.start[x]];
+    }
+    return;
+  }
+  // Source rows needed by the chunk
+  int r0 = job->cy.start[y0];
+  int r1 = job->cy.start[y1 - 1] + job->cy.count[y1 - 1];
+  int wpad = (dw + RSTRIP - 1) / RSTRIP * RSTRIP;
+  uint16_t* inter = calloc((size_t)(r1 - r0)*wpad, sizeof(uint16_t));
+  int32_t* acc = malloc(sizeof(int32_t)*RSTRIP);
+  if (inter == NULL || acc == NULL) {
+    job->failed[worker] = errno;
+  } else {
+    // Horizontal pass
+    for (int r = r0; r < r1; r++) {
+      const uint8* s = src->pixel + (size_t)r*src->width;
+      uint16_t* t = inter + (size_t)(r - r0)*wpad;
+      for (int x = 0; x < dw; x++) {
+        const int16_t* q = job->cx.weight + (size_t)x*job->cx.taps;
+        const uint8* p = s + job->cx.start[x];
+        int32_t sum = 0;
+        for (int j = 0; j < job->cx.count[x]; j++) sum += q[j]*p[j];
+        t[x] = (uint16_t)((sum + (1 << (RBITS - RFRAC - 1))) >> (RBITS - RFRAC));
+      }
+    }
+    // Vertical pass
+    int maxval = dst->maxval;
+    uint8 out[RSTRIP];
+    for (int y = y0; y < y1; y++) {
+      const int16_t* q = job->cy.weight + (size_t)y*job->cy.taps;
+      const uint16_t* t = inter + (size_t)(job->cy.start[y] - r0)*wpad;
+      uint8* d = dst->pixel + (size_t)y*dw;
+      for (int x0 = 0; x0 < dw; x0 += RSTRIP) {
+        for (int x = 0; x < RSTRIP; x++) acc[x] = 1 << (RBITS + RFRAC - 1);
+        for (int j = 0; j < job->cy.count[y]; j++) {
+          resizeTaps(acc, t + (size_t)j*wpad + x0, q[j]);
+        }
+        resizeStore(out, acc, maxval);
+        memcpy(d + x0, out, dw - x0 < RSTRIP ? dw - x0 : RSTRIP);
+      }
+    }
+  }
+  free(inter);
+  free(acc);
+}
+
+/// Resize an image.
+Image ImageResize(Image img, int w, int h, ResizeMode mode) { ///
+  assert (img != NULL);
+  assert (w >= 0 && h >= 0);
+  if (verifying()) return verifyResize(img, w, h, mode);
+  TraceBegin("ImageResize", "kernel");
+  materialize(img);
+  Image res = ImageCreate(w, h, (uint8)img->maxval);
+  ResizeJob job = { img, res, mode, { 0 }, { 0 }, { 0 } };
+  int empty = w == 0 || h == 0 || img->width == 0 || img->height == 0;
+  int success = res != NULL &&
+  (empty ||   // nothing to resize: leave it black
+   (check( coefsBuild(&job.cx, w, img->width, mode) &&
+           coefsBuild(&job.cy, h, img->height, mode) , "Out of memory" )));
+  if (success && !empty) {
+    ImageParallelFor(h, rowGrain(w, h), resizeBand, &job);
+    for (int i = 0; i < MAXTHREADS; i++) {
+      if (job.failed[i] != 0) {
+        success = check( 0, "Out of memory" );
+        errno = job.failed[i];
+      }
+    }
+    PIXMEM += (size_t)img->width*img->height + (size_t)w*h;  // count pixel accesses
+  }
+  errsave = errno;
+  free(job.cx.start);
+  free(job.cy.start);
+  if (!success) ImageDestroy(&res);
+  errno = errsave;
+  TraceEnd(success ? (size_t)img->width*img->height + (size_t)w*h : 0);
+  return res;
+}
+
+// Rotation by an arbitrary angle
+//
+// Destination pixel (x, y) samples the source at (u, v), an affine
+// function of (x, y), so along a row u and v just step by constants.
+// They are kept in fixed point with RFIX fractional bits and only the
+// start of each row of a tile is computed in floating point.  The pixels
+// of a row whose sample falls inside the source form an interval, found
+// from the two linear constraints and then checked in fixed point; the
+// rest of the row stays black.  Rows are processed in RTILE x RTILE tiles
+// so that the source pixels read, along a slanted line, stay in cache.
+//
+// Stepping along a tile row adds up the rounding errors of the steps, to
+// far less than RSLACK.  Bilinear samples within RSLACK of the source
+// (such as all those of a one pixel high image) are clamped to its edge,
+// not dropped.  Nearest neighbour samples are RSLACK too high, so that
+// they round half-way cases up, as the exact coordinates would.
+
+#define RFIX 32
+#define RSLACK ((int64_t)1 << (RFIX - 20))
+#define RTILE 64
+#define RWBITS 11              // bits of the bilinear weights
+#define RWONE (1 << RWBITS)
+
+typedef struct {
+  Image src, dst;
+  ResizeMode interp;
+  double cosa, sina;       // the rotation
+  int64_t du, dv;          // steps of (u, v) per destination column
+  size_t count[MAXTHREADS];  // pixels sampled by each worker
+} RotateJob;
+
+// (u, v) at destination pixel (x, y).
+static void rotateStart(const RotateJob* job, int x, int y, int64_t* u, int64_t* v) {
+  double cx = (job->src->width - 1) / 2.0, cy = (job->src->height - 1) / 2.0;
+  double dy = y - (job->dst->height - 1) / 2.0;
+  double dx = x - (job->dst->width - 1) / 2.0;
+  double su = cx + dx*job->cosa - dy*job->sina;
+  double sv = cy + dx*job->sina + dy*job->cosa;
+  if (job->interp == ResizeNearest) {  // so that truncating rounds
+    su += 0.5;
+    sv += 0.5;
+  }
+  *u = llround(ldexp(su, RFIX));
+  *v = llround(ldexp(sv, RFIX));
+  if (job->interp == ResizeNearest) {  // (and half-way cases round up)
+    *u += RSLACK;
+    *v += RSLACK;
+  }
+}
+
+// Is fixed point coordinate t a valid sample position in [0, n)?
+static inline int rotateInside(const RotateJob* job, int64_t t, int n) {
+  if (job->interp == ResizeNearest) return t >= 0 && t < (int64_t)n << RFIX;
+  return t >= -RSLACK && t <= ((int64_t)(n - 1) << RFIX) + RSLACK;
+}
+
+static inline int rotateValid(const RotateJob* job, int64_t u, int64_t v) {
+  return rotateInside(job, u, job->src->width) && rotateInside(job, v, job->src->height);
+}
+
+// Narrow [*x0, *x1) to the columns where t0 + x*dt is inside [0, n).
+static void rotateClip(double t0, double dt, double n, int* x0, int* x1) {
+  if (dt == 0.0) {
+    if (t0 < -1.0 || t0 > n + 1.0) *x1 = *x0;  // (borderline cases are settled exactly)
+    return;
+  }
+  double a = (-1.0 - t0) / dt, b = (n + 1.0 - t0) / dt;
+  if (a > b) { double t = a; a = b; b = t; }
+  if (a > *x0) *x0 = a > *x1 ? *x1 : (int)a;
+  if (b < *x1) *x1 = b < *x0 ? *x0 : (int)b + 1;
+}
+
+// Bilinear sample of the w x h source s at (u, v), inside it.
+static inline uint8 rotateBilinear(const uint8* s, int w, int h, int64_t u, int64_t v) {
+  int sx = (int)(u >> RFIX), sy = (int)(v >> RFIX);
+  int32_t fx = (int32_t)(u >> (RFIX - RWBITS)) & (RWONE - 1);
+  int32_t fy = (int32_t)(v >> (RFIX - RWBITS)) & (RWONE - 1);
+  const uint8* p = s + (size_t)sy*w + sx;
+  size_t right = sx < w - 1, down = sy < h - 1 ? (size_t)w : 0;  // (weights are 0 past the edge)
+  int32_t top = p[0]*(RWONE - fx) + p[right]*fx;
+  int32_t bottom = p[down]*(RWONE - fx) + p[down + right]*fx;
+  return (uint8)((top*(RWONE - fy) + bottom*fy + (1 << (2*RWBITS - 1))) >> 2*RWBITS);
+}
+
+// Sample row span [x0, x1) of the destination, starting at (u, v).
+static void rotateSpan(const RotateJob* job, uint8* d, int x0, int x1, int64_t u, int64_t v) {
+  const uint8* s = job->src->pixel;
+  int w = job->src->width, h = job->src->height;
+  int64_t du = job->du, dv = job->dv;
+  if (job->interp == ResizeNearest) {
+    for (int x = x0; x < x1; x++, u += du, v += dv) {
+      d[x] = s[(size_t)(v >> RFIX)*w + (size_t)(u >> RFIX)];
+    }
+    return;
+  }
+  // Only the samples at the ends of the span may be (just) outside the
+  // source: those are clamped to its edges, one by one.
+  int64_t umax = (int64_t)(w - 1) << RFIX, vmax = (int64_t)(h - 1) << RFIX;
+  while (x0 < x1 && (u < 0 || u > umax || v < 0 || v > vmax)) {
+    d[x0++] = rotateBilinear(s, w, h, u < 0 ? 0 : u > umax ? umax : u,
+                             v < 0 ? 0 : v > vmax ? vmax : v);
+    u += du;
+    v += dv;
+  }
+  for (int64_t ue = u + (x1 - 1 - x0)*du, ve = v + (x1 - 1 - x0)*dv;
+       x1 > x0 && (ue < 0 || ue > umax || ve < 0 || ve > vmax); ue -= du, ve -= dv) {
+    d[--x1] = rotateBilinear(s, w, h, ue < 0 ? 0 : ue > umax ? umax : ue,
+                             ve < 0 ? 0 : ve > vmax ? vmax : ve);
+  }
+  for (int x = x0; x < x1; x++, u += du, v += dv) {
+    d[x] = rotateBilinear(s, w, h, u, v);
+  }
+}
+
+// Compute rows [y0, y1) of job->dst.
+static void rotateBand(int y0, int y1, int worker, void* arg) {
+  RotateJob* job = arg;
+  int w = job->dst->width;
+  double sw = job->src->width, sh = job->src->height;
+  double du = ldexp((double)job->du, -RFIX), dv = ldexp((double)job->dv, -RFIX);
+  size_t count = 0;
+  for (int ty = y0; ty < y1; ty += RTILE) {
+    int ty1 = y1 - ty < RTILE ? y1 : ty + RTILE;
+    for (int tx = 0; tx < w; tx += RTILE) {
+      int tx1 = w - tx < RTILE ? w : tx + RTILE;
+      for (int y = ty; y < ty1; y++) {
+        // (u, v) at x = tx, and as it would be at x = 0, with the same steps
+        int64_t ut, vt;
+        rotateStart(job, tx, y, &ut, &vt);
+        int64_t u = ut - tx*job->du, v = vt - tx*job->dv;
+        // Approximate span, then fix its ends exactly
+        int x0 = tx, x1 = tx1;
+        rotateClip(ldexp((double)u, -RFIX), du, sw, &x0, &x1);
+        rotateClip(ldexp((double)v, -RFIX), dv, sh, &x0, &x1);
+        while (x0 < x1 && !rotateValid(job, u + x0*job->du, v + x0*job->dv)) x0++;
+        while (x1 > x0 && !rotateValid(job, u + (x1 - 1)*job->du, v + (x1 - 1)*job->dv)) x1--;
+        while (x0 > tx && rotateValid(job, u + (x0 - 1)*job->du, v + (x0 - 1)*job->dv)) x0--;
+        while (x1 < tx1 && rotateValid(job, u + x1*job->du, v + x1*job->dv)) x1++;
+        if (x0 >= x1) continue;
+        rotateSpan(job, job->dst->pixel + (size_t)y*w, x0, x1,
+                   u + x0*job->du, v + x0*job->dv);
+        count += x1 - x0;
+      }
+    }
+  }
+  job->count[worker] += count;
+}
+
+/// Rotate an image by an arbitrary angle.
+Image ImageRotateAngle(Image img, double degrees, ResizeMode interp) { ///
+  assert (img != NULL);
+  assert (interp == ResizeNearest || interp == ResizeBilinear);
+  assert (isfinite(degrees));
+  if (verifying()) return verifyRotateAngle(img, degrees, interp);
+  Image res = ImageCreate(img->width, img->height, (uint8)img->maxval);
+  if (res == NULL) return NULL;
+
+  TraceBegin("ImageRotateAngle", "kernel");
+  materialize(img);
+  // Exact quarter turns have exact sines and cosines
+  double turn = fmod(degrees, 360.0);
+  if (turn < 0.0) turn += 360.0;
+  double cosa, sina;
+  if (turn == 0.0) { cosa = 1.0; sina = 0.0; }
+  else if (turn == 90.0) { cosa = 0.0; sina = 1.0; }
+  else if (turn == 180.0) { cosa = -1.0; sina = 0.0; }
+  else if (turn == 270.0) { cosa = 0.0; sina = -1.0; }
+  else { cosa = cos(turn * M_PI / 180.0); sina = sin(turn * M_PI / 180.0); }
+  RotateJob job = { img, res, interp, cosa, sina,
+                    llround(ldexp(cosa, RFIX)), llround(ldexp(sina, RFIX)), { 0 } };
+  size_t count = 0;
+  if (img->width > 0 && img->height > 0) {
+    ImageParallelFor(res->height, rowGrain(res->width, res->height), rotateBand, &job);
+    for (int i = 0; i < MAXTHREADS; i++) count += job.count[i];
+  }
+  int reads = interp == ResizeNearest ? 1 : 4;
+  PIXMEM += (reads + 1) * count;  // count pixel accesses
+  TraceEnd((reads + 1) * count);
+  return res;
+}
+
 
 /// Operations on two images
 
+// Copy n pixels from s to d.
+static void pasteSpan(uint8* d, const uint8* s, int n, const void* arg) {
+  (void)arg;
+  memcpy(d, s, (size_t)n);
+}
+
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -604,17 +2990,267 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!-----
+  if (verifying()) { verifyPaste(img1, x, y, img2); return; }
+  TraceBegin("ImagePaste", "kernel");
+  materialize(img2);
+  touch(img1, x, y, img2->width, img2->height);
+  // Into a sparse image, copy tile by tile (or, if out of memory, densify)
+  if (img1->tiles != NULL) {
+    if (sparseApply(img1, x, y, img2->width, img2->height,
+                    img2->pixel, (size_t)img2->width, pasteSpan, NULL)) {
+      PIXMEM += 2*(size_t)img2->width*img2->height;  // count pixel reads and writes
+      TraceEnd(2*(size_t)img2->width*img2->height);
+      return;
+    }
+  }
+  makeWritable(img1);
+  for (int j = 0; j < img2->height; j++) {
+    pasteSpan(img1->pixel + (size_t)(y + j)*img1->width + x,
+              img2->pixel + (size_t)j*img2->width, img2->width, NULL);
+  }
+  PIXMEM += 2*(size_t)img2->width*img2->height;  // count pixel reads and writes
+  TraceEnd(2*(size_t)img2->width*img2->height);
+}
 
-  uint8 pix_img2;// Variável para armazenar o valor do pixel da segunda imagem
-  
-  // Itera sobre os pixels da segunda imagem
-  for (int i = 0;i < img2 -> width;i++){
-    for(int j = 0;j < img2 -> height;j++){
-      pix_img2 = ImageGetPixel(img2,i,j);// Obtém o valor do pixel da segunda imagem na posição (i, j)
-      ImageSetPixel(img1,i + x,j + y,pix_img2);// Define o pixel na primeira imagem na posição (i + x, j + y)
+// Masked pasting
+//
+// A source pixel s[i] is opaque if its selector m[i] differs from key:
+// m is the mask row and key is 0 for ImagePasteMasked, m is the source row
+// itself and key is the color key for ImagePasteKeyed.
+// Rows are classified in chunks of PCHUNK pixels: consecutive all-opaque
+// chunks make a run that is copied with a single memcpy, all-transparent
+// chunks are skipped, and mixed chunks are merged with a byte select,
+// which the compiler vectorizes.
+
+#define PCHUNK 32
+
+// Number of opaque pixels in a chunk.
+static inline int opaqueCount(const uint8* restrict m, uint8 key) {
+  int count = 0;
+  for (int i = 0; i < PCHUNK; i++) count += m[i] != key;
+  return count;
+}
+
+// d[i] = s[i] where the pixel is opaque, for a chunk.
+static inline void selectChunk(uint8* restrict d, const uint8* restrict s,
+                               const uint8* restrict m, uint8 key) {
+  for (int i = 0; i < PCHUNK; i++) {
+    uint8 sel = (uint8)-(m[i] != key);   // all ones where opaque
+    d[i] = (uint8)((s[i] & sel) | (d[i] & ~sel));
+  }
+}
+
+// Paste the opaque pixels of source row s (of n pixels) into row d.
+static void pasteRow(uint8* d, const uint8* s, const uint8* m, int n, uint8 key) {
+  int run = 0;   // start of the current opaque run
+  int x = 0;
+  for (; x + PCHUNK <= n; x += PCHUNK) {
+    int count = opaqueCount(m + x, key);
+    if (count == PCHUNK) continue;   // extend the run
+    if (run < x) memcpy(d + run, s + run, x - run);
+    if (count > 0) selectChunk(d + x, s + x, m + x, key);
+    run = x + PCHUNK;
+  }
+  if (run < x) memcpy(d + run, s + run, x - run);
+  for (; x < n; x++) {
+    if (m[x] != key) d[x] = s[x];
+  }
+}
+
+/// Paste the pixels of an image selected by a mask into a larger image.
+void ImagePasteMasked(Image img1, int x, int y, Image img2, Image mask) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (mask != NULL);
+  assert (mask->width == img2->width && mask->height == img2->height);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (verifying()) { verifyPasteMasked(img1, x, y, img2, mask); return; }
+  TraceBegin("ImagePasteMasked", "kernel");
+  makeWritable(img1);
+  touch(img1, x, y, img2->width, img2->height);
+  materialize(img2);
+  materialize(mask);
+  for (int j = 0; j < img2->height; j++) {
+    pasteRow(img1->pixel + (size_t)(y + j)*img1->width + x,
+             img2->pixel + (size_t)j*img2->width,
+             mask->pixel + (size_t)j*mask->width, img2->width, 0);
+  }
+  PIXMEM += 3*(size_t)img2->width*img2->height;  // count pixel accesses
+  TraceEnd(3*(size_t)img2->width*img2->height);
+}
+
+/// Paste an image into a larger image, except for the pixels of a key level.
+void ImagePasteKeyed(Image img1, int x, int y, Image img2, uint8 key) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (verifying()) { verifyPasteKeyed(img1, x, y, img2, key); return; }
+  TraceBegin("ImagePasteKeyed", "kernel");
+  makeWritable(img1);
+  touch(img1, x, y, img2->width, img2->height);
+  materialize(img2);
+  for (int j = 0; j < img2->height; j++) {
+    const uint8* s = img2->pixel + (size_t)j*img2->width;
+    pasteRow(img1->pixel + (size_t)(y + j)*img1->width + x, s, s, img2->width, key);
+  }
+  PIXMEM += 2*(size_t)img2->width*img2->height;  // count pixel accesses
+  TraceEnd(2*(size_t)img2->width*img2->height);
+}
+
+// Blending
+//
+// A blended pixel is ((1-alpha)*p1 + alpha*p2) + 0.5, truncated and
+// saturated to [0, maxval], computed in double as in the original
+// ImageBlend.  The fast path computes it in fixed point instead:
+// t = a1*p1 + a2*p2 + 2^(k-1), with a2 = round(alpha*2^k), a1 = 2^k - a2,
+// and the result is t >> k.  Rounding alpha moves t by at most BMARGIN
+// units, so when the low k bits of t are farther than that from a carry
+// boundary, the result is certainly the same; the few pixels closer to it
+// are recomputed in double, so results always match the original.
+
+#define BCHUNK 64      // pixels per fixed-point chunk
+#define BMARGIN 256    // bound on the fixed-point error (units of 2^-k)
+
+typedef struct {
+  double alpha;
+  int32_t a1, a2;
+  int k;           // fractional bits (0: no fixed-point path)
+  int maxval;
+} BlendCoef;
+
+// Set up the fixed-point coefficients for alpha, with as many fractional
+// bits as fit in int32 (up to 22).
+static void blendCoef(double alpha, int maxval, BlendCoef* c) {
+  c->alpha = alpha;
+  c->maxval = maxval;
+  c->k = 0;
+  for (int k = 22; k >= 12 && c->k == 0; k--) {
+    double a2 = nearbyint(ldexp(alpha, k));
+    double a1 = ldexp(1.0, k) - a2;
+    if ((fabs(a1) + fabs(a2))*PixMax + ldexp(1.0, k) < 0x1p31) {
+      c->a1 = (int32_t)a1;
+      c->a2 = (int32_t)a2;
+      c->k = k;
+    }
+  }
+}
+
+// Blend p2 into p1, exactly as in double.
+static inline uint8 blendExact(uint8 p1, uint8 p2, const BlendCoef* c) {
+  double v = ((1.0 - c->alpha)*p1 + c->alpha*p2) + 0.5;
+  return (uint8)(v <= 0.0 ? 0 : v >= c->maxval ? c->maxval : v);
+}
+
+// Blend s into d, for BCHUNK pixels, in fixed point.
+// Returns nonzero if some pixel needs to be recomputed in double.
+static inline int blendChunk(uint8* restrict d, const uint8* restrict s, const BlendCoef* c) {
+  int32_t a1 = c->a1, a2 = c->a2, half = 1 << (c->k - 1), mask = (1 << c->k) - 1;
+  int k = c->k, maxval = c->maxval;
+  int near = 0;
+  for (int x = 0; x < BCHUNK; x++) {
+    int32_t t = a1*d[x] + a2*s[x] + half;
+    int32_t r = t >> k;
+    near |= ((t + BMARGIN) & mask) < 2*BMARGIN;
+    d[x] = (uint8)(r < 0 ? 0 : r > maxval ? maxval : r);
+  }
+  return near;
+}
+
+// Blend the n pixels of s into d.
+static void blendSpan(uint8* d, const uint8* s, int n, const BlendCoef* c) {
+  int x = 0;
+  if (c->k > 0) {
+    uint8 orig[BCHUNK];
+    for (; x + BCHUNK <= n; x += BCHUNK) {
+      memcpy(orig, d + x, BCHUNK);
+      if (blendChunk(d + x, s + x, c)) {
+        for (int i = 0; i < BCHUNK; i++) {
+          int32_t t = c->a1*orig[i] + c->a2*s[x+i] + (1 << (c->k - 1));
+          if (((t + BMARGIN) & ((1 << c->k) - 1)) < 2*BMARGIN) {
+            d[x+i] = blendExact(orig[i], s[x+i], c);
+          }
+        }
+      }
+    }
+  }
+  for (; x < n; x++) d[x] = blendExact(d[x], s[x], c);
+}
+
+// The layers to blend into the rows of dst.
+typedef struct {
+  Image dst;
+  const ImageLayer* layers;
+  int n;
+} BlendJob;
+
+#define BTILEW 1024  // destination tile width
+#define BTILEH 16    // destination tile height
+
+// Blend every layer into each tile of rows [y0, y1) of dst, in turn.
+static void blendBand(int y0, int y1, int worker, void* arg) {
+  BlendJob* job = arg;
+  Image dst = job->dst;
+  for (int ty = y0; ty < y1; ty += BTILEH) {
+    int ty1 = ty + BTILEH < y1 ? ty + BTILEH : y1;
+    for (int tx = 0; tx < dst->width; tx += BTILEW) {
+      int tx1 = tx + BTILEW < dst->width ? tx + BTILEW : dst->width;
+      for (int i = 0; i < job->n; i++) {
+        const ImageLayer* l = &job->layers[i];
+        // Intersection of the layer with the tile
+        int x0 = l->x > tx ? l->x : tx;
+        int x1 = l->x + l->img->width < tx1 ? l->x + l->img->width : tx1;
+        int ya = l->y > ty ? l->y : ty;
+        int yb = l->y + l->img->height < ty1 ? l->y + l->img->height : ty1;
+        if (x0 >= x1 || ya >= yb) continue;
+        BlendCoef c;
+        blendCoef(l->alpha, dst->maxval, &c);
+        for (int y = ya; y < yb; y++) {
+          blendSpan(dst->pixel + (size_t)y*dst->width + x0,
+                    l->img->pixel + (size_t)(y - l->y)*l->img->width + (x0 - l->x),
+                    x1 - x0, &c);
+        }
+      }
+    }
+  }
+}
+
+// blendSpan, as a SpanFn.
+static void blendTileSpan(uint8* d, const uint8* s, int n, const void* arg) {
+  blendSpan(d, s, n, arg);
+}
+
+// Blend the n layers into dst, tile by tile.
+static void blendLayers(Image dst, const ImageLayer* layers, int n) {
+  size_t pixels = 0;
+  for (int i = 0; i < n; i++) {
+    assert (layers[i].img != NULL);
+    assert (ImageValidRect(dst, layers[i].x, layers[i].y, layers[i].img->width, layers[i].img->height));
+    pixels += (size_t)layers[i].img->width*layers[i].img->height;
+    touch(dst, layers[i].x, layers[i].y, layers[i].img->width, layers[i].img->height);
+  }
+  for (int i = 0; i < n; i++) materialize(layers[i].img);
+  // Into a sparse image, blend layer by layer and tile by tile
+  // (or, if out of memory for the tiles, densify it and go on below).
+  while (dst->tiles != NULL && n > 0) {
+    BlendCoef c;
+    blendCoef(layers->alpha, dst->maxval, &c);
+    if (sparseApply(dst, layers->x, layers->y, layers->img->width, layers->img->height,
+                    layers->img->pixel, (size_t)layers->img->width, blendTileSpan, &c)) {
+      layers++;
+      n--;
+    } else {
+      materialize(dst);
     }
   }
+  if (dst->tiles == NULL) {
+    makeWritable(dst);
+    BlendJob job = { dst, layers, n };
+    // (Chunks of whole tiles; one, if there is little to blend.)
+    int grain = rowGrain(dst->width, dst->height);
+    grain = pixels < PARMIN ? dst->height : (grain + BTILEH - 1) / BTILEH * BTILEH;
+    ImageParallelFor(dst->height, grain, blendBand, &job);
+  }
+  PIXMEM += 3*pixels;  // count pixel reads and writes
 }
 
 /// Blend an image into a larger image.
@@ -627,26 +3263,31 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!---------
-
-  uint8 pix_img2,pix_img1,pix_blend;
-  // Itera sobre os pixels da segunda imagem
-  for (int i = 0;i < img2 -> width;i++){
-    for(int j = 0;j < img2 -> height;j++){
-      // Obtém os valores dos pixels das duas imagens nas posições correspondentes
-      pix_img2 = ImageGetPixel(img2,i,j);
-      pix_img1 = ImageGetPixel(img1,i + x,j + y);
-      pix_blend = ((1.0 - alpha) * pix_img1 + alpha * pix_img2) + 0.5;// Calcula o pixel resultante da mistura ponderada, +0.5 para arrendondamentos
+  if (verifying()) { verifyBlend(img1, x, y, img2, alpha); return; }
+  TraceBegin("ImageBlend", "kernel");
+  ImageLayer layer = { img2, x, y, alpha };
+  blendLayers(img1, &layer, 1);
+  TraceEnd(3*(size_t)img2->width*img2->height);
+}
 
-      ImageSetPixel(img1,i + x,j + y,pix_blend);// Define o pixel na primeira imagem na posição (i + x, j + y) como o resultado da mistura
-    }
-  }
+/// Blend several layers into an image, in one pass.
+void ImageBlendMany(Image img, const ImageLayer* layers, int n) { ///
+  assert (img != NULL);
+  assert (n >= 0);
+  assert (n == 0 || layers != NULL);
+  if (verifying()) { verifyBlendMany(img, layers, n); return; }
+  TraceBegin("ImageBlendMany", "kernel");
+  blendLayers(img, layers, n);
+  size_t bytes = 0;
+  for (int i = 0; i < n; i++) bytes += 3*(size_t)layers[i].img->width*layers[i].img->height;
+  TraceEnd(bytes);
 }
 
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidPos(img1, x, y));
+  if (verifying()) return verifyMatchSubImage(img1, x, y, img2);
 
   uint8 pix_img2, pix_img1;
 
@@ -681,6 +3322,11 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  if (verifying()) return verifyLocateSubImage(img1, px, py, img2);
+  if (img1->width == 0 || img1->height == 0) return 0;   // (no valid position)
+  TraceBegin("ImageLocateSubImage", "kernel");
+  materialize(img1);
+  materialize(img2);
 
   int match = 0; // Inicializa a variável de correspondência como falsa
 
@@ -705,55 +3351,1260 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
     }
   }
 
+  TraceEnd((size_t)img1->width*img1->height);
+
   return match; //1 se verdadeiro, 0 caso contrario
 }
 
 
 /// Filtering
 
+// ImageBlur keeps, for the current row, the sums of each column over the
+// rows of the window, which slide down one row by adding one pixel and
+// subtracting another (in strips of BSTRIP columns that the compiler
+// vectorizes).  The sum of a window is then a difference of prefix sums of
+// those column sums.  So it takes constant time per pixel, whatever the
+// window size.  Sums are exact integers, divided in double as before, so
+// results are unchanged.  Chunks of rows run in parallel (each sums its
+// first window afresh) and write to another raster: a new one, copied back
+// at the end, for ImageBlur.  ImageBlurUpdate computes only rectangles
+// around the pixels modified since its last call, in the same way.
+
+#define BSTRIP 64
+
+typedef struct {
+  Image img;
+  int dx, dy;
+  Rect r;       // the pixels to compute
+  uint8* out;   // where to (a raster the size of img)
+  size_t reads[MAXTHREADS];  // pixels read by each worker
+  int failed[MAXTHREADS];    // errno of a failure of each worker, or 0
+} BlurJob;
+
+// c[x] += in[x] - gone[x], for x in [0, BSTRIP).
+static inline void colsSlide(uint32_t* restrict c, const uint8* restrict in,
+                             const uint8* restrict gone) {
+  for (int x = 0; x < BSTRIP; x++) c[x] += in[x] - gone[x];
+}
+
+// c[x] += in[x], for x in [0, BSTRIP).
+static inline void colsAdd(uint32_t* restrict c, const uint8* restrict in) {
+  for (int x = 0; x < BSTRIP; x++) c[x] += in[x];
+}
+
+// c[x] -= gone[x], for x in [0, BSTRIP).
+static inline void colsSub(uint32_t* restrict c, const uint8* restrict gone) {
+  for (int x = 0; x < BSTRIP; x++) c[x] -= gone[x];
+}
+
+// Add row in (if not NULL) to the n column sums c and subtract row gone
+// (if not NULL).  The sums are uint32_t, or uint64_t if wide (for windows
+// of more than 16843009 rows, whose sums may not fit in 32 bits).
+static void colsUpdate(void* c, const uint8* in, const uint8* gone, int n, int wide) {
+  int x = 0;
+  if (wide) {
+    uint64_t* cw = c;
+    for (; x < n; x++) cw[x] += (in != NULL ? in[x] : 0) - (uint64_t)(gone != NULL ? gone[x] : 0);
+    return;
+  }
+  uint32_t* cn = c;
+  if (in != NULL && gone != NULL) {
+    for (; x + BSTRIP <= n; x += BSTRIP) colsSlide(cn + x, in + x, gone + x);
+    for (; x < n; x++) cn[x] += in[x] - gone[x];
+  } else if (in != NULL) {
+    for (; x + BSTRIP <= n; x += BSTRIP) colsAdd(cn + x, in + x);
+    for (; x < n; x++) cn[x] += in[x];
+  } else if (gone != NULL) {
+    for (; x + BSTRIP <= n; x += BSTRIP) colsSub(cn + x, gone + x);
+    for (; x < n; x++) cn[x] -= gone[x];
+  }
+}
+
+// Compute rows [r.y0 + i0, r.y0 + i1) of rectangle job->r of the blurred
+// image, in job->out.
+static void blurBand(int i0, int i1, int worker, void* arg) {
+  BlurJob* job = arg;
+  Image img = job->img;
+  int w = img->width, h = img->height, dx = job->dx, dy = job->dy;
+  int y0 = job->r.y0 + i0, y1 = job->r.y0 + i1;
+  // Columns in the windows of the rectangle
+  int c0 = job->r.x0 - dx > 0 ? job->r.x0 - dx : 0;
+  int c1 = job->r.x1 + dx < w ? job->r.x1 + dx : w;
+  int nc = c1 - c0;
+  int wide = (uint64_t)PixMax*(2*(uint64_t)dy + 1) > UINT32_MAX;
+  void* col = calloc((size_t)nc, wide ? sizeof(uint64_t) : sizeof(uint32_t));   // column sums
+  uint64_t* pre = malloc(sizeof(uint64_t)*((size_t)nc + 1));   // their prefix sums
+  size_t reads = 0;
+  if (col == NULL || pre == NULL) {
+    job->failed[worker] = errno;
+  } else {
+    // Window rows of row y0, but its last one
+    for (int r = y0 - dy > 0 ? y0 - dy : 0; r < y0 + dy && r < h; r++) {
+      colsUpdate(col, img->pixel + (size_t)r*w + c0, NULL, nc, wide);
+      reads += nc;
+    }
+    pre[0] = 0;
+    for (int y = y0; y < y1; y++) {
+      // Slide the column sums down, to rows [y-dy, y+dy]
+      const uint8* in = y + dy < h ? img->pixel + (size_t)(y + dy)*w + c0 : NULL;
+      const uint8* gone = y > y0 && y - dy - 1 >= 0 ? img->pixel + (size_t)(y - dy - 1)*w + c0 : NULL;
+      colsUpdate(col, in, gone, nc, wide);
+      reads += (size_t)nc*((in != NULL) + (gone != NULL));
+      if (wide) {
+        for (int c = 0; c < nc; c++) pre[c + 1] = pre[c] + ((uint64_t*)col)[c];
+      } else {
+        for (int c = 0; c < nc; c++) pre[c + 1] = pre[c] + ((uint32_t*)col)[c];
+      }
+
+      int rows = (y + dy < h ? y + dy : h - 1) - (y - dy > 0 ? y - dy : 0) + 1;
+      uint8* d = job->out + (size_t)y*w;
+      for (int x = job->r.x0; x < job->r.x1; x++) {
+        int xa = x - dx > 0 ? x - dx : 0;
+        int xb = x + dx < w ? x + dx + 1 : w;
+        double count = (double)(xb - xa)*rows;
+        d[x] = (uint8)((double)(pre[xb - c0] - pre[xa - c0]) / count + 0.5);
+      }
+    }
+  }
+  job->reads[worker] += reads;
+  free(col);
+  free(pre);
+}
+
+// Compute rectangle r of img blurred with a (2dx+1)x(2dy+1) window (dx, dy
+// no larger than the image) into out, a raster the size of img, and add
+// the pixels read to *reads.
+// Returns 1 on success; on failure (out of memory), returns 0 and sets
+// errno/errCause, with r only partly computed.
+static int blurRect(Image img, int dx, int dy, Rect r, uint8* out, size_t* reads) {
+  int w = r.x1 - r.x0, h = r.y1 - r.y0;
+  if (w <= 0 || h <= 0) return 1;
+  BlurJob job = { img, dx, dy, r, out, { 0 }, { 0 } };
+  // (Chunks of at least a window height, so that summing each chunk's
+  // first window does not cost more than the chunk itself.)
+  int grain = rowGrain(w, h);
+  int least = h / ImageThreads() < 2*dy + 1 ? h / ImageThreads() : 2*dy + 1;
+  ImageParallelFor(h, grain > least ? grain : least, blurBand, &job);
+  int success = 1;
+  for (int i = 0; i < MAXTHREADS; i++) {
+    if (job.failed[i] != 0) {
+      success = check( 0, "Out of memory" );
+      errno = job.failed[i];
+    }
+    *reads += job.reads[i];
+  }
+  return success;
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
+int ImageBlur(Image img, int dx, int dy) { ///
   assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (verifying()) return verifyFilter(ImageBlur, RefBlur, "ImageBlur", img, dx, dy);
+  TraceBegin("ImageBlur", "kernel");
+  makeWritable(img);
+  int w = img->width, h = img->height;
+  // Larger windows hold the same pixels
+  if (dx >= w) dx = w > 0 ? w - 1 : 0;
+  if (dy >= h) dy = h > 0 ? h - 1 : 0;
+  size_t n = (size_t)w*h;
+  Rect all = { 0, 0, w, h };
+  uint8* out = NULL;
+  size_t reads = 0;
+  int success =
+  check( (out = malloc(n + 1)) != NULL , "Out of memory" ) &&
+  blurRect(img, dx, dy, all, out, &reads);
+  if (success) {
+    touchAll(img);
+    memcpy(img->pixel, out, n);
+    PIXMEM += reads + 2*n;  // count pixel reads and writes
+  }
+  errsave = errno;
+  free(out);
+  errno = errsave;
+  TraceEnd(success ? 2*n : 0);
+  return success;
+}
 
-  uint8_t pix_filter;// Variável para armazenar o valor do pixel após o desfoque
-  // Cria uma cópia da imagem original para armazenar o resultado do desfoque.
-  Image img_copia = ImageCreate(ImageWidth(img),ImageHeight(img),ImageMaxval(img));
+/// Blur an image into another one, recomputing only what changed.
+int ImageBlurUpdate(Image img, Image out, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (out != NULL && out != img);
+  assert (out->width == img->width && out->height == img->height);
+  assert (dx >= 0 && dy >= 0);
+  if (verifying()) return verifyBlurUpdate(img, out, dx, dy);
+  TraceBegin("ImageBlurUpdate", "kernel");
+  materialize(img);
+  makeWritable(out);
+  int w = img->width, h = img->height;
+  // Larger windows hold the same pixels
+  if (dx >= w) dx = w > 0 ? w - 1 : 0;
+  if (dy >= h) dy = h > 0 ? h - 1 : 0;
+  // Pixels to compute: those within the window of a dirty pixel, if out
+  // is still what the last call made of img, or else all of them.
+  // (Other processes may write shared images behind our back.)
+  Rect todo[DIRTYMAX];
+  int ntodo = 0;
+  if (img->filtered == out && out->filterDx == dx && out->filterDy == dy &&
+      img->shared == NULL && out->shared == NULL) {
+    for (int i = 0; i < img->ndirty; i++) {
+      Rect d = img->dirty[i];
+      Rect r = { d.x0 - dx > 0 ? d.x0 - dx : 0, d.y0 - dy > 0 ? d.y0 - dy : 0,
+                 d.x1 + dx < w ? d.x1 + dx : w, d.y1 + dy < h ? d.y1 + dy : h };
+      todo[ntodo++] = r;
+    }
+  } else {
+    Rect all = { 0, 0, w, h };
+    todo[ntodo++] = all;
+  }
+  // Unlink them from their previous partners (and each other, until done)
+  if (img->filtered != NULL) img->filtered->filteredFrom = NULL;
+  if (out->filteredFrom != NULL) out->filteredFrom->filtered = NULL;
+  img->filtered = out->filteredFrom = NULL;
+
+  out->maxval = img->maxval;
+  size_t reads = 0, writes = 0;
+  int success = 1;
+  for (int i = 0; success && i < ntodo; i++) {
+    dirtyAdd(out, todo[i]);   // (out may be blurred from in turn)
+    success = blurRect(img, dx, dy, todo[i], out->pixel, &reads);
+    writes += (size_t)rectArea(todo[i]);
+  }
+  if (success) {
+    img->filtered = out;
+    out->filteredFrom = img;
+    out->filterDx = dx;
+    out->filterDy = dy;
+    img->ndirty = 0;
+  }
+  PIXMEM += reads + writes;  // count pixel reads and writes
+  TraceEnd(reads + writes);
+  return success;
+}
 
 
-// Itera sobre os pixels da imagem
-  for (int i = 0; i < img->width; i++) {
-    for (int j = 0; j < img->height; j++) {
-      double sum = 0;
-      double count = 0;
+// ImageMedian uses the constant-time algorithm of Perreault and Hébert
+// (2007).  Each column keeps a histogram of its pixels in the rows of the
+// window, which slides down one row by adding one pixel and removing
+// another.  The window histogram is the sum of the histograms of its
+// columns, and slides right by adding one column and removing another.
+// Histograms have 16 coarse bins (high 4 bits) and 256 fine ones: the
+// window keeps its coarse bins current, finds the coarse bin holding the
+// median, and brings only that bin's 16 fine ones up to date, lazily.
+// The image is processed in vertical strips of MTILE columns, so that the
+// column histograms of a strip stay in cache.  Their bins are uint16_t,
+// or uint32_t (wide) for windows of more than 65535 rows, in strips
+// half as wide.
+
+#define MTILE 128   // strip width
+#define FINE 256    // fine bins, followed by
+#define COARSE 16   // coarse bins, in each column histogram
+
+// h[i] += c[i], for i in [0, n), with c wide or not.
+static inline void binsAdd(uint32_t* restrict h, const void* restrict c, int n, int wide) {
+  if (wide) {
+    const uint32_t* cw = c;
+    for (int i = 0; i < n; i++) h[i] += cw[i];
+  } else {
+    const uint16_t* cn = c;
+    for (int i = 0; i < n; i++) h[i] += cn[i];
+  }
+}
+
+// h[i] -= c[i], for i in [0, n), with c wide or not.
+static inline void binsSub(uint32_t* restrict h, const void* restrict c, int n, int wide) {
+  if (wide) {
+    const uint32_t* cw = c;
+    for (int i = 0; i < n; i++) h[i] -= cw[i];
+  } else {
+    const uint16_t* cn = c;
+    for (int i = 0; i < n; i++) h[i] -= cn[i];
+  }
+}
 
-// Itera sobre a janela definida por (dx, dy) em torno do pixel atual
-      for (int di = -dx; di <= dx; di++) {
-        for (int dj = -dy; dj <= dy; dj++) {
-          int ni = i + di;
-          int nj = j + dj;
-  // Verifica se a posição (ni, nj) está dentro dos limites da imagem
-          if (ni >= 0 && ni < img->width && nj >= 0 && nj < img->height) {
-            sum += ImageGetPixel(img, ni, nj);
-            count++;
-            COMPARISONS++;
+// Add pixels row[c0..c1-1] to column histograms col (wide or not), with
+// d = 1, or remove them, with d = -1.
+static void histsUpdate(void* col, const uint8* row, int c0, int c1, int d, int wide) {
+  if (wide) {
+    uint32_t* hc = col;
+    for (int c = c0; c < c1; c++, hc += FINE + COARSE) {
+      hc[row[c]] += d;
+      hc[FINE + (row[c] >> 4)] += d;
+    }
+  } else {
+    uint16_t* hc = col;
+    for (int c = c0; c < c1; c++, hc += FINE + COARSE) {
+      hc[row[c]] += d;
+      hc[FINE + (row[c] >> 4)] += d;
+    }
+  }
+}
+
+/// Median filter an image, with a (2dx+1)x(2dy+1) window.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (verifying()) return verifyFilter(ImageMedian, RefMedian, "ImageMedian", img, dx, dy);
+  TraceBegin("ImageMedian", "kernel");
+  makeWritable(img);
+  int w = img->width, h = img->height;
+  // Larger windows hold the same pixels
+  if (dx >= w) dx = w > 0 ? w - 1 : 0;
+  if (dy >= h) dy = h > 0 ? h - 1 : 0;
+  int wide = 2*dy + 1 > UINT16_MAX;
+  int mtile = wide ? MTILE/2 : MTILE;
+  size_t bin = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+  size_t hsize = bin*(FINE + COARSE);   // bytes per column histogram
+  size_t n = (size_t)w*h;
+  int ncols = mtile + 2*dx < w ? mtile + 2*dx : w;
+  uint8* out = NULL;
+  char* col = NULL;   // column histograms of the strip
+  int success =
+  check( (out = malloc(n + 1)) != NULL &&
+         (col = malloc(hsize*ncols + 1)) != NULL , "Out of memory" );
+  uint32_t fine[FINE];      // window histogram
+  uint32_t coarse[COARSE];
+  int last[COARSE];         // x when fine[16*b..16*b+15] was brought up to date
+  size_t reads = 0;
+  for (int x0 = 0; success && x0 < w; x0 += mtile) {
+    int x1 = x0 + mtile < w ? x0 + mtile : w;
+    int c0 = x0 - dx > 0 ? x0 - dx : 0;   // columns used by the strip
+    int c1 = x1 + dx < w ? x1 + dx : w;
+    memset(col, 0, hsize*(c1 - c0));
+    for (int y = -dy; y < h; y++) {
+      // Slide the column histograms down, to rows [y-dy, y+dy]
+      const uint8* in = y + dy < h ? img->pixel + (size_t)(y + dy)*w : NULL;
+      const uint8* gone = y - dy - 1 >= 0 ? img->pixel + (size_t)(y - dy - 1)*w : NULL;
+      if (in != NULL) histsUpdate(col, in, c0, c1, 1, wide);
+      if (gone != NULL) histsUpdate(col, gone, c0, c1, -1, wide);
+      reads += (size_t)(c1 - c0)*((in != NULL) + (gone != NULL));
+      if (y < 0) continue;   // still filling in the top rows
+
+      int rows = (y + dy < h ? y + dy : h - 1) - (y - dy > 0 ? y - dy : 0) + 1;
+      // Window at x0: sum its columns' coarse bins; fine bins are stale
+      memset(coarse, 0, sizeof(coarse));
+      for (int c = x0 - dx > 0 ? x0 - dx : 0; c <= x0 + dx && c < w; c++) {
+        binsAdd(coarse, col + (size_t)(c - c0)*hsize + FINE*bin, COARSE, wide);
+      }
+      for (int b = 0; b < COARSE; b++) last[b] = INT_MIN;
+      for (int x = x0; x < x1; x++) {
+        if (x > x0) {
+          if (x + dx < w) binsAdd(coarse, col + (size_t)(x + dx - c0)*hsize + FINE*bin, COARSE, wide);
+          if (x - dx - 1 >= 0) binsSub(coarse, col + (size_t)(x - dx - 1 - c0)*hsize + FINE*bin, COARSE, wide);
+        }
+        int cols = (x + dx < w ? x + dx : w - 1) - (x - dx > 0 ? x - dx : 0) + 1;
+        uint32_t rank = (uint32_t)(cols*rows - 1) / 2;   // lower median
+
+        // Find the coarse bin holding the median
+        uint32_t below = 0;
+        int b = 0;
+        while (below + coarse[b] <= rank) below += coarse[b++];
+
+        // Bring its fine bins up to date: slide them from last[b] to x,
+        // or sum them afresh if that is cheaper
+        uint32_t* fb = fine + 16*b;
+        if (last[b] == INT_MIN || x - last[b] > dx + 1) {
+          memset(fb, 0, 16*sizeof(uint32_t));
+          for (int c = x - dx > 0 ? x - dx : 0; c <= x + dx && c < w; c++) {
+            binsAdd(fb, col + (size_t)(c - c0)*hsize + 16*b*bin, 16, wide);
           }
+        } else {
+          for (int j = last[b] + 1; j <= x; j++) {
+            if (j + dx < w) binsAdd(fb, col + (size_t)(j + dx - c0)*hsize + 16*b*bin, 16, wide);
+            if (j - dx - 1 >= 0) binsSub(fb, col + (size_t)(j - dx - 1 - c0)*hsize + 16*b*bin, 16, wide);
+          }
+        }
+        last[b] = x;
+
+        int v = 0;
+        while (below + fb[v] <= rank) below += fb[v++];
+        out[(size_t)y*w + x] = (uint8)(16*b + v);
+      }
+    }
+  }
+  if (success) {
+    touchAll(img);
+    memcpy(img->pixel, out, n);
+    PIXMEM += reads + 2*n;  // count pixel reads and writes
+  }
+  errsave = errno;
+  free(out);
+  free(col);
+  errno = errsave;
+  TraceEnd(success ? 2*n : 0);
+  return success;
+}
+
+
+/// Convolution
+
+// A kernel keeps its weights as given, and, when it is separable (the
+// outer product of a column and a row vector), the two factors as well.
+// The row factor is normalized to unit absolute sum.
+//
+// Convolution runs in 16-bit fixed point: weights are scaled by a power of 2
+// and rounded to int16, products are accumulated in int32, and the sum is
+// rounded and shifted back at the end.  A separable kernel takes a row pass
+// into an int16 intermediate (with F fractional bits), followed by a column
+// pass.  The image is processed in vertical strips of KTILE columns, so the
+// intermediate rows of a strip stay in cache; the inner loops always run
+// over a whole strip, with no dependences, so that the compiler turns them
+// into SIMD code.
+
+struct kernel {
+  int width;
+  int height;
+  double bias;     // added to each result, in units of maxval
+  double* weight;  // height*width, row-major
+  double* col;     // separable factors: weight[i*width+j] == col[i]*row[j]
+  double* row;     // (NULL if the kernel is not separable)
+};
+
+#define KTILE 512  // strip width (a multiple of every SIMD width)
+
+/// Create a convolution kernel.
+Kernel KernelCreate(int width, int height, const double* weights, double bias) { ///
+  assert (width > 0 && width % 2 == 1);
+  assert (height > 0 && height % 2 == 1);
+  assert (weights != NULL);
+  int n = width*height;
+  double amax = 0.0, asum = 0.0;
+  int pivot = 0;
+  for (int i = 0; i < n; i++) {
+    double a = fabs(weights[i]);
+    if (a > amax) { amax = a; pivot = i; }
+    asum += a;
+  }
+  // Every weight must be representable in int16 and every sum in int32.
+  if (!(amax <= 32767.0 && (asum + fabs(bias))*PixMax <= 1e9)) {
+    errCause = "Invalid kernel";
+    errno = EINVAL;
+    return NULL;
+  }
+  Kernel k = malloc(sizeof(struct kernel) + sizeof(double)*(n + width + height));
+  if (k == NULL) {
+    errCause = "Out of memory";
+    errno = ENOMEM;
+    return NULL;
+  }
+  k->width = width;
+  k->height = height;
+  k->bias = bias;
+  k->weight = (double*)(k + 1);
+  k->col = k->weight + n;
+  k->row = k->col + height;
+  memcpy(k->weight, weights, sizeof(double)*n);
+
+  // Rank-1 test: factor out the row and the column through the largest
+  // weight, and check that their product gives back every weight.
+  int separable = amax > 0.0;
+  if (separable) {
+    int pi = pivot / width, pj = pivot % width;
+    double rsum = 0.0;
+    for (int j = 0; j < width; j++) {
+      k->row[j] = weights[pi*width + j];
+      rsum += fabs(k->row[j]);
+    }
+    for (int i = 0; i < height; i++) {
+      k->col[i] = weights[i*width + pj] / weights[pivot] * rsum;
+    }
+    for (int j = 0; j < width; j++) k->row[j] /= rsum;
+    for (int i = 0; separable && i < n; i++) {
+      separable = fabs(k->col[i/width]*k->row[i%width] - weights[i]) <= 1e-9*amax;
+    }
+  }
+  if (!separable) k->col = k->row = NULL;
+  return k;
+}
+
+/// Create a normalized Gaussian kernel.
+Kernel KernelGaussian(double sigma) { ///
+  assert (sigma > 0.0);
+  int r = (int)ceil(3.0*sigma);
+  int size = 2*r + 1;
+  double* g = malloc(sizeof(double)*size);
+  double* w = malloc(sizeof(double)*size*size);
+  Kernel k = NULL;
+  if (g != NULL && w != NULL) {
+    double sum = 0.0;
+    for (int i = 0; i < size; i++) {
+      g[i] = exp(-(double)(i - r)*(i - r) / (2.0*sigma*sigma));
+      sum += g[i];
+    }
+    for (int i = 0; i < size; i++) g[i] /= sum;
+    for (int i = 0; i < size*size; i++) w[i] = g[i/size]*g[i%size];
+    k = KernelCreate(size, size, w, 0.0);
+  } else {
+    errCause = "Out of memory";
+    errno = ENOMEM;
+  }
+  free(g);
+  free(w);
+  return k;
+}
+
+/// Destroy the kernel pointed to by (*kp).
+void KernelDestroy(Kernel* kp) { ///
+  assert (kp != NULL);
+  free(*kp);  // a single block
+  *kp = NULL;
+}
+
+/// Check if kernel k is separable.
+int KernelSeparable(Kernel k) { ///
+  assert (k != NULL);
+  return k->row != NULL;
+}
+
+// Largest shift s <= smax such that every |v[i]|*2^s fits in int16, and
+// (sum(|v[i]|)*vmax + extra)*2^s stays below 2^30.
+// Returns -1 if there is none.
+static int fixShift(const double* v, int n, double vmax, double extra, int smax) {
+  double amax = 0.0, asum = 0.0;
+  for (int i = 0; i < n; i++) {
+    amax = fmax(amax, fabs(v[i]));
+    asum += fabs(v[i]);
+  }
+  int s = smax;
+  while (s >= 0 && !(ldexp(amax, s) <= 32767.0 && ldexp(asum*vmax + extra, s) <= 0x1p30)) s--;
+  return s;
+}
+
+// Round v[0..n-1]*2^s to int16 in q, and return the sum of |q[i]|.
+static long quantize(const double* v, int n, int s, int16_t* q) {
+  long sum = 0;
+  for (int i = 0; i < n; i++) {
+    q[i] = (int16_t)lround(ldexp(v[i], s));
+    sum += labs(q[i]);
+  }
+  return sum;
+}
+
+// Map coordinate i into [0, n) as border says, or return -1 for a pixel
+// that is outside and black (BorderZero).
+static inline int borderIndex(int i, int n, BorderMode border) {
+  if (0 <= i && i < n) return i;
+  if (border == BorderClamp) return i < 0 ? 0 : n - 1;
+  if (border == BorderMirror) {  // reflect about the edge pixels: -1 -> 1
+    if (n == 1) return 0;
+    int p = 2*(n - 1);
+    i %= p;
+    if (i < 0) i += p;
+    return i < n ? i : p - i;
+  }
+  return -1;
+}
+
+// Copy pixels x0..x1-1 of row src (of width w) to dst, taking the ones
+// outside the row as border says.
+static void padRow(const uint8* src, int w, int x0, int x1, BorderMode border, uint8* dst) {
+  int a = x0 > 0 ? x0 : 0;
+  int b = x1 < w ? x1 : w;
+  for (int x = x0; x < x1 && x < 0; x++) {
+    int m = borderIndex(x, w, border);
+    *dst++ = m < 0 ? 0 : src[m];
+  }
+  if (a < b) {
+    memcpy(dst, src + a, b - a);
+    dst += b - a;
+  }
+  for (int x = (x0 > w ? x0 : w); x < x1; x++) {
+    int m = borderIndex(x, w, border);
+    *dst++ = m < 0 ? 0 : src[m];
+  }
+}
+
+// acc[x] = sum(q[j]*src[x+j]), for x in [0, KTILE) and j in [0, n).
+static void tapsRow(int32_t* restrict acc, const uint8* restrict src,
+                    const int16_t* restrict q, int n) {
+  for (int x = 0; x < KTILE; x++) acc[x] = 0;
+  for (int j = 0; j < n; j++) {
+    int32_t c = q[j];
+    const uint8* s = src + j;
+    for (int x = 0; x < KTILE; x++) acc[x] += c*s[x];
+  }
+}
+
+// acc[x] += c*t[x], for x in [0, KTILE).
+static void tapsCol(int32_t* restrict acc, const int16_t* restrict t, int32_t c) {
+  for (int x = 0; x < KTILE; x++) acc[x] += c*t[x];
+}
+
+// Round acc[x]/2^s to t[x], for x in [0, KTILE).
+static void storeInter(int16_t* restrict t, const int32_t* restrict acc, int s) {
+  int32_t half = (1 << s) >> 1;
+  for (int x = 0; x < KTILE; x++) t[x] = (int16_t)((acc[x] + half) >> s);
+}
+
+// Round acc[x]/2^s, plus bias, saturated to [0, maxval], to dst[x],
+// for x in [0, n).
+static void storePixels(uint8* restrict dst, const int32_t* restrict acc,
+                        int n, int32_t bias, int s, int maxval) {
+  bias += (1 << s) >> 1;
+  for (int x = 0; x < n; x++) {
+    int32_t v = (acc[x] + bias) >> s;
+    dst[x] = (uint8)(v < 0 ? 0 : v > maxval ? maxval : v);
+  }
+}
+
+// Convolve img with a separable kernel into out, strip by strip.
+// The intermediate rows live in a ring of k->height rows: row r is in slot
+// r % k->height, and the rows an output row needs are never more than
+// k->height apart (also at the borders).
+// Returns 0 if the kernel does not fit in fixed point this way.
+static int convolveSeparable(Image img, Kernel k, BorderMode border, uint8* out) {
+  int w = img->width, h = img->height;
+  int rx = k->width / 2, ry = k->height / 2;
+  int16_t qrow[k->width], qcol[k->height];
+  int sr = fixShift(k->row, k->width, PixMax, 0.0, 30);
+  if (sr < 0) return 0;
+  long rsum = quantize(k->row, k->width, sr, qrow);
+  int f = sr;  // fractional bits kept in the intermediate
+  while (f > 0 && ldexp((double)rsum*PixMax, f - sr) > 32000.0) f--;
+  double tmax = ldexp((double)rsum*PixMax, f - sr) + 1.0;
+  double bias = k->bias*img->maxval;
+  int sc = fixShift(k->col, k->height, tmax, ldexp(fabs(bias), f), 30 - f);
+  if (sc < 0) return 0;
+  quantize(k->col, k->height, sc, qcol);
+  int32_t qbias = (int32_t)lround(ldexp(bias, sc + f));
+
+  int32_t* acc = malloc(sizeof(int32_t)*KTILE);
+  uint8* pad = calloc(KTILE + 2*rx, 1);
+  int16_t* ring = malloc(sizeof(int16_t)*KTILE*k->height);
+  int success = check( acc != NULL && pad != NULL && ring != NULL , "Out of memory" );
+  for (int x0 = 0; success && x0 < w; x0 += KTILE) {
+    int x1 = x0 + KTILE < w ? x0 + KTILE : w;
+    int next = 0;  // next row for the row pass
+    for (int y = 0; y < h; y++) {
+      for (; next < h && next <= y + ry; next++) {
+        padRow(img->pixel + (size_t)next*w, w, x0 - rx, x1 + rx, border, pad);
+        tapsRow(acc, pad, qrow, k->width);
+        storeInter(ring + (size_t)(next % k->height)*KTILE, acc, sr - f);
+      }
+      for (int x = 0; x < KTILE; x++) acc[x] = 0;
+      for (int i = 0; i < k->height; i++) {
+        int m = borderIndex(y + i - ry, h, border);
+        if (m >= 0) tapsCol(acc, ring + (size_t)(m % k->height)*KTILE, qcol[i]);
+      }
+      storePixels(out + (size_t)y*w + x0, acc, x1 - x0, qbias, sc + f, img->maxval);
+    }
+  }
+  free(acc);
+  free(pad);
+  free(ring);
+  return success;
+}
+
+// Convolve img with any kernel into out, strip by strip, row by row.
+static int convolve2D(Image img, Kernel k, BorderMode border, uint8* out) {
+  int w = img->width, h = img->height;
+  int rx = k->width / 2, ry = k->height / 2;
+  int16_t* q = malloc(sizeof(int16_t)*k->width*k->height);
+  int32_t* acc = malloc(sizeof(int32_t)*KTILE);
+  int32_t* sum = malloc(sizeof(int32_t)*KTILE);
+  uint8* pad = calloc(KTILE + 2*rx, 1);
+  int success = check( q != NULL && acc != NULL && sum != NULL && pad != NULL , "Out of memory" );
+  double bias = k->bias*img->maxval;
+  int s = success ? fixShift(k->weight, k->width*k->height, PixMax, fabs(bias), 30) : 0;
+  assert (s >= 0);  // as checked by KernelCreate
+  if (success) quantize(k->weight, k->width*k->height, s, q);
+  int32_t qbias = (int32_t)lround(ldexp(bias, s));
+  for (int x0 = 0; success && x0 < w; x0 += KTILE) {
+    int x1 = x0 + KTILE < w ? x0 + KTILE : w;
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < KTILE; x++) sum[x] = 0;
+      for (int i = 0; i < k->height; i++) {
+        int m = borderIndex(y + i - ry, h, border);
+        if (m < 0) continue;
+        padRow(img->pixel + (size_t)m*w, w, x0 - rx, x1 + rx, border, pad);
+        tapsRow(acc, pad, q + i*k->width, k->width);
+        for (int x = 0; x < KTILE; x++) sum[x] += acc[x];
+      }
+      storePixels(out + (size_t)y*w + x0, sum, x1 - x0, qbias, s, img->maxval);
+    }
+  }
+  free(q);
+  free(acc);
+  free(sum);
+  free(pad);
+  return success;
+}
+
+// (Among the verifyX functions above, if it were not for struct kernel.)
+static int verifyConvolve(Image img, Kernel k, BorderMode border) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = verifyCopy(img);
+  if (ref != NULL && !RefConvolve(ref, k->width, k->height, k->weight, k->bias, border)) {
+    ImageDestroy(&ref);
+  }
+  verifyResume(count);
+  int ok = ImageConvolve(img, k, border);
+  verifyNear(ok ? img : NULL, ref, ref, "ImageConvolve(%dx%d kernel, bias=%.17g, border=%d)",
+             k->width, k->height, k->bias, border);
+  return ok;
+}
+
+/// Convolve an image with a kernel.
+int ImageConvolve(Image img, Kernel k, BorderMode border) { ///
+  assert (img != NULL);
+  assert (k != NULL);
+  if (verifying()) return verifyConvolve(img, k, border);
+  TraceBegin("ImageConvolve", "kernel");
+  makeWritable(img);
+  size_t n = (size_t)img->width*img->height;
+  uint8* out = NULL;
+  int success =
+  check( (out = malloc(n + 1)) != NULL , "Out of memory" ) &&
+  ((k->row != NULL && convolveSeparable(img, k, border, out)) ||
+   convolve2D(img, k, border, out));
+  if (success) {
+    touchAll(img);
+    memcpy(img->pixel, out, n);
+    int taps = k->row != NULL ? k->width + k->height : k->width*k->height;
+    PIXMEM += n*(taps + 1);  // count pixel reads and writes
+  }
+  errsave = errno;
+  free(out);
+  errno = errsave;
+  TraceEnd(success ? 2*n : 0);
+  return success;
+}
+
+
+/// Morphology
+
+// Erosion and dilation with a rectangle are separable: a min (or max)
+// over the rows of the window, then over its columns.  Each 1-D pass uses
+// the algorithm of van Herk and of Gil and Werman: split the (padded)
+// line in blocks of k = 2r+1, take running mins g forward and h backward
+// within each block; then the min of the window starting at p is
+// min(h[p], g[p+k-1]), which costs 3 comparisons per pixel for any k.
+// The vertical pass runs on strips of MSTRIP columns, taking mins of whole
+// strip rows, which the compiler vectorizes; the horizontal pass transposes
+// the image, runs the vertical pass and transposes back.
+
+#define MSTRIP 256   // strip width (a multiple of every SIMD width)
+#define TBLOCK 16    // transpose block size
+
+// d[i] = min(d[i], a[i]) (or max, if dilate), for i in [0, MSTRIP).
+static void stripMinMax(uint8* restrict d, const uint8* restrict a, int dilate) {
+  if (dilate) {
+    for (int i = 0; i < MSTRIP; i++) d[i] = d[i] > a[i] ? d[i] : a[i];
+  } else {
+    for (int i = 0; i < MSTRIP; i++) d[i] = d[i] < a[i] ? d[i] : a[i];
+  }
+}
+
+// Replace each pixel of the w x h image pix by the min (or max, if dilate)
+// of the pixels of rows [y-r, y+r] of its column that are inside the image.
+// buf must hold 2*npad*MSTRIP bytes, where npad is h+2r rounded up to a
+// multiple of 2r+1.
+static void morphColumns(uint8* pix, int w, int h, int r, int dilate, uint8* buf) {
+  int k = 2*r + 1;
+  int npad = (h + 2*r + k - 1) / k * k;
+  uint8* g = buf;                            // forward running min
+  uint8* hb = buf + (size_t)npad*MSTRIP;     // padded rows, then backward min
+  uint8 identity = dilate ? 0 : PixMax;      // pixels outside do not count
+  for (int x0 = 0; x0 < w; x0 += MSTRIP) {
+    int sw = w - x0 < MSTRIP ? w - x0 : MSTRIP;
+    for (int p = 0; p < npad; p++) {
+      uint8* row = hb + (size_t)p*MSTRIP;
+      int y = p - r;
+      if (0 <= y && y < h) {
+        memcpy(row, pix + (size_t)y*w + x0, sw);
+        memset(row + sw, identity, MSTRIP - sw);
+      } else {
+        memset(row, identity, MSTRIP);
+      }
+    }
+    for (int p = 0; p < npad; p++) {
+      uint8* row = g + (size_t)p*MSTRIP;
+      memcpy(row, hb + (size_t)p*MSTRIP, MSTRIP);
+      if (p % k != 0) stripMinMax(row, row - MSTRIP, dilate);
+    }
+    for (int p = npad - 2; p >= 0; p--) {
+      uint8* row = hb + (size_t)p*MSTRIP;
+      if (p % k != k - 1) stripMinMax(row, row + MSTRIP, dilate);
+    }
+    uint8 out[MSTRIP];
+    for (int y = 0; y < h; y++) {
+      memcpy(out, hb + (size_t)y*MSTRIP, MSTRIP);
+      stripMinMax(out, g + (size_t)(y + k - 1)*MSTRIP, dilate);
+      memcpy(pix + (size_t)y*w + x0, out, sw);
+    }
+  }
+  COMPARISONS += 3*(size_t)w*h;
+  PIXMEM += 2*(size_t)w*h;  // count pixel reads and writes
+}
+
+// Transpose the w x h image src into the h x w image dst, by blocks.
+static void transpose(const uint8* restrict src, uint8* restrict dst, int w, int h) {
+  for (int y0 = 0; y0 < h; y0 += TBLOCK) {
+    for (int x0 = 0; x0 < w; x0 += TBLOCK) {
+      int y1 = y0 + TBLOCK < h ? y0 + TBLOCK : h;
+      int x1 = x0 + TBLOCK < w ? x0 + TBLOCK : w;
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) dst[(size_t)x*h + y] = src[(size_t)y*w + x];
+      }
+    }
+  }
+  PIXMEM += 2*(size_t)w*h;  // count pixel reads and writes
+}
+
+// Erode (or dilate) img with a (2dx+1)x(2dy+1) rectangle.
+// Returns 0 on failure, with img unmodified.
+static int morph(Image img, int dx, int dy, int dilate) {
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  makeWritable(img);
+  int w = img->width, h = img->height;
+  // Larger windows hold the same pixels
+  if (dx >= w) dx = w > 0 ? w - 1 : 0;
+  if (dy >= h) dy = h > 0 ? h - 1 : 0;
+  int kx = 2*dx + 1, ky = 2*dy + 1;
+  size_t npad = (size_t)(h + 2*dy + ky - 1) / ky * ky;
+  size_t npadx = (size_t)(w + 2*dx + kx - 1) / kx * kx;
+  if (dx > 0 && npadx > npad) npad = npadx;
+  uint8* buf = NULL;
+  uint8* t = NULL;   // transposed image
+  int success =
+  check( (buf = malloc(2*npad*MSTRIP)) != NULL &&
+         (dx == 0 || (t = malloc((size_t)w*h + 1)) != NULL) , "Out of memory" );
+  if (success) touchAll(img);
+  if (success && dy > 0) {
+    morphColumns(img->pixel, w, h, dy, dilate, buf);
+  }
+  if (success && dx > 0) {
+    transpose(img->pixel, t, w, h);
+    morphColumns(t, h, w, dx, dilate, buf);
+    transpose(t, img->pixel, h, w);
+  }
+  errsave = errno;
+  free(buf);
+  free(t);
+  errno = errsave;
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+int ImageErode(Image img, int dx, int dy) { ///
+  if (verifying()) return verifyFilter(ImageErode, RefErode, "ImageErode", img, dx, dy);
+  TraceBegin("ImageErode", "kernel");
+  int success = morph(img, dx, dy, 0);
+  TraceEnd(success ? 2*(size_t)img->width*img->height : 0);
+  return success;
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+int ImageDilate(Image img, int dx, int dy) { ///
+  if (verifying()) return verifyFilter(ImageDilate, RefDilate, "ImageDilate", img, dx, dy);
+  TraceBegin("ImageDilate", "kernel");
+  int success = morph(img, dx, dy, 1);
+  TraceEnd(success ? 2*(size_t)img->width*img->height : 0);
+  return success;
+}
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle.
+int ImageOpen(Image img, int dx, int dy) { ///
+  if (verifying()) return verifyFilter(ImageOpen, refOpen, "ImageOpen", img, dx, dy);
+  TraceBegin("ImageOpen", "kernel");
+  int success = morph(img, dx, dy, 0) && morph(img, dx, dy, 1);
+  TraceEnd(success ? 4*(size_t)img->width*img->height : 0);
+  return success;
+}
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle.
+int ImageClose(Image img, int dx, int dy) { ///
+  if (verifying()) return verifyFilter(ImageClose, refClose, "ImageClose", img, dx, dy);
+  TraceBegin("ImageClose", "kernel");
+  int success = morph(img, dx, dy, 1) && morph(img, dx, dy, 0);
+  TraceEnd(success ? 4*(size_t)img->width*img->height : 0);
+  return success;
+}
+
+
+/// Binary images
+
+// A bitmap is stored as rows of 64-bit words.  Pixel (x,y) is bit x%64
+// (counting from the least significant) of word x/64 of row y.
+// Each row starts at a word boundary, and the unused high bits of the last
+// word of each row are always kept at 0, so that whole words may be
+// compared and counted directly.
+
+typedef uint64_t word;
+
+#define WORDBITS 64
+
+struct bitmap {
+  int width;
+  int height;
+  size_t stride;  // words per row
+  word* bits;     // height*stride words
+};
+
+// Number of bits set in w.
+static inline int popcount(word w) {
+#ifdef __GNUC__
+  return __builtin_popcountll(w);
+#else
+  w = w - ((w >> 1) & 0x5555555555555555u);
+  w = (w & 0x3333333333333333u) + ((w >> 2) & 0x3333333333333333u);
+  w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0Fu;
+  return (int)((w * 0x0101010101010101u) >> 56);
+#endif
+}
+
+// Mask with the n (1..64) low bits set.
+static inline word lowMask(int n) {
+  return n >= WORDBITS ? ~(word)0 : ((word)1 << n) - 1;
+}
+
+// Get n (1..64) bits starting at bit position pos of row a.
+static inline word getBits(const word* a, size_t pos, int n) {
+  size_t i = pos / WORDBITS;
+  int sh = (int)(pos % WORDBITS);
+  word v = a[i] >> sh;
+  if (sh != 0 && sh + n > WORDBITS) v |= a[i+1] << (WORDBITS - sh);
+  return v & lowMask(n);
+}
+
+// Store the n (1..64) low bits of v at bit position pos of row a.
+static inline void putBits(word* a, size_t pos, word v, int n) {
+  size_t i = pos / WORDBITS;
+  int sh = (int)(pos % WORDBITS);
+  word m = lowMask(n);
+  v &= m;
+  a[i] = (a[i] & ~(m << sh)) | (v << sh);
+  if (sh != 0 && sh + n > WORDBITS) {
+    a[i+1] = (a[i+1] & ~(m >> (WORDBITS - sh))) | (v >> (WORDBITS - sh));
+  }
+}
+
+// Verification of the bitmap operations
+// (Among the verifyX functions above, if it were not for struct bitmap.)
+
+// A copy of bm, to run a reference operation on (or NULL).
+static Bitmap verifyBitmapCopy(Bitmap bm) {
+  Bitmap copy = BitmapCreate(bm->width, bm->height);
+  if (copy != NULL) memcpy(copy->bits, bm->bits, bm->stride*bm->height*sizeof(word));
+  return copy;
+}
+
+// Finish verifying a bitmap operation: compare its result out with the
+// reference result ref (if they both exist), pixel by pixel and then word
+// by word (for the padding bits), and report the first difference, with
+// the operation described by format op and its arguments.  Destroys ref.
+static void verifyBitmap(Bitmap out, Bitmap ref, const char* op, ...) {
+  int errsave = errno;
+  char* cause = errCause;
+  char what[128] = "";
+  if (out == NULL || ref == NULL) {
+    // (The operation or the reference failed: nothing to compare.)
+  } else if (out->width != ref->width || out->height != ref->height) {
+    snprintf(what, sizeof(what), "result is %dx%d, reference %dx%d",
+             out->width, out->height, ref->width, ref->height);
+  } else {
+    size_t differ = 0;
+    int fx = 0, fy = 0;
+    for (int y = 0; y < out->height; y++) {
+      for (int x = 0; x < out->width; x++) {
+        if (BitmapGetPixel(out, x, y) != BitmapGetPixel(ref, x, y) && differ++ == 0) {
+          fx = x; fy = y;
         }
       }
+    }
+    if (differ > 0) {
+      snprintf(what, sizeof(what), "pixel (%d,%d) is %d, reference %d (%zu of %dx%d pixels differ)",
+               fx, fy, BitmapGetPixel(out, fx, fy), BitmapGetPixel(ref, fx, fy),
+               differ, out->width, out->height);
+    } else if (memcmp(out->bits, ref->bits, out->stride*out->height*sizeof(word)) != 0) {
+      snprintf(what, sizeof(what), "padding bits are set");
+    }
+  }
+  if (what[0] != '\0') {
+    char desc[256];
+    va_list args;
+    va_start(args, op);
+    vsnprintf(desc, sizeof(desc), op, args);
+    va_end(args);
+    verifyReport(desc, what);
+  }
+  BitmapDestroy(&ref);
+  verifyDepth--;
+  errCause = cause;
+  errno = errsave;
+}
+
+static Bitmap verifyThresholdBitmap(Image img, uint8 thr) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Bitmap ref = RefThresholdBitmap(img, thr);
+  verifyResume(count);
+  Bitmap bm = ImageThresholdBitmap(img, thr);
+  verifyBitmap(bm, ref, "ImageThresholdBitmap(thr=%d)", thr);
+  return bm;
+}
+
+static Image verifyBitmapToImage(Bitmap bm, uint8 maxval) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Image ref = RefBitmapToImage(bm, maxval);
+  verifyResume(count);
+  Image img = BitmapToImage(bm, maxval);
+  verifyImage(img, ref, "BitmapToImage(maxval=%d)", maxval);
+  return img;
+}
+
+static size_t verifyBitmapCount(Bitmap bm) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  size_t ref = RefBitmapCount(bm);
+  verifyResume(count);
+  size_t n = BitmapCount(bm);
+  verifyDepth--;
+  if (n != ref) {
+    char desc[64], what[64];
+    snprintf(desc, sizeof(desc), "BitmapCount(%dx%d)", bm->width, bm->height);
+    snprintf(what, sizeof(what), "result is %zu, reference %zu", n, ref);
+    verifyReport(desc, what);
+  }
+  return n;
+}
 
-     // Calcula o valor médio (+0.5 para arredondamentos) e define-o no pixel de saída
-      if (count > 0) {
-        pix_filter = (sum / count + 0.5) ;
-        ImageSetPixel(img_copia, i, j, pix_filter);
-        PIXMEM++; 
+// Verify bitwise operation fn, with reference ref, called name.
+static void verifyBitwise(void (*fn)(Bitmap, Bitmap), void (*ref)(Bitmap, Bitmap),
+                          const char* name, Bitmap bm1, Bitmap bm2) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Bitmap copy = verifyBitmapCopy(bm1);
+  if (copy != NULL) ref(copy, bm2);
+  verifyResume(count);
+  fn(bm1, bm2);
+  verifyBitmap(bm1, copy, "%s(%dx%d)", name, bm1->width, bm1->height);
+}
+
+static void verifyBitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) {
+  unsigned long long count[NUMCOUNTERS];
+  verifyPause(count);
+  Bitmap ref = verifyBitmapCopy(bm1);
+  if (ref != NULL) RefBitmapPaste(ref, x, y, bm2);
+  verifyResume(count);
+  BitmapPaste(bm1, x, y, bm2);
+  verifyBitmap(bm1, ref, "BitmapPaste(x=%d, y=%d, %dx%d)", x, y, bm2->width, bm2->height);
+}
+
+static int verifyBitmapLocate(Bitmap bm1, int* px, int* py, Bitmap bm2) {
+  unsigned long long count[NUMCOUNTERS];
+  int rx = -1, ry = -1;
+  verifyPause(count);
+  int ref = RefBitmapLocate(bm1, &rx, &ry, bm2);
+  verifyResume(count);
+  int found = BitmapLocate(bm1, px, py, bm2);
+  verifyDepth--;
+  if (found != ref || (found && (*px != rx || *py != ry))) {
+    char desc[96], what[96];
+    snprintf(desc, sizeof(desc), "BitmapLocate(%dx%d in %dx%d)",
+             bm2->width, bm2->height, bm1->width, bm1->height);
+    snprintf(what, sizeof(what), "result is %d at (%d,%d), reference %d at (%d,%d)",
+             found, found ? *px : -1, found ? *py : -1, ref, rx, ry);
+    verifyReport(desc, what);
+  }
+  return found;
+}
+
+/// Create a new black (all 0) bitmap.
+Bitmap BitmapCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  Bitmap bm = malloc(sizeof(struct bitmap));
+  if (bm == NULL) {
+    errCause = "Out of memory";
+    errno = ENOMEM;
+    return NULL;
+  }
+  bm->width = width;
+  bm->height = height;
+  bm->stride = ((size_t)width + WORDBITS - 1) / WORDBITS;
+  bm->bits = calloc(bm->stride * height + 1, sizeof(word));  // never 0
+  if (bm->bits == NULL) {
+    free(bm);
+    errCause = "Out of memory";
+    errno = ENOMEM;
+    return NULL;
+  }
+  return bm;
+}
+
+/// Destroy the bitmap pointed to by (*bmp).
+void BitmapDestroy(Bitmap* bmp) { ///
+  assert (bmp != NULL);
+  if (*bmp == NULL) return;
+  free((*bmp)->bits);
+  free(*bmp);
+  *bmp = NULL;
+}
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bm) { ///
+  assert (bm != NULL);
+  return bm->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bm) { ///
+  assert (bm != NULL);
+  return bm->height;
+}
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitmapGetPixel(Bitmap bm, int x, int y) { ///
+  assert (bm != NULL);
+  assert (0 <= x && x < bm->width && 0 <= y && y < bm->height);
+  return (int)(bm->bits[y*bm->stride + x/WORDBITS] >> (x % WORDBITS)) & 1;
+}
+
+/// Set the pixel at position (x,y) to 1 if bit is nonzero, 0 otherwise.
+void BitmapSetPixel(Bitmap bm, int x, int y, int bit) { ///
+  assert (bm != NULL);
+  assert (0 <= x && x < bm->width && 0 <= y && y < bm->height);
+  word* w = &bm->bits[y*bm->stride + x/WORDBITS];
+  word m = (word)1 << (x % WORDBITS);
+  *w = bit ? (*w | m) : (*w & ~m);
+}
+
+/// Threshold an image into a new bitmap.
+Bitmap ImageThresholdBitmap(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  if (verifying()) return verifyThresholdBitmap(img, thr);
+  Bitmap bm = BitmapCreate(img->width, img->height);
+  if (bm == NULL) return NULL;
+  materialize(img);
+
+  // Build each word from up to 64 branch-free comparisons
+  for (int y = 0; y < img->height; y++) {
+    const uint8* p = img->pixel + (size_t)y*img->width;
+    word* row = bm->bits + y*bm->stride;
+    for (int x0 = 0; x0 < img->width; x0 += WORDBITS) {
+      int n = img->width - x0 < WORDBITS ? img->width - x0 : WORDBITS;
+      word v = 0;
+      for (int i = 0; i < n; i++) {
+        v |= (word)(p[x0 + i] >= thr) << i;
       }
+      row[x0 / WORDBITS] = v;
     }
   }
-  // Substitui a imagem original pela imagem desfocada
-  ImagePaste(img,0,0,img_copia);
+  PIXMEM += (size_t)img->width*img->height;  // count pixel reads
+  return bm;
+}
+
+/// Convert a bitmap to a new image with levels 0 and maxval.
+Image BitmapToImage(Bitmap bm, uint8 maxval) { ///
+  assert (bm != NULL);
+  if (verifying()) return verifyBitmapToImage(bm, maxval);
+  Image img = ImageCreate(bm->width, bm->height, maxval);
+  if (img == NULL) return NULL;
+
+  for (int y = 0; y < bm->height; y++) {
+    uint8* p = img->pixel + (size_t)y*bm->width;
+    const word* row = bm->bits + y*bm->stride;
+    for (int x = 0; x < bm->width; x++) {
+      // -0 = 0x00, -1 = 0xFF
+      p[x] = (uint8)(-(int)((row[x / WORDBITS] >> (x % WORDBITS)) & 1)) & maxval;
+    }
+  }
+  PIXMEM += (size_t)bm->width*bm->height;  // count pixel writes
+  return img;
+}
+
+/// Count the pixels set to 1.
+size_t BitmapCount(Bitmap bm) { ///
+  assert (bm != NULL);
+  if (verifying()) return verifyBitmapCount(bm);
+  size_t count = 0;
+  size_t n = bm->stride * bm->height;
+  for (size_t i = 0; i < n; i++) {
+    count += popcount(bm->bits[i]);  // padding bits are 0
+  }
+  return count;
+}
+
+/// Bitwise operations.
+/// Combine bm2 into bm1, pixel by pixel, with logical and, or, xor.
+/// (Padding bits stay 0 in all three.)
+void BitmapAnd(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (bm1->width == bm2->width && bm1->height == bm2->height);
+  if (verifying()) { verifyBitwise(BitmapAnd, RefBitmapAnd, "BitmapAnd", bm1, bm2); return; }
+  size_t n = bm1->stride * bm1->height;
+  for (size_t i = 0; i < n; i++) bm1->bits[i] &= bm2->bits[i];
+}
 
+void BitmapOr(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (bm1->width == bm2->width && bm1->height == bm2->height);
+  if (verifying()) { verifyBitwise(BitmapOr, RefBitmapOr, "BitmapOr", bm1, bm2); return; }
+  size_t n = bm1->stride * bm1->height;
+  for (size_t i = 0; i < n; i++) bm1->bits[i] |= bm2->bits[i];
 }
 
+void BitmapXor(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (bm1->width == bm2->width && bm1->height == bm2->height);
+  if (verifying()) { verifyBitwise(BitmapXor, RefBitmapXor, "BitmapXor", bm1, bm2); return; }
+  size_t n = bm1->stride * bm1->height;
+  for (size_t i = 0; i < n; i++) bm1->bits[i] ^= bm2->bits[i];
+}
+
+/// Paste bitmap bm2 into position (x, y) of bm1.
+void BitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (0 <= x && 0 <= y);
+  assert (x + bm2->width <= bm1->width && y + bm2->height <= bm1->height);
+  if (verifying()) { verifyBitmapPaste(bm1, x, y, bm2); return; }
+
+  // Copy 64 bits at a time, shifted into position x
+  for (int j = 0; j < bm2->height; j++) {
+    const word* src = bm2->bits + j*bm2->stride;
+    word* dst = bm1->bits + (y + j)*bm1->stride;
+    for (int i = 0; i < bm2->width; i += WORDBITS) {
+      int n = bm2->width - i < WORDBITS ? bm2->width - i : WORDBITS;
+      putBits(dst, (size_t)x + i, src[i / WORDBITS], n);
+    }
+  }
+}
+
+// Compare bm2 to the sub-bitmap of bm1 at position (x, y), 64 bits at a time.
+static int bitmapMatch(Bitmap bm1, int x, int y, Bitmap bm2) {
+  for (int j = 0; j < bm2->height; j++) {
+    const word* src = bm2->bits + j*bm2->stride;
+    const word* row = bm1->bits + (y + j)*bm1->stride;
+    for (int i = 0; i < bm2->width; i += WORDBITS) {
+      int n = bm2->width - i < WORDBITS ? bm2->width - i : WORDBITS;
+      COMPARISONS++;
+      if (getBits(row, (size_t)x + i, n) != src[i / WORDBITS]) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate a sub-bitmap inside another bitmap.
+int BitmapLocate(Bitmap bm1, int* px, int* py, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  if (verifying()) return verifyBitmapLocate(bm1, px, py, bm2);
+  // Scan positions in the same order as ImageLocateSubImage
+  // (and, like it, only valid ones, even for an empty bm2)
+  for (int i = 0; i < bm1->width && i <= bm1->width - bm2->width; i++) {
+    for (int j = 0; j < bm1->height && j <= bm1->height - bm2->height; j++) {
+      if (bitmapMatch(bm1, i, j, bm2)) {
+        *px = i;
+        *py = j;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -39,6 +40,59 @@ char* ImageErrMsg() ;
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) ;
 
+/// Parallel execution
+
+/// Operations on large images run on a pool of threads, created on first
+/// use.  The number of threads is the number of CPUs, or the value of the
+/// IMAGE_THREADS environment variable, if set (at most 16).
+
+/// Number of threads used by parallel image operations.
+int ImageThreads(void) ;
+
+/// Set the number of threads used by parallel image operations.
+/// n = 1 makes every operation run in the calling thread;
+/// n < 1 restores the default.
+/// Must not be called while an operation is running on another thread.
+void ImageSetThreads(int n) ;
+
+/// Type of range functions: process items [i0, i1), on behalf of worker
+/// number worker (in [0, ImageThreads()), so partial results may be kept
+/// per worker without locking).
+typedef void (*ImageRangeFn)(int i0, int i1, int worker, void* arg);
+
+/// Run fn over items [0, n), split in chunks of grain items, on the pool
+/// threads and the calling thread, and wait for all chunks to be done.
+/// Threads that finish their share early steal chunks from the others.
+/// fn may be called several times per worker, in any order; it must not
+/// touch the instrumentation counters.  When the pool is busy (fn itself
+/// calls ImageParallelFor, or another thread is using it), all chunks run
+/// in the calling thread, as worker 0.
+void ImageParallelFor(int n, int grain, ImageRangeFn fn, void* arg) ;
+
+/// Verification
+
+/// The statistics and hash, pixel transformations, geometric
+/// transformations, operations on two images, filters and bitmap
+/// operations have simple reference versions in module imageRef, written
+/// pixel by pixel with the accessors.  In verification mode, every call to
+/// one of them also runs its reference version on a copy of its input and
+/// compares the results: exactly, except for resizing, arbitrary rotation
+/// and convolution (within one level) and the variance of ImageStatsFull
+/// (up to rounding).  A mismatch is reported on stderr, with the operation,
+/// its parameters and the first pixel that differs.  Operations take much
+/// longer, but the results and the instrumentation counters are those of
+/// the optimized versions.  Loading and saving, and the accessors the
+/// references are written with, are not verified.  The mode is on from
+/// ImageInit when the IMAGE_VERIFY environment variable is set to a
+/// nonzero number.
+
+/// Turn verification mode on (if on is nonzero) or off.
+void ImageSetVerify(int on) ;
+
+/// Number of operations whose results did not match their reference
+/// versions, so far.
+size_t ImageVerifyMismatches(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -51,6 +105,19 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black sparse image.
+/// As ImageCreate, but pixels are kept in 64x64 tiles, allocated when first
+/// written, so that memory grows with the parts of the image written.
+/// Pasting and blending into the image, saving it, cropping it and getting
+/// or setting pixels work on the allocated tiles; other operations first
+/// convert it to an ordinary image (and that never fails).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateSparse(int width, int height, uint8 maxval) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -73,6 +140,91 @@ Image ImageLoad(const char* filename) ;
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Load a rectangular region of a raw PGM file.
+/// The region is specified by the top left corner coords (x, y) and
+/// width w and height h, as in ImageCrop.
+/// Only the header and the pixels inside the region are read from the file
+/// (with positioned reads), so the cost depends on the region size only.
+/// On success, a new w x h image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a region that does not fit inside the image),
+/// returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
+
+/// Compressed graymap files
+
+/// Images may also be stored in a compact lossless format (ZGM, for
+/// Z-compressed graymap), with a PGM-like header and magic number "Z5".
+/// It is very effective on images with flat areas, such as thresholded
+/// masks and scans, and decodes much faster than disks can read.
+
+/// Load a compressed graymap (ZGM) file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) ;
+
+/// Save image to a compressed graymap (ZGM) file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename) ;
+
+/// Shared memory images
+
+/// Images may live in named POSIX shared memory segments, so that other
+/// processes can map the same pixels: handing an image over copies nothing.
+/// Names are like file names (a leading / is added if missing).
+/// Modifying a shared image in-place is seen by every process that opened it.
+/// ImageDestroy unmaps a shared image, but the segment persists until
+/// ImageRemoveShared is called.
+
+/// Create a new black image in shared memory segment name.
+/// An existing segment with the same name is replaced
+/// (images already open on it are not affected).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) ;
+
+/// Open the image in shared memory segment name (without copying it).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageOpenShared(const char* name) ;
+
+/// Remove shared memory segment name.
+/// Images already open on it remain valid.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageRemoveShared(const char* name) ;
+
+/// Multi-frame PGM streams
+
+/// A PGM stream may contain several images (frames) simply concatenated,
+/// as produced by cameras and by netpbm tools.
+/// These functions read and write one frame at a time on an open stream,
+/// which may be a regular file, a pipe, stdin or stdout.
+
+/// Check if there are no more frames in stream f.
+/// Skips whitespace between frames.
+/// Returns nonzero at end-of-stream, 0 if another frame follows.
+int ImageEndOfStream(FILE* f) ;
+
+/// Load the next frame from PGM stream f.
+/// The stream is left positioned right after the frame's last pixel.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadFrame(FILE* f) ;
+
+/// Append image img as a new frame to PGM stream f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveFrame(Image img, FILE* f) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -91,8 +243,32 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (For an empty image, both are set to 0.)
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Compute the histogram of img.
+/// On return, hist[v] is the number of pixels with level v, for v in [0, 255].
+/// Large images are processed by several threads.
+void ImageHistogram(Image img, size_t hist[256]) ;
+
+/// Full image statistics
+typedef struct {
+  size_t count;       // number of pixels
+  uint8 min, max;     // gray level range (0, 0 for an empty image)
+  double mean;        // mean gray level
+  double variance;    // (population) variance of the gray levels
+  size_t hist[256];   // histogram, as in ImageHistogram
+} ImageStatistics;
+
+/// Compute the statistics of img, in a single pass over the pixels.
+void ImageStatsFull(Image img, ImageStatistics* st) ;
+
+/// Compute a 64-bit hash of the contents of img (its size, maxval and
+/// pixels), starting from seed.  Images with the same contents have the
+/// same hash, whatever their internal layout (views, sparse tiles).
+/// Different contents collide with probability about 2^-64.
+uint64_t ImageHash(Image img, uint64_t seed) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -112,6 +288,36 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Row access operations
+
+/// These give direct access to whole rows of pixels, which are stored
+/// contiguously, from left to right.  Preconditions are checked and
+/// pixel accesses are counted once per row, not once per pixel, so they
+/// are the fast way to implement new operations on top of this module.
+
+/// Get a pointer to the first pixel of row y.
+/// Pixel (x,y) is at ImageRowPtr(img, y)[x], for 0 <= x < ImageWidth(img).
+/// The pointer remains valid until img is destroyed.
+/// Writing through it modifies img.
+/// Counts one access per pixel of the row.
+uint8* ImageRowPtr(Image img, int y) ;
+
+/// Copy the w pixels from (x,y) to (x+w-1,y) into buf.
+/// Requires: the pixels must be inside img.
+void ImageGetRow(Image img, int x, int y, int w, uint8* buf) ;
+
+/// Copy the w pixels in buf to positions (x,y) to (x+w-1,y).
+/// Requires: the pixels must be inside img.
+void ImageSetRow(Image img, int x, int y, int w, const uint8* buf) ;
+
+/// Type of row functions for ImageForEachRow.
+/// Receives the row index y, a pointer to its pixels (which may be
+/// modified), the image width and the arg given to ImageForEachRow.
+typedef void (*ImageRowFn)(int y, uint8* row, int width, void* arg) ;
+
+/// Call fn for every row of img, from top to bottom.
+void ImageForEachRow(Image img, ImageRowFn fn, void* arg) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +341,17 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Equalize the histogram of an image.
+/// Each level is mapped to its cumulative frequency, scaled so that the
+/// lowest level in the image becomes black and the highest becomes white,
+/// which spreads the most frequent levels apart and enhances contrast.
+void ImageEqualize(Image img) ;
+
+/// Stretch the contrast of an image to the full range (auto-levels).
+/// Levels are scaled linearly, so that the minimum level in the image
+/// becomes 0 and the maximum becomes maxval.
+void ImageStretch(Image img) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -147,7 +364,10 @@ void ImageBrighten(Image img, double factor) ;
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counter-clockwise.
+/// This takes constant time: the result is a lazy view of img, whose pixels
+/// are only moved when (and if) some operation needs them in raster order.
+/// (So a view and img must not be used by different threads at once.)
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -157,6 +377,7 @@ Image ImageRotate(Image img) ;
 
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
+/// This takes constant time, like ImageRotate.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -178,6 +399,35 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// How ImageResize computes each pixel.
+typedef enum {
+  ResizeNearest,   // copy the nearest source pixel (fast, blocky)
+  ResizeBilinear,  // interpolate the 2x2 nearest source pixels
+  ResizeArea,      // average the source pixels covered (best to shrink)
+} ResizeMode;
+
+/// Resize an image.
+/// Returns a w x h version of img, scaled independently in each direction.
+/// Requires: w and h must be non-negative.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeMode mode) ;
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of img rotated degrees counter-clockwise about its
+/// center, with the same size.  Pixels that come from outside img are black
+/// (those that come from its edges, up to rounding errors, are not).
+/// interp must be ResizeNearest or ResizeBilinear.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, ResizeMode interp) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -186,6 +436,20 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
+/// Paste the pixels of img2 selected by mask into position (x, y) of img1.
+/// Only the pixels of img2 where mask is nonzero are pasted; the others
+/// leave img1 unchanged.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and
+/// mask must have the same size as img2.
+void ImagePasteMasked(Image img1, int x, int y, Image img2, Image mask) ;
+
+/// Paste img2 into position (x, y) of img1, except for its pixels of level
+/// key (color keying), which leave img1 unchanged.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void ImagePasteKeyed(Image img1, int x, int y, Image img2, uint8 key) ;
+
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -194,6 +458,21 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// A layer to blend: image img at position (x, y), with factor alpha.
+typedef struct {
+  Image img;
+  int x, y;
+  double alpha;
+} ImageLayer;
+
+/// Blend n layers into img, in order.
+/// The result is the same as calling ImageBlend for each layer in turn,
+/// but img is traversed only once, tile by tile, so each tile is loaded
+/// and stored only once, however many layers cover it.
+/// This modifies img in-place: no allocation involved.
+/// Requires: every layer must fit inside img at its position.
+void ImageBlendMany(Image img, const ImageLayer* layers, int n) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -202,6 +481,7 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// (Of several matches, the one with the least x, and then the least y.)
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
@@ -211,6 +491,200 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// It takes constant time per pixel, whatever the window size.
+/// Requires: dx, dy >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Blur an image into another one, recomputing only what changed.
+/// Sets out to img blurred as by ImageBlur (img is not modified).
+/// Images keep track of the rectangles of pixels modified in-place (by
+/// ImagePaste, ImageBlend, ImageSetPixel and all other operations), so
+/// when out was last set by this function from img, with the same dx and
+/// dy, and was not modified since, only the pixels within (dx, dy) of
+/// those modified in img since then are recomputed.  Thus small edits to
+/// a large image cost time in proportion to the edit.  Otherwise, all
+/// pixels are computed.  (Each image remembers only the last out set from
+/// it.  Writes through a pointer from ImageRowPtr count as made when it
+/// was returned.)
+/// Requires: out != img, with the same size; dx, dy as in ImageBlur.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and out may be partly updated (the next call will compute it all).
+int ImageBlurUpdate(Image img, Image out, int dx, int dy) ;
+
+/// Median filter an image, with a (2dx+1)x(2dy+1) window.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image (the lower one,
+/// when there is an even number of them).
+/// This removes salt-and-pepper noise while keeping edges sharp.
+/// It takes constant time per pixel, whatever the window size.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Convolution
+
+/// A kernel is a width x height matrix of weights (both dimensions odd),
+/// centered on the pixel being computed.
+/// Convolving an image substitutes each pixel by the sum of the weights
+/// times the pixels around it, plus a bias (in units of maxval), rounded
+/// and saturated to [0, maxval].  (Strictly, this is a correlation: the
+/// kernel is not flipped.)
+/// Kernels that are the product of a column and a row (such as Gaussians
+/// and Sobel operators) are detected and applied as two 1-D passes, which
+/// costs width+height operations per pixel instead of width*height.
+/// Arithmetic is in 16-bit fixed point, so results may differ by one level
+/// from exact ones.
+
+// Type Kernel is a pointer to kernel objects
+typedef struct kernel *Kernel;
+
+/// How to treat pixels beyond the image borders.
+typedef enum {
+  BorderClamp,   // repeat the edge pixels
+  BorderMirror,  // reflect about the edge pixels (-1 is 1, -2 is 2, ...)
+  BorderZero,    // all black
+} BorderMode;
+
+/// Create a convolution kernel.
+///   width, height : the dimensions of the kernel, both odd.
+///   weights : the width*height weights, row by row (they are copied).
+///   bias : added to every result, in units of maxval (0.5 is mid-gray).
+/// Requires: width and height must be positive and odd.
+/// Weights must not exceed 32767 in magnitude.
+/// 
+/// On success, a new kernel is returned.
+/// (The caller is responsible for destroying the returned kernel!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Kernel KernelCreate(int width, int height, const double* weights, double bias) ;
+
+/// Create a Gaussian kernel with standard deviation sigma.
+/// The kernel extends to 3*sigma around the center and its weights add to 1.
+/// Requires: sigma > 0.
+/// 
+/// On success, a new kernel is returned.
+/// (The caller is responsible for destroying the returned kernel!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Kernel KernelGaussian(double sigma) ;
+
+/// Destroy the kernel pointed to by (*kp).
+/// If (*kp)==NULL, no operation is performed.
+/// Ensures: (*kp)==NULL.
+void KernelDestroy(Kernel* kp) ;
+
+/// Check if kernel k is separable (the product of a column and a row).
+int KernelSeparable(Kernel k) ;
+
+/// Convolve an image with kernel k.
+/// Pixels beyond the image borders are taken as given by border.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified.
+int ImageConvolve(Image img, Kernel k, BorderMode border) ;
+
+/// Morphology
+
+/// Grayscale erosion and dilation with a (2dx+1)x(2dy+1) rectangle:
+/// each pixel is substituted by the minimum (erosion) or maximum (dilation)
+/// of the pixels in the rectangle [x-dx, x+dx]x[y-dy, y+dy] that are
+/// inside the image.
+/// Opening (erosion then dilation) removes bright specks smaller than the
+/// rectangle; closing (dilation then erosion) fills dark holes.
+/// On thresholded images, these are the binary operations.
+/// They take 3 comparisons per pixel and pass, whatever the rectangle size.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately,
+/// and the image is not modified (but ImageOpen and ImageClose may leave
+/// it after the first step).
+int ImageErode(Image img, int dx, int dy) ;
+int ImageDilate(Image img, int dx, int dy) ;
+int ImageOpen(Image img, int dx, int dy) ;
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Binary images
+
+/// A binary image (bitmap) stores one bit per pixel, packed in 64-bit words,
+/// and is typically the result of thresholding an image.
+/// It takes 8 times less memory than an Image, and the operations below
+/// process 64 pixels per word operation.
+/// Pixels are 0 (black) or 1 (white).
+
+// Type Bitmap is a pointer to bitmap objects
+typedef struct bitmap *Bitmap;
+
+/// Create a new black (all 0) bitmap.
+/// Requires: width and height must be non-negative.
+/// 
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCreate(int width, int height) ;
+
+/// Destroy the bitmap pointed to by (*bmp).
+/// If (*bmp)==NULL, no operation is performed.
+/// Ensures: (*bmp)==NULL.
+void BitmapDestroy(Bitmap* bmp) ;
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bm) ;
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bm) ;
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitmapGetPixel(Bitmap bm, int x, int y) ;
+
+/// Set the pixel at position (x,y) to 1 if bit is nonzero, 0 otherwise.
+void BitmapSetPixel(Bitmap bm, int x, int y, int bit) ;
+
+/// Threshold an image into a new bitmap.
+/// Pixels with level>=thr become 1, pixels with level<thr become 0,
+/// as in ImageThreshold.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap ImageThresholdBitmap(Image img, uint8 thr) ;
+
+/// Convert a bitmap to a new image with levels 0 and maxval.
+/// ImageThresholdBitmap followed by BitmapToImage gives the same result as
+/// ImageThreshold.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitmapToImage(Bitmap bm, uint8 maxval) ;
+
+/// Count the pixels set to 1.
+size_t BitmapCount(Bitmap bm) ;
+
+/// Bitwise operations.
+/// Combine bm2 into bm1, pixel by pixel, with logical and, or, xor.
+/// This modifies bm1 in-place.
+/// Requires: bm1 and bm2 must have the same size.
+void BitmapAnd(Bitmap bm1, Bitmap bm2) ;
+void BitmapOr(Bitmap bm1, Bitmap bm2) ;
+void BitmapXor(Bitmap bm1, Bitmap bm2) ;
+
+/// Paste bitmap bm2 into position (x, y) of bm1.
+/// This modifies bm1 in-place.
+/// Requires: bm2 must fit inside bm1 at position (x, y).
+void BitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) ;
+
+/// Locate a sub-bitmap inside another bitmap.
+/// Searches for bm2 inside bm1, as ImageLocateSubImage.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitmapLocate(Bitmap bm1, int* px, int* py, Bitmap bm2) ;
 
 #endif
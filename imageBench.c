@@ -0,0 +1,947 @@
+// imageBench - Benchmark suite for the image8bit module.
+//
+// This program times every public operation of the image8bit module
+// on synthetic images of several sizes, and reports statistics over
+// repeated runs, optionally comparing them against a saved baseline.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// Based on the image8bit module by João Manuel Rodrigues <jmr@ua.pt>.
+//
+// Authors:
+// NMec: 115246 Name: Daniela Silva
+// Date: 10/18/2026
+
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Time image8bit operations on synthetic SxS images, for each size S.\n"
+    "  For every operation and size, report median and 95th percentile of\n"
+    "  wall and cpu times over the repetitions, throughput in bytes per\n"
+    "  second, and the instrumentation counters of one run.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s S1,S2,...    Image sizes S to sweep (default 64,256,1024), or sizes\n"
+    "                  N in complexity mode (default 32,64,128,256)\n"
+    "  -r REPS         Repetitions per operation and size (default 7)\n"
+    "  -p PATTERN      Only run operations whose name contains PATTERN\n"
+    "  -j              Output JSON instead of CSV\n"
+    "  -o FILE         Write results to FILE instead of stdout\n"
+    "  -b BASELINE     Compare median wall times to a CSV file saved\n"
+    "                  previously with this program, and fail (exit status 1)\n"
+    "                  if any is slower by more than the threshold\n"
+    "  -t PERCENT      Regression threshold (default 10)\n"
+    "  -n THREADS      Threads for parallel operations (default: the\n"
+    "                  IMAGE_THREADS environment variable, or the CPU count)\n"
+    "\n"
+    "  -c              Complexity mode: sweep one parameter at a time for\n"
+    "                  ImageLocateSubImage and ImageBlur, and fit the growth\n"
+    "                  exponent a of time and counters ~ PARAM^a (CSV only):\n"
+    "                    locate-haystack  NxN haystack, 8x8 needle\n"
+    "                    locate-needle    256x256 haystack, KxK needle\n"
+    "                    blur-size        NxN image, 5x5 filter\n"
+    "                    blur-kernel      256x256 image, (2K+1)x(2K+1) filter\n"
+    "                  Locate is measured on best (needle at 0,0), worst\n"
+    "                  (uniform images, needle differs in its last pixel) and\n"
+    "                  typical (random images, no match) cases.\n"
+    "  -k K1,K2,...    Needle / kernel sizes K (default 2,4,8,16)\n"
+    "\n"
+    ;
+
+// Directory for temporary files
+static char tmpdir[] = "/tmp/imageBenchXXXXXX";
+
+// Path of temporary file name in buf
+static const char* tmpfile_name(char* buf, size_t size, const char* name) {
+  snprintf(buf, size, "%s/%s", tmpdir, name);
+  return buf;
+}
+
+
+// Synthetic images
+
+// Deterministic pseudo-random numbers (so runs are comparable)
+static unsigned long long seed = 1;
+static int rnd(int n) {
+  seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+  return (int)((seed >> 33) % (unsigned long long)n);
+}
+
+// A smooth gradient with some noise, like a photograph
+static Image makeImage(int w, int h) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(img, x, y, (uint8)((x + 2*y) * 255 / (w + 2*h) + rnd(16)));
+    }
+  }
+  return img;
+}
+
+
+// Benchmarks
+//
+// Each benchmark runs one operation on the fixture images and returns
+// the number of bytes of pixel data it processed.
+
+typedef struct {
+  int size;
+  Image img;      // size x size, photo-like
+  Image small;    // size/4 x size/4, cropped from the bottom right of img
+  Image copy;     // scratch image, same size as img
+  Image blurred;  // copy blurred by ImageBlurUpdate, same size as img
+  Bitmap bm;      // img thresholded
+  Bitmap bmsmall; // small thresholded
+  Bitmap bmcopy;  // scratch bitmap
+} Fixture;
+
+typedef size_t (*BenchFn)(Fixture* fx);
+
+static size_t pixels(Image img) {
+  return (size_t)ImageWidth(img) * ImageHeight(img);
+}
+
+static void check(int ok, const char* what) {
+  if (!ok) error(2, errno, "%s: %s", what, ImageErrMsg());
+}
+
+static size_t benchCreate(Fixture* fx) {
+  Image img = ImageCreate(fx->size, fx->size, PixMax);
+  check(img != NULL, "ImageCreate");
+  ImageDestroy(&img);
+  return (size_t)fx->size * fx->size;
+}
+
+static size_t benchSave(Fixture* fx) {
+  char buf[256];
+  check(ImageSave(fx->img, tmpfile_name(buf, sizeof(buf), "bench.pgm")), "ImageSave");
+  return pixels(fx->img);
+}
+
+static size_t benchLoad(Fixture* fx) {
+  char buf[256];
+  Image img = ImageLoad(tmpfile_name(buf, sizeof(buf), "bench.pgm"));
+  check(img != NULL, "ImageLoad");
+  ImageDestroy(&img);
+  return pixels(fx->img);
+}
+
+static size_t benchLoadRegion(Fixture* fx) {
+  char buf[256];
+  int s = fx->size / 4;
+  Image img = ImageLoadRegion(tmpfile_name(buf, sizeof(buf), "bench.pgm"), s, s, s, s);
+  check(img != NULL, "ImageLoadRegion");
+  ImageDestroy(&img);
+  return (size_t)s * s;
+}
+
+static size_t benchSaveFrame(Fixture* fx) {
+  char buf[256];
+  FILE* f = fopen(tmpfile_name(buf, sizeof(buf), "frames.pgm"), "wb");
+  check(f != NULL, "Opening stream");
+  for (int i = 0; i < 4; i++) check(ImageSaveFrame(fx->img, f), "ImageSaveFrame");
+  fclose(f);
+  return 4 * pixels(fx->img);
+}
+
+static size_t benchLoadFrame(Fixture* fx) {
+  char buf[256];
+  FILE* f = fopen(tmpfile_name(buf, sizeof(buf), "frames.pgm"), "rb");
+  check(f != NULL, "Opening stream");
+  while (!ImageEndOfStream(f)) {
+    Image img = ImageLoadFrame(f);
+    check(img != NULL, "ImageLoadFrame");
+    ImageDestroy(&img);
+  }
+  fclose(f);
+  return 4 * pixels(fx->img);
+}
+
+static size_t benchSaveCompressed(Fixture* fx) {
+  char buf[256];
+  check(ImageSaveCompressed(fx->img, tmpfile_name(buf, sizeof(buf), "bench.zgm")),
+        "ImageSaveCompressed");
+  return pixels(fx->img);
+}
+
+static size_t benchLoadCompressed(Fixture* fx) {
+  char buf[256];
+  Image img = ImageLoadCompressed(tmpfile_name(buf, sizeof(buf), "bench.zgm"));
+  check(img != NULL, "ImageLoadCompressed");
+  ImageDestroy(&img);
+  return pixels(fx->img);
+}
+
+static size_t benchShared(Fixture* fx) {
+  char name[64];
+  snprintf(name, sizeof(name), "imageBench%ld", (long)getpid());
+  Image img = ImageCreateShared(name, fx->size, fx->size, PixMax);
+  check(img != NULL, "ImageCreateShared");
+  Image img2 = ImageOpenShared(name);
+  check(img2 != NULL, "ImageOpenShared");
+  ImageDestroy(&img2);
+  ImageDestroy(&img);
+  check(ImageRemoveShared(name), "ImageRemoveShared");
+  return (size_t)fx->size * fx->size;
+}
+
+static size_t benchStats(Fixture* fx) {
+  uint8 min = PixMax, max = 0;
+  ImageStats(fx->img, &min, &max);
+  return pixels(fx->img);
+}
+
+static size_t benchHistogram(Fixture* fx) {
+  size_t hist[256];
+  ImageHistogram(fx->img, hist);
+  return pixels(fx->img);
+}
+
+static size_t benchStatsFull(Fixture* fx) {
+  ImageStatistics st;
+  ImageStatsFull(fx->img, &st);
+  return pixels(fx->img);
+}
+
+static size_t benchHash(Fixture* fx) {
+  ImageHash(fx->img, 0);
+  return pixels(fx->img);
+}
+
+static size_t benchGetPixel(Fixture* fx) {
+  int w = ImageWidth(fx->img), h = ImageHeight(fx->img);
+  unsigned sum = 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      sum += ImageGetPixel(fx->img, x, y);
+  if (sum == 1) puts("");   // keep the loop alive
+  return pixels(fx->img);
+}
+
+static size_t benchSetPixel(Fixture* fx) {
+  int w = ImageWidth(fx->copy), h = ImageHeight(fx->copy);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(fx->copy, x, y, (uint8)(x ^ y));
+  return pixels(fx->copy);
+}
+
+static size_t benchRowPtr(Fixture* fx) {
+  int w = ImageWidth(fx->copy), h = ImageHeight(fx->copy);
+  for (int y = 0; y < h; y++) {
+    uint8* row = ImageRowPtr(fx->copy, y);
+    for (int x = 0; x < w; x++) row[x] = (uint8)(x ^ y);
+  }
+  return pixels(fx->copy);
+}
+
+static size_t benchGetSetRow(Fixture* fx) {
+  int w = ImageWidth(fx->img), h = ImageHeight(fx->img);
+  uint8 buf[w];
+  for (int y = 0; y < h; y++) {
+    ImageGetRow(fx->img, 0, y, w, buf);
+    ImageSetRow(fx->copy, 0, y, w, buf);
+  }
+  return 2 * pixels(fx->img);
+}
+
+static void invertRow(int y, uint8* row, int width, void* arg) {
+  for (int x = 0; x < width; x++) row[x] = (uint8)~row[x];
+}
+
+static size_t benchForEachRow(Fixture* fx) {
+  ImageForEachRow(fx->copy, invertRow, NULL);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchNegative(Fixture* fx) {
+  ImageNegative(fx->copy);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchThreshold(Fixture* fx) {
+  ImageThreshold(fx->copy, 128);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchBrighten(Fixture* fx) {
+  ImageBrighten(fx->copy, 0.9);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchEqualize(Fixture* fx) {
+  ImageEqualize(fx->copy);
+  return 3 * pixels(fx->copy);
+}
+
+static size_t benchStretch(Fixture* fx) {
+  ImageBrighten(fx->copy, 0.5);   // so that there is a range to stretch
+  ImageStretch(fx->copy);
+  return 5 * pixels(fx->copy);
+}
+
+static size_t benchRotate(Fixture* fx) {
+  Image img = ImageRotate(fx->img);
+  check(img != NULL, "ImageRotate");
+  ImageDestroy(&img);
+  return 2 * pixels(fx->img);
+}
+
+// Rotation is lazy: cropping the whole view does the actual remap.
+static size_t benchRotateCrop(Fixture* fx) {
+  Image rot = ImageRotate(fx->img);
+  check(rot != NULL, "ImageRotate");
+  Image img = ImageCrop(rot, 0, 0, ImageWidth(rot), ImageHeight(rot));
+  check(img != NULL, "ImageCrop");
+  ImageDestroy(&img);
+  ImageDestroy(&rot);
+  return 2 * pixels(fx->img);
+}
+
+static size_t benchRotateAngle(Fixture* fx) {
+  Image img = ImageRotateAngle(fx->img, 7.5, ResizeBilinear);
+  check(img != NULL, "ImageRotateAngle");
+  ImageDestroy(&img);
+  return 5 * pixels(fx->img);
+}
+
+static size_t benchMirror(Fixture* fx) {
+  Image img = ImageMirror(fx->img);
+  check(img != NULL, "ImageMirror");
+  ImageDestroy(&img);
+  return 2 * pixels(fx->img);
+}
+
+static size_t benchCrop(Fixture* fx) {
+  int s = fx->size / 2;
+  Image img = ImageCrop(fx->img, s/2, s/2, s, s);
+  check(img != NULL, "ImageCrop");
+  ImageDestroy(&img);
+  return 2 * (size_t)s * s;
+}
+
+static size_t benchResize(Fixture* fx) {
+  int s = fx->size;
+  Image img = ImageResize(fx->img, s/3, s/3, ResizeArea);
+  check(img != NULL, "ImageResize");
+  ImageDestroy(&img);
+  img = ImageResize(fx->img, 3*s/2, 3*s/2, ResizeBilinear);
+  check(img != NULL, "ImageResize");
+  ImageDestroy(&img);
+  return 2 * pixels(fx->img) + (size_t)(s/3) * (s/3) + (size_t)(3*s/2) * (3*s/2);
+}
+
+// A mosaic: 4 pastes into a mostly empty 8Sx8S sparse canvas, then save.
+static size_t benchSparsePaste(Fixture* fx) {
+  int s = fx->size;
+  Image canvas = ImageCreateSparse(8*s, 8*s, PixMax);
+  check(canvas != NULL, "ImageCreateSparse");
+  for (int i = 0; i < 4; i++) ImagePaste(canvas, 2*i*s, i*s, fx->img);
+  FILE* f = fopen("/dev/null", "wb");
+  check(f != NULL && ImageSaveFrame(canvas, f), "ImageSaveFrame");
+  fclose(f);
+  ImageDestroy(&canvas);
+  return 4 * pixels(fx->img) + 64 * pixels(fx->img);
+}
+
+static size_t benchPaste(Fixture* fx) {
+  ImagePaste(fx->copy, 0, 0, fx->img);
+  return 2 * pixels(fx->img);
+}
+
+static size_t benchPasteMasked(Fixture* fx) {
+  ImagePasteMasked(fx->copy, 0, 0, fx->img, fx->img);   // nonzero pixels
+  return 3 * pixels(fx->img);
+}
+
+static size_t benchPasteKeyed(Fixture* fx) {
+  ImagePasteKeyed(fx->copy, 0, 0, fx->img, 128);
+  return 2 * pixels(fx->img);
+}
+
+static size_t benchBlend(Fixture* fx) {
+  ImageBlend(fx->copy, 0, 0, fx->img, 0.33);
+  return 3 * pixels(fx->img);
+}
+
+static size_t benchBlendMany(Fixture* fx) {
+  int s = fx->size - ImageWidth(fx->small);
+  ImageLayer layers[4] = {
+    { fx->img, 0, 0, 0.33 },
+    { fx->small, 0, 0, 0.5 },
+    { fx->small, s, s, 0.25 },
+    { fx->img, 0, 0, 0.9 },
+  };
+  ImageBlendMany(fx->copy, layers, 4);
+  return 3 * (2 * pixels(fx->img) + 2 * pixels(fx->small));
+}
+
+static size_t benchMatch(Fixture* fx) {
+  int s = ImageWidth(fx->small);
+  int ok = ImageMatchSubImage(fx->img, fx->size - s, fx->size - s, fx->small);
+  check(ok, "ImageMatchSubImage");
+  return 2 * pixels(fx->small);
+}
+
+static size_t benchLocate(Fixture* fx) {
+  int x, y;
+  check(ImageLocateSubImage(fx->img, &x, &y, fx->small), "ImageLocateSubImage");
+  return pixels(fx->img);
+}
+
+static size_t benchBlur(Fixture* fx) {
+  ImageBlur(fx->copy, 3, 3);
+  return 2 * pixels(fx->copy);
+}
+
+// A 16x16 edit to copy, then update its blur
+static size_t benchBlurUpdate(Fixture* fx) {
+  int n = fx->size < 16 ? fx->size : 16;
+  int x = rnd(fx->size - n + 1), y = rnd(fx->size - n + 1);
+  uint8 row[16];
+  for (int j = 0; j < n; j++) {
+    ImageGetRow(fx->img, 0, j, n, row);
+    ImageSetRow(fx->copy, x, y + j, n, row);
+  }
+  check(ImageBlurUpdate(fx->copy, fx->blurred, 3, 3), "ImageBlurUpdate");
+  return 2 * (size_t)(n + 6) * (n + 6);
+}
+
+static size_t benchMedian(Fixture* fx) {
+  check(ImageMedian(fx->copy, 3, 3), "ImageMedian");
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchErode(Fixture* fx) {
+  check(ImageErode(fx->copy, 3, 3), "ImageErode");
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchDilate(Fixture* fx) {
+  check(ImageDilate(fx->copy, 3, 3), "ImageDilate");
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchOpen(Fixture* fx) {
+  check(ImageOpen(fx->copy, 3, 3), "ImageOpen");
+  return 4 * pixels(fx->copy);
+}
+
+static size_t benchClose(Fixture* fx) {
+  check(ImageClose(fx->copy, 3, 3), "ImageClose");
+  return 4 * pixels(fx->copy);
+}
+
+static size_t benchConvolve(Fixture* fx) {
+  static const double sharpen[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+  Kernel k = KernelCreate(3, 3, sharpen, 0.0);
+  check(k != NULL && ImageConvolve(fx->copy, k, BorderClamp), "ImageConvolve");
+  KernelDestroy(&k);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchGauss(Fixture* fx) {
+  Kernel k = KernelGaussian(2.0);
+  check(k != NULL && ImageConvolve(fx->copy, k, BorderClamp), "ImageConvolve");
+  KernelDestroy(&k);
+  return 2 * pixels(fx->copy);
+}
+
+static size_t benchThresholdBitmap(Fixture* fx) {
+  Bitmap bm = ImageThresholdBitmap(fx->img, 128);
+  check(bm != NULL, "ImageThresholdBitmap");
+  BitmapDestroy(&bm);
+  return pixels(fx->img);
+}
+
+static size_t benchBitmapToImage(Fixture* fx) {
+  Image img = BitmapToImage(fx->bm, PixMax);
+  check(img != NULL, "BitmapToImage");
+  ImageDestroy(&img);
+  return pixels(fx->img);
+}
+
+static size_t benchBitmapCount(Fixture* fx) {
+  if (BitmapCount(fx->bm) == 1) puts("");
+  return pixels(fx->img) / 8;
+}
+
+static size_t benchBitmapLogic(Fixture* fx) {
+  BitmapAnd(fx->bmcopy, fx->bm);
+  BitmapOr(fx->bmcopy, fx->bm);
+  BitmapXor(fx->bmcopy, fx->bm);
+  return 3 * 2 * pixels(fx->img) / 8;
+}
+
+static size_t benchBitmapPaste(Fixture* fx) {
+  BitmapPaste(fx->bmcopy, 1, 1, fx->bmsmall);
+  return 2 * pixels(fx->small) / 8;
+}
+
+static size_t benchBitmapLocate(Fixture* fx) {
+  int x, y;
+  check(BitmapLocate(fx->bm, &x, &y, fx->bmsmall), "BitmapLocate");
+  return pixels(fx->img) / 8;
+}
+
+static const struct {
+  const char* name;
+  BenchFn fn;
+} benches[] = {
+  { "create", benchCreate },
+  { "save", benchSave },
+  { "load", benchLoad },
+  { "loadregion", benchLoadRegion },
+  { "saveframe", benchSaveFrame },
+  { "loadframe", benchLoadFrame },
+  { "savecompressed", benchSaveCompressed },
+  { "loadcompressed", benchLoadCompressed },
+  { "shared", benchShared },
+  { "stats", benchStats },
+  { "histogram", benchHistogram },
+  { "statsfull", benchStatsFull },
+  { "hash", benchHash },
+  { "getpixel", benchGetPixel },
+  { "setpixel", benchSetPixel },
+  { "rowptr", benchRowPtr },
+  { "getsetrow", benchGetSetRow },
+  { "foreachrow", benchForEachRow },
+  { "neg", benchNegative },
+  { "thr", benchThreshold },
+  { "bri", benchBrighten },
+  { "equalize", benchEqualize },
+  { "stretch", benchStretch },
+  { "rotate", benchRotate },
+  { "rotatecrop", benchRotateCrop },
+  { "rotateangle", benchRotateAngle },
+  { "mirror", benchMirror },
+  { "crop", benchCrop },
+  { "resize", benchResize },
+  { "paste", benchPaste },
+  { "sparsepaste", benchSparsePaste },
+  { "pastemasked", benchPasteMasked },
+  { "pastekeyed", benchPasteKeyed },
+  { "blend", benchBlend },
+  { "blendmany", benchBlendMany },
+  { "match", benchMatch },
+  { "locate", benchLocate },
+  { "blur", benchBlur },
+  { "blurupdate", benchBlurUpdate },
+  { "median", benchMedian },
+  { "erode", benchErode },
+  { "dilate", benchDilate },
+  { "open", benchOpen },
+  { "close", benchClose },
+  { "conv", benchConvolve },
+  { "gauss", benchGauss },
+  { "thrbitmap", benchThresholdBitmap },
+  { "bitmaptoimage", benchBitmapToImage },
+  { "bitmapcount", benchBitmapCount },
+  { "bitmaplogic", benchBitmapLogic },
+  { "bitmappaste", benchBitmapPaste },
+  { "bitmaplocate", benchBitmapLocate },
+};
+
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+
+// Results
+
+typedef struct {
+  char op[32];
+  int width, height, reps;
+  double wallMed, wallP95;
+  double cpuMed, cpuP95;
+  double bytesPerSec;
+  unsigned long long count[NUMCOUNTERS];
+} Result;
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// The p-th percentile of the n values in v (sorts v)
+static double percentile(double* v, int n, double p) {
+  qsort(v, (size_t)n, sizeof(double), cmpDouble);
+  int i = (int)(p / 100.0 * (n - 1) + 0.5);
+  return v[i];
+}
+
+static Result runBench(int b, Fixture* fx, int reps) {
+  Result r;
+  double wall[reps], cpu[reps];
+  size_t bytes = 0;
+  snprintf(r.op, sizeof(r.op), "%s", benches[b].name);
+  r.width = r.height = fx->size;
+  r.reps = reps;
+  for (int i = 0; i < reps; i++) {
+    InstrReset();
+    double w0 = wall_time(), c0 = cpu_time();
+    bytes = benches[b].fn(fx);
+    cpu[i] = cpu_time() - c0;
+    wall[i] = wall_time() - w0;
+  }
+  for (int c = 0; c < NUMCOUNTERS; c++) r.count[c] = InstrCount[c];
+  r.wallMed = percentile(wall, reps, 50);
+  r.wallP95 = percentile(wall, reps, 95);
+  r.cpuMed = percentile(cpu, reps, 50);
+  r.cpuP95 = percentile(cpu, reps, 95);
+  r.bytesPerSec = r.wallMed > 0 ? (double)bytes / r.wallMed : 0.0;
+  return r;
+}
+
+static void printCSVHeader(FILE* f) {
+  fprintf(f, "op,width,height,reps,wall_median_s,wall_p95_s,cpu_median_s,cpu_p95_s,bytes_per_s");
+  for (int c = 0; c < NUMCOUNTERS; c++)
+    if (InstrName[c] != NULL) fprintf(f, ",%s", InstrName[c]);
+  fprintf(f, "\n");
+}
+
+static void printCSV(FILE* f, const Result* r) {
+  fprintf(f, "%s,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.6g", r->op, r->width, r->height,
+          r->reps, r->wallMed, r->wallP95, r->cpuMed, r->cpuP95, r->bytesPerSec);
+  for (int c = 0; c < NUMCOUNTERS; c++)
+    if (InstrName[c] != NULL) fprintf(f, ",%llu", r->count[c]);
+  fprintf(f, "\n");
+}
+
+static void printJSON(FILE* f, const Result* r, int first) {
+  fprintf(f, "%s\n  {\"op\": \"%s\", \"width\": %d, \"height\": %d, \"reps\": %d, "
+          "\"wall_median_s\": %.9f, \"wall_p95_s\": %.9f, "
+          "\"cpu_median_s\": %.9f, \"cpu_p95_s\": %.9f, \"bytes_per_s\": %.6g",
+          first ? "" : ",", r->op, r->width, r->height, r->reps,
+          r->wallMed, r->wallP95, r->cpuMed, r->cpuP95, r->bytesPerSec);
+  for (int c = 0; c < NUMCOUNTERS; c++)
+    if (InstrName[c] != NULL) fprintf(f, ", \"%s\": %llu", InstrName[c], r->count[c]);
+  fprintf(f, "}");
+}
+
+
+// Complexity fitting
+
+#define MAXPOINTS 32
+
+// Parse a comma separated list of at most max integers >= min into v.
+// Returns the number of integers.
+static int parseList(const char* list, int v[], int max, int min) {
+  int n = 0;
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (n == max || (v[n] = atoi(p)) < min) error(1, 0, "Invalid list: %s", list);
+    n++;
+  }
+  return n;
+}
+
+// Fill img with random levels
+static void randomize(Image img) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y, (uint8)rnd(256));
+}
+
+// Locate cases
+enum { BEST, WORST, TYPICAL, NCASES };
+static const char* caseName[NCASES] = { "best", "worst", "typical" };
+
+// Make a haystack of size hs and a needle of size ns for a locate case.
+static void makeLocate(int c, int hs, int ns, Image* hay, Image* needle) {
+  *hay = ImageCreate(hs, hs, PixMax);
+  check(*hay != NULL, "ImageCreate");
+  switch (c) {
+  case BEST:      // found at the first position tried
+    randomize(*hay);
+    *needle = ImageCrop(*hay, 0, 0, ns, ns);
+    break;
+  case WORST:     // every position compares the whole needle, and fails
+    *needle = ImageCreate(ns, ns, PixMax);
+    check(*needle != NULL, "ImageCreate");
+    ImageSetPixel(*needle, ns-1, ns-1, 1);
+    break;
+  default:        // mismatch after about one comparison
+    randomize(*hay);
+    *needle = ImageCreate(ns, ns, PixMax);
+    check(*needle != NULL, "ImageCreate");
+    randomize(*needle);
+    break;
+  }
+  check(*needle != NULL, "ImageCrop");
+}
+
+// A measurement: median time and counters of the last run
+typedef struct {
+  int param;
+  double time;
+  double pixmem;
+  double comparisons;
+} Point;
+
+// Slope of the least squares line through (log x, log y).
+// (Zero y values, as counters of trivial cases, are taken as 1.)
+static double fitExponent(const Point* pt, int n, int field) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < n; i++) {
+    double y = field == 0 ? pt[i].time : field == 1 ? pt[i].pixmem : pt[i].comparisons;
+    double lx = log((double)pt[i].param);
+    double ly = log(y > 1e-12 ? y : field == 0 ? 1e-12 : 1.0);
+    sx += lx; sy += ly; sxx += lx*lx; sxy += lx*ly;
+  }
+  double d = n*sxx - sx*sx;
+  return d > 0 ? (n*sxy - sx*sy) / d : 0.0;
+}
+
+// Run locate (blurD < 0) or blur on the given images, reps times.
+static Point measure(Image img, Image needle, int blurD, int reps, int param) {
+  double t[reps];
+  for (int i = 0; i < reps; i++) {
+    Image work = NULL;
+    if (blurD >= 0) {   // blur is in-place: work on a fresh copy
+      work = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+      check(work != NULL, "ImageCrop");
+    }
+    int x, y;
+    InstrReset();
+    double c0 = cpu_time();
+    if (blurD >= 0) ImageBlur(work, blurD, blurD);
+    else ImageLocateSubImage(img, &x, &y, needle);
+    t[i] = cpu_time() - c0;
+    ImageDestroy(&work);
+  }
+  Point p = { param, percentile(t, reps, 50), (double)InstrCount[0], (double)InstrCount[1] };
+  return p;
+}
+
+// Print the points of one sweep and its fitted exponents.
+static void printSweep(FILE* out, FILE* fits, const char* sweep, const char* c,
+                       const Point* pt, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(out, "%s,%s,%d,%.9f,%.0f,%.0f\n", sweep, c, pt[i].param,
+            pt[i].time, pt[i].pixmem, pt[i].comparisons);
+  }
+  fprintf(fits, "%s,%s,%.3f,%.3f,%.3f\n", sweep, c, fitExponent(pt, n, 0),
+          fitExponent(pt, n, 1), fitExponent(pt, n, 2));
+}
+
+// Complexity mode: run all sweeps, printing points and then fits.
+static void runComplexity(FILE* out, const char* sizes, const char* ks, int reps) {
+  int size[MAXPOINTS], k[MAXPOINTS];
+  int nsizes = parseList(sizes, size, MAXPOINTS, 16);
+  int nks = parseList(ks, k, MAXPOINTS, 1);
+  const int fixedSize = 256;
+  Point pt[MAXPOINTS];
+  char fitbuf[4096];
+  FILE* fits = fmemopen(fitbuf, sizeof(fitbuf), "w");
+  if (fits == NULL) error(2, errno, "fmemopen");
+
+  fprintf(out, "sweep,case,param,time_s,pixmem,comparisons\n");
+  fprintf(fits, "sweep,case,exp_time,exp_pixmem,exp_comparisons\n");
+
+  for (int c = 0; c < NCASES; c++) {
+    fprintf(stderr, "locate-haystack %s\n", caseName[c]);
+    for (int i = 0; i < nsizes; i++) {
+      Image hay, needle;
+      makeLocate(c, size[i], 8, &hay, &needle);
+      pt[i] = measure(hay, needle, -1, reps, size[i]);
+      ImageDestroy(&hay);
+      ImageDestroy(&needle);
+    }
+    printSweep(out, fits, "locate-haystack", caseName[c], pt, nsizes);
+
+    fprintf(stderr, "locate-needle %s\n", caseName[c]);
+    for (int i = 0; i < nks; i++) {
+      if (k[i] > fixedSize) error(1, 0, "Needle larger than haystack: %d", k[i]);
+      Image hay, needle;
+      makeLocate(c, fixedSize, k[i], &hay, &needle);
+      pt[i] = measure(hay, needle, -1, reps, k[i]);
+      ImageDestroy(&hay);
+      ImageDestroy(&needle);
+    }
+    printSweep(out, fits, "locate-needle", caseName[c], pt, nks);
+  }
+
+  fprintf(stderr, "blur-size\n");
+  for (int i = 0; i < nsizes; i++) {
+    Image img = makeImage(size[i], size[i]);
+    pt[i] = measure(img, NULL, 2, reps, size[i]);
+    ImageDestroy(&img);
+  }
+  printSweep(out, fits, "blur-size", "typical", pt, nsizes);
+
+  fprintf(stderr, "blur-kernel\n");
+  Image img = makeImage(fixedSize, fixedSize);
+  for (int i = 0; i < nks; i++) {
+    pt[i] = measure(img, NULL, k[i], reps, k[i]);
+  }
+  ImageDestroy(&img);
+  printSweep(out, fits, "blur-kernel", "typical", pt, nks);
+
+  fclose(fits);
+  fprintf(out, "\n%s", fitbuf);
+}
+
+
+// Baseline comparison
+
+// Compare results to the baseline CSV file, reporting regressions on stderr.
+// Returns the number of regressions.
+static int compareBaseline(const char* filename, Result* res, int nres, double threshold) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(2, errno, "Opening baseline %s", filename);
+  char line[1024];
+  int regressions = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char op[32];
+    int w, h, reps;
+    double wallMed;
+    if (sscanf(line, "%31[^,],%d,%d,%d,%lf", op, &w, &h, &reps, &wallMed) != 5) {
+      continue;   // header or garbage
+    }
+    for (int i = 0; i < nres; i++) {
+      Result* r = &res[i];
+      if (strcmp(r->op, op) != 0 || r->width != w || r->height != h) continue;
+      double change = wallMed > 0 ? 100.0 * (r->wallMed - wallMed) / wallMed : 0.0;
+      if (change > threshold) {
+        fprintf(stderr, "REGRESSION %s %dx%d: %.6fs -> %.6fs (%+.1f%%)\n",
+                op, w, h, wallMed, r->wallMed, change);
+        regressions++;
+      }
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+
+int main(int ac, char* av[]) {
+  const char* sizes = NULL;
+  const char* ks = "2,4,8,16";
+  int complexity = 0;
+  const char* pattern = "";
+  const char* outname = NULL;
+  const char* baseline = NULL;
+  int reps = 7;
+  int json = 0;
+  double threshold = 10.0;
+  int threads = 0;
+
+  int opt;
+  while ((opt = getopt(ac, av, "s:r:p:jo:b:t:n:ck:h")) != -1) {
+    switch (opt) {
+    case 'c': complexity = 1; break;
+    case 'k': ks = optarg; break;
+    case 's': sizes = optarg; break;
+    case 'r': reps = atoi(optarg); break;
+    case 'p': pattern = optarg; break;
+    case 'j': json = 1; break;
+    case 'o': outname = optarg; break;
+    case 'b': baseline = optarg; break;
+    case 't': threshold = atof(optarg); break;
+    case 'n': threads = atoi(optarg); break;
+    default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (reps < 1 || optind < ac) error(1, 0, "\n%s", USAGE);
+
+  FILE* out = stdout;
+  if (outname != NULL && (out = fopen(outname, "w")) == NULL) {
+    error(2, errno, "Opening %s", outname);
+  }
+  if (mkdtemp(tmpdir) == NULL) error(2, errno, "Creating %s", tmpdir);
+
+  ImageInit();
+  ImageSetThreads(threads);
+  fprintf(stderr, "Threads: %d\n", ImageThreads());
+
+  if (complexity) {
+    runComplexity(out, sizes != NULL ? sizes : "32,64,128,256", ks, reps);
+    if (out != stdout) fclose(out);
+    rmdir(tmpdir);
+    return 0;
+  }
+  if (sizes == NULL) sizes = "64,256,1024";
+
+  Result* res = NULL;
+  int nres = 0;
+
+  if (json) fprintf(out, "[");
+  else printCSVHeader(out);
+
+  for (const char* p = sizes; *p != '\0'; ) {
+    int size = atoi(p);
+    if (size < 4) error(1, 0, "Invalid size: %s", p);
+    fprintf(stderr, "Size %dx%d\n", size, size);
+
+    Fixture fx;
+    fx.size = size;
+    fx.img = makeImage(size, size);
+    fx.copy = makeImage(size, size);
+    fx.blurred = ImageCreate(size, size, PixMax);
+    check(fx.blurred != NULL, "ImageCreate");
+    int s = size / 4;
+    fx.small = ImageCrop(fx.img, size - s, size - s, s, s);
+    check(fx.small != NULL, "ImageCrop");
+    fx.bm = ImageThresholdBitmap(fx.img, 128);
+    fx.bmsmall = ImageThresholdBitmap(fx.small, 128);
+    fx.bmcopy = ImageThresholdBitmap(fx.img, 128);
+    check(fx.bm != NULL && fx.bmsmall != NULL && fx.bmcopy != NULL, "ImageThresholdBitmap");
+    // Files for the loaders
+    benchSave(&fx);
+    benchSaveFrame(&fx);
+    benchSaveCompressed(&fx);
+
+    for (int b = 0; b < NBENCHES; b++) {
+      if (strstr(benches[b].name, pattern) == NULL) continue;
+      fprintf(stderr, "  %s\n", benches[b].name);
+      res = realloc(res, (size_t)(nres + 1) * sizeof(Result));
+      if (res == NULL) error(2, errno, "Out of memory");
+      res[nres] = runBench(b, &fx, reps);
+      if (json) printJSON(out, &res[nres], nres == 0);
+      else printCSV(out, &res[nres]);
+      fflush(out);
+      nres++;
+    }
+
+    ImageDestroy(&fx.img);
+    ImageDestroy(&fx.copy);
+    ImageDestroy(&fx.blurred);
+    ImageDestroy(&fx.small);
+    BitmapDestroy(&fx.bm);
+    BitmapDestroy(&fx.bmsmall);
+    BitmapDestroy(&fx.bmcopy);
+
+    p = strchr(p, ',');
+    if (p == NULL) break;
+    p++;
+  }
+  if (json) fprintf(out, "\n]\n");
+  if (out != stdout) fclose(out);
+
+  // Cleanup temporary files
+  char buf[256];
+  remove(tmpfile_name(buf, sizeof(buf), "bench.pgm"));
+  remove(tmpfile_name(buf, sizeof(buf), "bench.zgm"));
+  remove(tmpfile_name(buf, sizeof(buf), "frames.pgm"));
+  rmdir(tmpdir);
+
+  int regressions = 0;
+  if (baseline != NULL) {
+    regressions = compareBaseline(baseline, res, nres, threshold);
+    fprintf(stderr, "%d regression(s) beyond %.1f%% against %s\n",
+            regressions, threshold, baseline);
+  }
+  free(res);
+  return regressions > 0 ? 1 : 0;
+}
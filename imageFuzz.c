@@ -0,0 +1,512 @@
+// imageFuzz - Randomized differential tests for the image8bit module.
+//
+// This program runs random operations, with random parameters, on random
+// images of random sizes and layouts (ordinary, sparse, rotated and
+// mirrored views), in verification mode, so that every result is checked
+// against the reference versions in imageRef.  Any mismatch is reported
+// (by image8bit) with the operation and its parameters, and here with the
+// seed and step that reproduce it.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// Based on the image8bit module by João Manuel Rodrigues <jmr@ua.pt>.
+//
+// Authors:
+// NMec: 115246 Name: Daniela Silva
+// Date: 10/19/2026
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+
+static const char* USAGE =
+    "USAGE: imageFuzz [OPTION...]\n"
+    "  Run random image8bit operations on random images in verification\n"
+    "  mode, comparing every result with the reference implementation, and\n"
+    "  fail (exit status 1) if any differs.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -n STEPS        Number of operations to run (default 2000)\n"
+    "  -s SEED         Random seed (default: from the clock); a failure is\n"
+    "                  reproduced by running again with its seed\n"
+    "  -m SIZE         Maximum width and height of ordinary images\n"
+    "                  (default 160); one step in 50 uses a large image,\n"
+    "                  above the size where operations go parallel\n"
+    "  -t THREADS      Threads for parallel operations (default: the\n"
+    "                  IMAGE_THREADS environment variable, or the CPU count)\n"
+    "  -o OP           Run only operation OP (see opNames)\n"
+    "  -v              Print every operation before running it\n"
+    "\n"
+    ;
+
+// Pseudo-random numbers, reproducible from the seed
+static unsigned long long seed;
+
+static unsigned rnd32(void) {
+  seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+  return (unsigned)(seed >> 32);
+}
+
+// Random integer in [0, n)
+static int rnd(int n) {
+  return (int)(rnd32() % (unsigned)n);
+}
+
+// Random integer in [lo, hi]
+static int rndRange(int lo, int hi) {
+  return lo + rnd(hi - lo + 1);
+}
+
+static int maxSize = 160;
+static int verbose = 0;
+
+// Failures found here (not by verification mode)
+static size_t failures = 0;
+
+// Temporary file for compressed images
+static char zgmPath[] = "/tmp/imageFuzz.XXXXXX";
+
+// Images that views made in this step look at (destroying them would
+// turn the views into ordinary images)
+static Image bases[64];
+static int nbases = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) error(2, errno, "%s: %s", what, ImageErrMsg());
+}
+
+// Do images a and b have the same size, maxval and pixels?
+static int sameImage(Image a, Image b) {
+  int w = ImageWidth(a), h = ImageHeight(a);
+  if (ImageWidth(b) != w || ImageHeight(b) != h || ImageMaxval(b) != ImageMaxval(a)) return 0;
+  uint8* ra = malloc((size_t)w + 1);
+  uint8* rb = malloc((size_t)w + 1);
+  check(ra != NULL && rb != NULL, "Allocating rows");
+  int same = 1;
+  for (int y = 0; same && y < h; y++) {
+    ImageGetRow(a, 0, y, w, ra);
+    ImageGetRow(b, 0, y, w, rb);
+    same = memcmp(ra, rb, (size_t)w) == 0;
+  }
+  free(ra);
+  free(rb);
+  return same;
+}
+
+
+// Random images
+
+// A random size: mostly small, with the edge cases 0 and 1 and, now and
+// then, large enough to run in parallel.
+static int rndSize(int large) {
+  if (large) return rndRange(1000, 1100);
+  switch (rnd(8)) {
+  case 0: return rnd(3);
+  case 1: return rndRange(60, 70);   // around a sparse tile
+  default: return rndRange(1, maxSize);
+  }
+}
+
+// Fill img with a random pattern of levels in [0, maxval].
+static void fill(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int maxval = ImageMaxval(img);
+  int kind = rnd(6);
+  int level = rnd(maxval + 1);
+  uint8* row = malloc((size_t)w + 1);
+  check(row != NULL, "Allocating row");
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int v;
+      switch (kind) {
+      case 0: v = rnd(maxval + 1); break;                         // noise
+      case 1: v = (x + 2*y) * maxval / (w + 2*h) + rnd(8); break; // gradient
+      case 2: v = rnd(4) == 0 ? maxval : level; break;            // few levels
+      case 3: v = level; break;                                   // flat
+      case 4: v = (x/3 % 2 ? maxval - level : level) + (x%3 == 2); break; // v,v,v+1
+      default: v = ((x / 7 + y / 5) % 2) * maxval; break;         // blocks
+      }
+      row[x] = (uint8)(v > maxval ? maxval : v);
+    }
+    ImageSetRow(img, 0, y, w, row);
+  }
+  free(row);
+}
+
+// A random w x h image, with a random layout.
+static Image makeImage(int w, int h) {
+  uint8 maxval = rnd(4) == 0 ? (uint8)rndRange(1, 254) : PixMax;
+  Image img;
+  switch (rnd(5)) {
+  case 0: {   // a sparse image with a few random patches
+    img = ImageCreateSparse(w, h, maxval);
+    check(img != NULL, "Creating sparse image");
+    for (int i = rnd(4); i > 0 && w > 0 && h > 0; i--) {
+      int pw = rndRange(1, w), ph = rndRange(1, h);
+      Image patch = ImageCreate(pw, ph, maxval);
+      check(patch != NULL, "Creating patch");
+      fill(patch);
+      ImagePaste(img, rnd(w - pw + 1), rnd(h - ph + 1), patch);
+      ImageDestroy(&patch);
+    }
+    return img;
+  }
+  case 1: {   // a rotated view
+    Image base = ImageCreate(h, w, maxval);
+    check(base != NULL, "Creating image");
+    fill(base);
+    img = ImageRotate(base);
+    check(img != NULL, "Rotating image");
+    bases[nbases++] = base;
+    return img;
+  }
+  case 2: {   // a mirrored view
+    Image base = ImageCreate(w, h, maxval);
+    check(base != NULL, "Creating image");
+    fill(base);
+    img = ImageMirror(base);
+    check(img != NULL, "Mirroring image");
+    bases[nbases++] = base;
+    return img;
+  }
+  default:
+    img = ImageCreate(w, h, maxval);
+    check(img != NULL, "Creating image");
+    fill(img);
+    return img;
+  }
+}
+
+// A random image of size at most w x h, and at least 1x1 if possible.
+static Image makeSmaller(int w, int h) {
+  return makeImage(w > 0 ? rndRange(1, w) : 0, h > 0 ? rndRange(1, h) : 0);
+}
+
+// A random alpha: usually in [0, 1], sometimes beyond, sometimes exact.
+static double rndAlpha(void) {
+  switch (rnd(6)) {
+  case 0: return rnd(3) * 0.5;
+  case 1: return rndRange(-1000, 2000) / 1000.0;
+  default: return rnd32() / 4294967296.0;
+  }
+}
+
+// A random window radius for dimension n of a w x h image: usually
+// small, sometimes beyond the image (if it is small: the reference
+// filters take time in proportion to the window area).
+static int rndRadius(int n, int w, int h) {
+  if ((long long)w*h > 64*64) return rnd(6);
+  switch (rnd(8)) {
+  case 0: return rndRange(n, n + 10);
+  case 1: return rnd(2) ? 1000000 : 0;
+  default: return rnd(6);
+  }
+}
+
+// A random kernel of up to 7x7 (or 5x5 for large images): arbitrary,
+// normalized or separable weights, and sometimes a bias.
+static Kernel rndKernel(int large) {
+  int kw = 2*rnd(large ? 3 : 4) + 1, kh = 2*rnd(large ? 3 : 4) + 1;
+  double weight[7*7], col[7], row[7];
+  int kind = rnd(3);
+  for (int i = 0; i < kh; i++) col[i] = rndRange(-100, 200) / 100.0;
+  for (int j = 0; j < kw; j++) row[j] = rndRange(-100, 200) / 100.0;
+  double sum = 0.0;
+  for (int i = 0; i < kw*kh; i++) {
+    switch (kind) {
+    case 0: weight[i] = rndRange(-300, 300) / 100.0; break;   // arbitrary
+    case 1: weight[i] = rnd(100); sum += weight[i]; break;     // normalized
+    default: weight[i] = col[i / kw] * row[i % kw]; break;    // separable
+    }
+  }
+  for (int i = 0; kind == 1 && sum > 0.0 && i < kw*kh; i++) weight[i] /= sum;
+  double bias = rnd(3) == 0 ? rndRange(-100, 100) / 100.0 : 0.0;
+  Kernel k = KernelCreate(kw, kh, weight, bias);
+  check(k != NULL, "Creating kernel");
+  return k;
+}
+
+// A random angle: sometimes a multiple of 90 degrees, often small.
+static double rndAngle(void) {
+  switch (rnd(4)) {
+  case 0: return 90.0 * rndRange(-4, 4);
+  case 1: return rndRange(-1000, 1000) / 100.0;
+  default: return rnd32() / 4294967296.0 * 720.0 - 360.0;
+  }
+}
+
+
+// Operations
+
+static const char* opNames[] = {
+  "stats", "histogram", "statsfull", "hash", "neg", "thr", "bri", "equalize", "stretch",
+  "rotate", "mirror", "crop", "paste", "pastemask", "pastekey",
+  "blend", "blendmany", "blur", "blurupdate", "median",
+  "erode", "dilate", "open", "close", "zgm",
+  "conv", "gauss", "resize", "turn", "locate", "match", "bitmap",
+};
+#define NOPS ((int)(sizeof(opNames)/sizeof(opNames[0])))
+
+// Run operation op on random images, with random parameters.
+static void runOp(int op, int large) {
+  const char* name = opNames[op];
+  int w = rndSize(large), h = rndSize(large);
+  Image img = makeImage(w, h);
+  int dx = rndRadius(w, w, h), dy = rndRadius(h, w, h);
+  if (verbose) fprintf(stderr, "%s on %dx%d\n", name, w, h);
+
+  if (strcmp(name, "stats") == 0) {
+    uint8 min, max;
+    ImageStats(img, &min, &max);
+  } else if (strcmp(name, "statsfull") == 0) {
+    ImageStatistics st;
+    ImageStatsFull(img, &st);
+  } else if (strcmp(name, "hash") == 0) {
+    ImageHash(img, (uint64_t)rnd32() << 32 | rnd32());
+  } else if (strcmp(name, "histogram") == 0) {
+    size_t hist[256];
+    ImageHistogram(img, hist);
+  } else if (strcmp(name, "neg") == 0) {
+    ImageNegative(img);
+  } else if (strcmp(name, "thr") == 0) {
+    ImageThreshold(img, (uint8)rnd(256));
+  } else if (strcmp(name, "bri") == 0) {
+    ImageBrighten(img, rnd(4) == 0 ? rnd(2) : rnd32() / 4294967295.0);
+  } else if (strcmp(name, "equalize") == 0) {
+    ImageEqualize(img);
+  } else if (strcmp(name, "stretch") == 0) {
+    ImageStretch(img);
+  } else if (strcmp(name, "rotate") == 0 || strcmp(name, "mirror") == 0) {
+    Image res = name[0] == 'r' ? ImageRotate(img) : ImageMirror(img);
+    check(res != NULL, name);
+    ImageNegative(res);   // (and use it, so that a view is materialized)
+    ImageDestroy(&res);
+  } else if (strcmp(name, "crop") == 0) {
+    int cw = rnd(w + 1), ch = rnd(h + 1);
+    Image res = ImageCrop(img, rnd(w - cw + 1), rnd(h - ch + 1), cw, ch);
+    check(res != NULL, name);
+    ImageDestroy(&res);
+  } else if (strncmp(name, "paste", 5) == 0 || strcmp(name, "blend") == 0) {
+    Image img2 = makeSmaller(w, h);
+    int x = rnd(w - ImageWidth(img2) + 1), y = rnd(h - ImageHeight(img2) + 1);
+    if (strcmp(name, "paste") == 0) {
+      ImagePaste(img, x, y, img2);
+    } else if (strcmp(name, "pastemask") == 0) {
+      Image mask = makeImage(ImageWidth(img2), ImageHeight(img2));
+      ImagePasteMasked(img, x, y, img2, mask);
+      ImageDestroy(&mask);
+    } else if (strcmp(name, "pastekey") == 0) {
+      ImagePasteKeyed(img, x, y, img2, (uint8)rnd(256));
+    } else {
+      ImageBlend(img, x, y, img2, rndAlpha());
+    }
+    ImageDestroy(&img2);
+  } else if (strcmp(name, "blendmany") == 0) {
+    ImageLayer layer[4];
+    int n = rnd(5);
+    for (int i = 0; i < n; i++) {
+      layer[i].img = makeSmaller(w, h);
+      layer[i].x = rnd(w - ImageWidth(layer[i].img) + 1);
+      layer[i].y = rnd(h - ImageHeight(layer[i].img) + 1);
+      layer[i].alpha = rndAlpha();
+    }
+    ImageBlendMany(img, layer, n);
+    for (int i = 0; i < n; i++) ImageDestroy(&layer[i].img);
+  } else if (strcmp(name, "blur") == 0) {
+    check(ImageBlur(img, dx, dy), name);
+  } else if (strcmp(name, "blurupdate") == 0) {
+    // Blur, edit a few random rectangles, and blur incrementally
+    Image out = ImageCreate(w, h, PixMax);
+    check(out != NULL, "Creating image");
+    check(ImageBlurUpdate(img, out, dx, dy), name);
+    for (int i = rndRange(1, 3); i > 0 && w > 0 && h > 0; i--) {
+      Image edit = makeSmaller(w < 20 ? w : 20, h < 20 ? h : 20);
+      ImagePaste(img, rnd(w - ImageWidth(edit) + 1), rnd(h - ImageHeight(edit) + 1), edit);
+      ImageDestroy(&edit);
+      check(ImageBlurUpdate(img, out, dx, dy), name);
+    }
+    ImageDestroy(&out);
+  } else if (strcmp(name, "zgm") == 0) {
+    // Compress and decompress: the image must come back the same
+    check(ImageSaveCompressed(img, zgmPath), "Saving compressed image");
+    Image res = ImageLoadCompressed(zgmPath);
+    check(res != NULL, "Loading compressed image");
+    if (!sameImage(img, res)) {
+      fprintf(stderr, "imageFuzz: zgm: %dx%d image changed by compression\n", w, h);
+      failures++;
+    }
+    ImageDestroy(&res);
+  } else if (strcmp(name, "conv") == 0 || strcmp(name, "gauss") == 0) {
+    // (The references take time in proportion to the kernel area.)
+    double sigma = (1 + rnd(large ? 7 : 30)) / 10.0;
+    Kernel k = name[0] == 'c' ? rndKernel(large) : KernelGaussian(sigma);
+    check(k != NULL, "Creating kernel");
+    check(ImageConvolve(img, k, (BorderMode)rnd(3)), name);
+    KernelDestroy(&k);
+  } else if (strcmp(name, "resize") == 0) {
+    // To any size, from shrinking to a few pixels to enlarging a lot
+    int rw = rnd(8) == 0 ? rnd(4) : rndSize(large && rnd(2));
+    int rh = rnd(8) == 0 ? rnd(4) : rndSize(large && rnd(2));
+    Image res = ImageResize(img, rw, rh, (ResizeMode)rnd(3));
+    check(res != NULL, name);
+    ImageDestroy(&res);
+  } else if (strcmp(name, "turn") == 0) {
+    Image res = ImageRotateAngle(img, rndAngle(), rnd(2) ? ResizeNearest : ResizeBilinear);
+    check(res != NULL, name);
+    ImageDestroy(&res);
+  } else if (strcmp(name, "locate") == 0 || strcmp(name, "match") == 0) {
+    // Look for a piece of img (sometimes altered), or for another image
+    // (references take time in proportion to both sizes)
+    Image img2;
+    int x = rnd(w + 1), y = rnd(h + 1);
+    if (rnd(3) != 0 && x < w && y < h) {
+      int cw = rndRange(1, w - x < 20 ? w - x : 20), ch = rndRange(1, h - y < 20 ? h - y : 20);
+      img2 = ImageCrop(img, x, y, cw, ch);
+      check(img2 != NULL, "Cropping image");
+      if (rnd(3) == 0) {
+        int px = rnd(cw), py = rnd(ch);
+        uint8 v = ImageGetPixel(img2, px, py);
+        ImageSetPixel(img2, px, py, v > 0 ? v - 1 : 1);
+      }
+    } else {
+      img2 = makeSmaller(w < 20 ? w : 20, h < 20 ? h : 20);
+    }
+    if (name[0] == 'l') {
+      int px, py;
+      ImageLocateSubImage(img, &px, &py, img2);
+    } else if (x < w && y < h) {
+      ImageMatchSubImage(img, x, y, img2);
+    }
+    ImageDestroy(&img2);
+  } else if (strcmp(name, "bitmap") == 0) {
+    // Threshold, and check that converting back gives what ImageThreshold
+    // gives (the references are checked in verification mode)
+    uint8 thr = (uint8)rnd(256);
+    Bitmap bm = ImageThresholdBitmap(img, thr);
+    check(bm != NULL, "Thresholding bitmap");
+    Image thrImg = ImageCrop(img, 0, 0, w, h);
+    check(thrImg != NULL, "Cropping image");
+    ImageThreshold(thrImg, thr);
+    Image res = BitmapToImage(bm, ImageMaxval(img));
+    check(res != NULL, "Converting bitmap");
+    if (!sameImage(res, thrImg)) {
+      fprintf(stderr, "imageFuzz: bitmap: %dx%d bitmap differs from ImageThreshold\n", w, h);
+      failures++;
+    }
+    ImageDestroy(&res);
+    ImageDestroy(&thrImg);
+    BitmapCount(bm);
+
+    // Combine with another bitmap of the same size
+    Image img2 = makeImage(w, h);
+    Bitmap bm2 = ImageThresholdBitmap(img2, (uint8)rnd(256));
+    check(bm2 != NULL, "Thresholding bitmap");
+    switch (rnd(3)) {
+    case 0: BitmapAnd(bm, bm2); break;
+    case 1: BitmapOr(bm, bm2); break;
+    default: BitmapXor(bm, bm2); break;
+    }
+    BitmapCount(bm);
+    ImageDestroy(&img2);
+    BitmapDestroy(&bm2);
+
+    // Paste a smaller bitmap, at any bit offset
+    img2 = makeSmaller(w, h);
+    bm2 = ImageThresholdBitmap(img2, (uint8)rnd(256));
+    check(bm2 != NULL, "Thresholding bitmap");
+    BitmapPaste(bm, rnd(w - BitmapWidth(bm2) + 1), rnd(h - BitmapHeight(bm2) + 1), bm2);
+    ImageDestroy(&img2);
+    BitmapDestroy(&bm2);
+
+    // Look for a piece of the bitmap (sometimes altered), or another one
+    int x = rnd(w + 1), y = rnd(h + 1);
+    if (rnd(3) != 0 && x < w && y < h) {
+      int cw = rndRange(1, w - x < 100 ? w - x : 100), ch = rndRange(1, h - y < 20 ? h - y : 20);
+      bm2 = BitmapCreate(cw, ch);
+      check(bm2 != NULL, "Creating bitmap");
+      for (int j = 0; j < ch; j++) {
+        for (int i = 0; i < cw; i++) BitmapSetPixel(bm2, i, j, BitmapGetPixel(bm, x + i, y + j));
+      }
+      if (rnd(3) == 0) {
+        int px = rnd(cw), py = rnd(ch);
+        BitmapSetPixel(bm2, px, py, !BitmapGetPixel(bm2, px, py));
+      }
+    } else {
+      img2 = makeSmaller(w < 20 ? w : 20, h < 20 ? h : 20);
+      bm2 = ImageThresholdBitmap(img2, (uint8)rnd(256));
+      check(bm2 != NULL, "Thresholding bitmap");
+      ImageDestroy(&img2);
+    }
+    int px, py;
+    BitmapLocate(bm, &px, &py, bm2);
+    BitmapDestroy(&bm2);
+    BitmapDestroy(&bm);
+  } else if (strcmp(name, "median") == 0) {
+    check(ImageMedian(img, dx, dy), name);
+  } else {
+    int (*morph)(Image, int, int) =
+        name[0] == 'e' ? ImageErode : name[0] == 'd' ? ImageDilate :
+        name[0] == 'o' ? ImageOpen : ImageClose;
+    check(morph(img, dx, dy), name);
+  }
+  ImageDestroy(&img);
+  while (nbases > 0) ImageDestroy(&bases[--nbases]);
+}
+
+
+int main(int ac, char* av[]) {
+  int steps = 2000;
+  int threads = 0;
+  int only = -1;
+  seed = (unsigned long long)time(NULL) ^ (unsigned long long)getpid() << 32;
+
+  int opt;
+  while ((opt = getopt(ac, av, "n:s:m:t:o:vh")) != -1) {
+    switch (opt) {
+    case 'n': steps = atoi(optarg); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    case 'm': maxSize = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'o':
+      for (only = NOPS - 1; only >= 0 && strcmp(optarg, opNames[only]) != 0; only--) {}
+      if (only < 0) error(1, 0, "Unknown operation %s", optarg);
+      break;
+    case 'v': verbose = 1; break;
+    default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (steps < 0 || maxSize < 1 || optind < ac) error(1, 0, "\n%s", USAGE);
+
+  ImageInit();
+  ImageSetThreads(threads);
+  ImageSetVerify(1);
+  int fd = mkstemp(zgmPath);
+  check(fd >= 0, zgmPath);
+  close(fd);
+  unsigned long long start = seed;
+  fprintf(stderr, "Seed: %llu\nThreads: %d\n", start, ImageThreads());
+
+  size_t failed = 0;
+  for (int step = 0; step < steps; step++) {
+    // (Each step starts from its own seed, so that a change in one step
+    // does not change the following ones.)
+    seed = start + (unsigned long long)step * 0x9E3779B97F4A7C15ull;
+    int op = only >= 0 ? only : rnd(NOPS);
+    int large = rnd(50) == 0;
+    runOp(op, large);
+    if (ImageVerifyMismatches() + failures > failed) {
+      failed = ImageVerifyMismatches() + failures;
+      fprintf(stderr, "imageFuzz: step %d (%s) failed, seed %llu\n", step, opNames[op], start);
+    }
+  }
+  unlink(zgmPath);
+  printf("%d steps, %zu mismatches\n", steps, failed);
+  return failed > 0 ? 1 : 0;
+}
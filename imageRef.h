@@ -0,0 +1,128 @@
+/// imageRef - Reference implementations of image8bit operations.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// João Manuel Rodrigues <jmr@ua.pt>
+/// 2013, 2023
+
+/// These are the simple, pixel by pixel, versions of the image8bit
+/// operations, written only in terms of ImageCreate, ImageGetPixel,
+/// ImageSetPixel and the information queries (and their Bitmap
+/// equivalents).  They are slow, but easy to check against the
+/// specifications in image8bit.h, and they define the results that the
+/// optimized operations must reproduce exactly.
+/// In verification mode (see ImageSetVerify), image8bit runs them next to
+/// the optimized operations and compares the results.
+///
+/// Each RefX function has the same specification as the ImageX (or X)
+/// function in image8bit.h, except that it does not take care of errno/errCause
+/// beyond what ImageCreate does.
+///
+/// The resampling and convolution operations work in fixed point, so their
+/// references compute in double precision instead, and define results up
+/// to one level either way (see each one below).
+
+#ifndef IMAGEREF_H
+#define IMAGEREF_H
+
+#include <stddef.h>
+#include "image8bit.h"
+
+/// Information queries
+
+void RefStats(Image img, uint8* min, uint8* max) ;
+
+void RefHistogram(Image img, size_t hist[256]) ;
+
+/// Compute the statistics of img, as ImageStatsFull, but summing over the
+/// pixels: the variance may differ from that of ImageStatsFull by rounding.
+void RefStatsFull(Image img, ImageStatistics* st) ;
+
+/// Hash img, as ImageHash, with XXH64 written as in its specification,
+/// in one pass over the pixels.
+uint64_t RefHash(Image img, uint64_t seed) ;
+
+/// Pixel transformations
+
+void RefNegative(Image img) ;
+
+void RefThreshold(Image img, uint8 thr) ;
+
+void RefBrighten(Image img, double factor) ;
+
+void RefEqualize(Image img) ;
+
+void RefStretch(Image img) ;
+
+/// Geometric transformations
+
+Image RefRotate(Image img) ;
+
+Image RefMirror(Image img) ;
+
+Image RefCrop(Image img, int x, int y, int w, int h) ;
+
+/// Set lo and hi (both of the size of the result) to the least and the
+/// greatest levels that each pixel of ImageResize(img, w, h, mode) may
+/// have.  These are the exact values, rounded, at the sample positions and
+/// at positions a tiny bit away, so that both neighbours of a tie count.
+void RefResize(Image img, ResizeMode mode, Image lo, Image hi) ;
+
+/// Set lo and hi (both of the size of img) to the least and the greatest
+/// levels that each pixel of ImageRotateAngle(img, degrees, interp) may
+/// have, as for RefResize (samples on the edges may also be black).
+void RefRotateAngle(Image img, double degrees, ResizeMode interp, Image lo, Image hi) ;
+
+/// Operations on two images
+
+void RefPaste(Image img1, int x, int y, Image img2) ;
+
+void RefPasteMasked(Image img1, int x, int y, Image img2, Image mask) ;
+
+void RefPasteKeyed(Image img1, int x, int y, Image img2, uint8 key) ;
+
+void RefBlend(Image img1, int x, int y, Image img2, double alpha) ;
+
+int RefMatchSubImage(Image img1, int x, int y, Image img2) ;
+
+int RefLocateSubImage(Image img1, int* px, int* py, Image img2) ;
+
+/// Filtering
+
+int RefBlur(Image img, int dx, int dy) ;
+
+int RefMedian(Image img, int dx, int dy) ;
+
+int RefErode(Image img, int dx, int dy) ;
+
+int RefDilate(Image img, int dx, int dy) ;
+
+/// Convolve img, as ImageConvolve, with the width x height kernel of the
+/// given weights and bias (see KernelCreate), rounding the exact results.
+int RefConvolve(Image img, int width, int height, const double* weights, double bias,
+                BorderMode border) ;
+
+/// Binary images
+/// (These work through BitmapGetPixel and BitmapSetPixel, one bit at a time.)
+
+Bitmap RefThresholdBitmap(Image img, uint8 thr) ;
+
+Image RefBitmapToImage(Bitmap bm, uint8 maxval) ;
+
+size_t RefBitmapCount(Bitmap bm) ;
+
+void RefBitmapAnd(Bitmap bm1, Bitmap bm2) ;
+
+void RefBitmapOr(Bitmap bm1, Bitmap bm2) ;
+
+void RefBitmapXor(Bitmap bm1, Bitmap bm2) ;
+
+void RefBitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) ;
+
+int RefBitmapLocate(Bitmap bm1, int* px, int* py, Bitmap bm2) ;
+
+#endif
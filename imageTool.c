@@ -15,12 +15,19 @@
 #include <errno.h>
 #include <error.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [OPTION...] [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -30,38 +37,95 @@ static const char* USAGE =
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
+    "OPTIONS:\n"
+    "  --frames IN OUT Frame mode: run the pipeline once for every frame of\n"
+    "                  the multi-frame PGM stream IN, starting with the frame\n"
+    "                  as I0, and append each resulting CURR to stream OUT.\n"
+    "                  Use - for stdin / stdout (then, what operations print\n"
+    "                  goes to stderr).  Frames are read, processed and\n"
+    "                  written concurrently.\n"
+    "  --border MODE   How conv and gauss treat pixels beyond the borders:\n"
+    "                  clamp (repeat edge pixels, the default), mirror\n"
+    "                  (reflect about the edge pixels) or zero (black).\n"
+    "  --cache DIR     Keep the results of operations in directory DIR (created\n"
+    "                  if needed), keyed by a hash of the input pixels and of\n"
+    "                  the operations and operands applied to them.  Operations\n"
+    "                  whose result is there are skipped, and the result is\n"
+    "                  loaded instead, when needed.\n"
+    "  --cache-size MB Remove the least recently used results when DIR grows\n"
+    "                  beyond MB megabytes (default 1024).\n"
+    "  --trace FILE    Record the time, bytes and counters of every operation\n"
+    "                  and of the internal phases (parse, load, kernels, save)\n"
+    "                  of each thread, and save them to FILE in the Chrome\n"
+    "                  trace_event JSON format (see chrome://tracing).\n"
+    "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit raw PGM format and in compressed graymap (ZGM)\n"
+    "  format are accepted.  The format of input files is detected from their\n"
+    "  contents; output files are saved as ZGM if their name ends in .zgm.\n"
+    "  A FILE named shm:NAME is an image in POSIX shared memory segment NAME:\n"
+    "  loading it maps the pixels without copying (changes are visible to\n"
+    "  other processes), and saving to it creates or replaces the segment.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  FILE@X,Y,W,H    Load only a rectangle from PGM image file\n"
+    "  save FILE       Save CURR to PGM (or ZGM) file\n"
+    "  info            Show information on CURR (size, range, mean, standard\n"
+    "                  deviation and histogram)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  equalize        Equalize the histogram of CURR\n"
+    "  stretch         Stretch the gray level range of CURR to [0, maxval]\n"
     "\n"              
-    "  create W,H      Create new black image with WxH pixels\n"
+    "  create W,H      Create new black image with WxH pixels (memory is only\n"
+    "                  used for the parts pasted or blended into it)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  turn A[,M]      Rotate CURR A degrees counter-clockwise about its center,\n"
+    "                  creating new image of the same size, with method M:\n"
+    "                  nearest or bilinear (default)\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH pixels, creating new image, with\n"
+    "                  method M: nearest, bilinear or area (default: area\n"
+    "                  when shrinking both ways, bilinear otherwise)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
+    "  pastemask X,Y   Paste I(N-3) into CURR at position (X,Y), only where\n"
+    "                  PRED (a mask of the same size) is nonzero\n"
+    "  pastekey X,Y,K  Paste PRED into CURR at position (X,Y), except for\n"
+    "                  its pixels of level K\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  blursave DX,DY FILE\n"
+    "                  Save CURR blurred as by blur to FILE, leaving CURR\n"
+    "                  unchanged.  Done again on the same CURR, with the same\n"
+    "                  DX,DY, only the pixels near those changed since (as by\n"
+    "                  paste or blend) are recomputed.\n"
+    "  median DX,DY    Median filter CURR with (2DX+1)x(2DY+1) window\n"
+    "  conv KERNEL     Convolve CURR with KERNEL\n"
+    "  erode DX,DY     Erode CURR with (2DX+1)x(2DY+1) rectangle (local min)\n"
+    "  dilate DX,DY    Dilate CURR with (2DX+1)x(2DY+1) rectangle (local max)\n"
+    "  open DX,DY      Open CURR (erode, then dilate): removes bright specks\n"
+    "  close DX,DY     Close CURR (dilate, then erode): fills dark holes\n"
+    "  gauss SIGMA     Convolve CURR with Gaussian of std deviation SIGMA\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  KERNEL          W,H,w1,...,wn  (W*H weights, row by row; W, H odd)\n"
+    "                  or one of: sharpen, sobelx, sobely, laplace\n"
+    "                  (sobel and laplace results are offset to mid-gray)\n"
     "\n"
     ;
 
@@ -74,6 +138,7 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Opening %s failed",
 };
 
 
@@ -85,36 +150,346 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// The image buffer capacity
+static const int N = 10;
+
+// Border mode for convolutions
+static BorderMode border = BorderClamp;
+
+// Named 3x3 kernels for conv
+static const struct {
+  const char* name;
+  double bias;
+  double weight[9];
+} namedKernels[] = {
+  { "sharpen", 0.0, {  0, -1,  0,  -1, 5, -1,   0, -1,  0 } },
+  { "sobelx",  0.5, { -1,  0,  1,  -2, 0,  2,  -1,  0,  1 } },
+  { "sobely",  0.5, { -1, -2, -1,   0, 0,  0,   1,  2,  1 } },
+  { "laplace", 0.5, {  0,  1,  0,   1, -4, 1,   0,  1,  0 } },
+};
+
+// Parse a KERNEL operand: a kernel name or W,H,w1,...,wn.
+// Returns NULL if it is invalid (with errno/errCause set by KernelCreate
+// if that is the reason).
+static Kernel parseKernel(const char* s) {
+  for (size_t i = 0; i < sizeof(namedKernels)/sizeof(namedKernels[0]); i++) {
+    if (strcmp(s, namedKernels[i].name) == 0) {
+      return KernelCreate(3, 3, namedKernels[i].weight, namedKernels[i].bias);
+    }
   }
+  int w, h, len;
+  if (sscanf(s, "%d,%d%n", &w, &h, &len) != 2) return NULL;
+  if (w <= 0 || h <= 0 || w % 2 == 0 || h % 2 == 0 || w > 1023 || h > 1023) return NULL;
+  double* weight = malloc(sizeof(double)*w*h);
+  if (weight == NULL) return NULL;
+  int n = 0;
+  char* end = (char*)s + len;
+  while (n < w*h && *end == ',') {
+    char* p = end + 1;
+    weight[n] = strtod(p, &end);
+    if (end == p) break;
+    n++;
+  }
+  Kernel k = (n == w*h && *end == '\0') ? KernelCreate(w, h, weight, 0.0) : NULL;
+  free(weight);
+  return k;
+}
 
-  ImageInit();
+// Load an image file, in PGM or compressed (ZGM) format,
+// detected from its magic number, or open shared image shm:NAME.
+static Image loadImage(const char* filename) {
+  if (strncmp(filename, "shm:", 4) == 0) {
+    return ImageOpenShared(filename + 4);
+  }
+  char magic[2] = "";
+  FILE* f = fopen(filename, "rb");
+  if (f != NULL) {
+    if (fread(magic, 1, 2, f) != 2) magic[0] = '\0';
+    fclose(f);
+  }
+  if (magic[0] == 'Z' && magic[1] == '5') {
+    return ImageLoadCompressed(filename);
+  }
+  return ImageLoad(filename);   // and let it report any problem
+}
 
-  int err = 0;
-  int x, y, w, h;
+// Save an image file, in compressed (ZGM) format if its name ends in .zgm,
+// or in PGM format otherwise, or copy it to a new shared image shm:NAME.
+static int saveImage(Image img, const char* filename) {
+  if (strncmp(filename, "shm:", 4) == 0) {
+    Image shm = ImageCreateShared(filename + 4, ImageWidth(img),
+                                  ImageHeight(img), (uint8)ImageMaxval(img));
+    if (shm == NULL) return 0;
+    ImagePaste(shm, 0, 0, img);
+    ImageDestroy(&shm);
+    return 1;
+  }
+  size_t len = strlen(filename);
+  if (len >= 4 && strcmp(filename + len - 4, ".zgm") == 0) {
+    return ImageSaveCompressed(img, filename);
+  }
+  return ImageSave(img, filename);
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+// Result cache
+//
+// With --cache DIR, every image in the buffer has a key: the hash of its
+// pixels, for loaded files, or else a hash of the operation and operand
+// that produced it and of the keys of the images it read.  Results are
+// saved in DIR as KEY.pgm.  When the result of an operation is found
+// there, the operation is skipped, and the result is only loaded when some
+// later operation needs its pixels: so a pipeline that repeats a prefix of
+// an earlier one starts from the last cached intermediate image.  When DIR
+// grows beyond the size limit, the least recently used files are removed.
+// Images in shared memory may change at any time, so they have key 0,
+// which means "not cached", as does every result that depends on them.
 
-  int k = 1;
+// Cache directory, or NULL when caching is off
+static const char* cacheDir = NULL;
+// Cache size limit, in bytes
+static long long cacheLimit = 1024ll << 20;
 
-  InstrCalibrate();
+// What the cache does with the result of an operation
+enum { UNCACHED, KEYED, CACHED };
+
+// Operations known to the cache: number of operands, number of images read
+// (at the end of the buffer), whether a new image is created, and what to
+// do with the result.  (create is cheap, and its sparse result small, so
+// its key is just computed.)  Other operations are file loads.
+static const struct {
+  const char* name;
+  int operands;
+  int inputs;
+  int creates;
+  int cache;
+} cacheOps[] = {
+  { "info",      0, 1, 0, UNCACHED },
+  { "tic",       0, 0, 0, UNCACHED },
+  { "toc",       0, 0, 0, UNCACHED },
+  { "save",      1, 1, 0, UNCACHED },
+  { "locate",    0, 2, 0, UNCACHED },
+  { "create",    1, 0, 1, KEYED },
+  { "neg",       0, 1, 0, CACHED },
+  { "thr",       1, 1, 0, CACHED },
+  { "bri",       1, 1, 0, CACHED },
+  { "equalize",  0, 1, 0, CACHED },
+  { "stretch",   0, 1, 0, CACHED },
+  { "rotate",    0, 1, 1, CACHED },
+  { "turn",      1, 1, 1, CACHED },
+  { "mirror",    0, 1, 1, CACHED },
+  { "crop",      1, 1, 1, CACHED },
+  { "resize",    1, 1, 1, CACHED },
+  { "paste",     1, 2, 0, CACHED },
+  { "pastemask", 1, 3, 0, CACHED },
+  { "pastekey",  1, 2, 0, CACHED },
+  { "blend",     1, 2, 0, CACHED },
+  { "blur",      1, 1, 0, CACHED },
+  { "blursave",  2, 1, 0, UNCACHED },
+  { "median",    1, 1, 0, CACHED },
+  { "conv",      1, 1, 0, CACHED },
+  { "gauss",     1, 1, 0, CACHED },
+  { "erode",     1, 1, 0, CACHED },
+  { "dilate",    1, 1, 0, CACHED },
+  { "open",      1, 1, 0, CACHED },
+  { "close",     1, 1, 0, CACHED },
+};
+
+// Index of operation name in cacheOps, or -1 for a file.
+static int cacheOp(const char* name) {
+  for (int i = 0; i < (int)(sizeof(cacheOps)/sizeof(cacheOps[0])); i++) {
+    if (strcmp(name, cacheOps[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+// Mix n bytes at p into hash h (FNV-1a).
+static uint64_t hashBytes(uint64_t h, const void* p, size_t n) {
+  const unsigned char* b = p;
+  for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 0x100000001B3ull;
+  return h;
+}
+
+// Key of the result of operation op with the given operand, applied to
+// images with keys in[0..nin-1].  Returns 0 if any of them is 0.
+static uint64_t opKey(int op, const char* operand, const uint64_t in[], int nin) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (int i = 0; i < nin; i++) {
+    if (in[i] == 0) return 0;
+    h = hashBytes(h, &in[i], sizeof(in[i]));
+  }
+  h = hashBytes(h, cacheOps[op].name, strlen(cacheOps[op].name) + 1);
+  h = hashBytes(h, operand, strlen(operand) + 1);
+  if (strcmp(cacheOps[op].name, "conv") == 0 || strcmp(cacheOps[op].name, "gauss") == 0) {
+    h = hashBytes(h, &border, sizeof(border));
+  }
+  return h != 0 ? h : 1;
+}
+
+// Key of an image loaded from file filename.
+static uint64_t fileKey(Image img, const char* filename) {
+  if (strncmp(filename, "shm:", 4) == 0) return 0;
+  uint64_t h = ImageHash(img, 0);
+  return h != 0 ? h : 1;
+}
+
+static void cachePath(char* path, size_t size, uint64_t key) {
+  snprintf(path, size, "%s/%016" PRIx64 ".pgm", cacheDir, key);
+}
+
+// Check if the result with key is in the cache, marking it as used.
+static int cacheHas(uint64_t key) {
+  char path[PATH_MAX];
+  cachePath(path, sizeof(path), key);
+  int errsave = errno;
+  int has = utime(path, NULL) == 0;   // (sets its times to now)
+  errno = errsave;
+  return has;
+}
+
+// Load the images img[i0..n-1] that are only in the cache.
+// Returns 0 on failure.
+static int cacheFetch(Image img[], const uint64_t key[], int i0, int n) {
+  for (int i = i0 < 0 ? 0 : i0; i < n; i++) {
+    if (img[i] != NULL) continue;
+    char path[PATH_MAX];
+    cachePath(path, sizeof(path), key[i]);
+    fprintf(stderr, "Loading cached %s -> I%d\n", path, i);
+    img[i] = ImageLoad(path);
+    if (img[i] == NULL) return 0;
+  }
+  return 1;
+}
+
+// A file in the cache directory
+typedef struct {
+  char name[32];
+  long long size;
+  struct timespec used;
+} CacheFile;
+
+static int cmpUsed(const void* a, const void* b) {
+  const struct timespec* p = &((const CacheFile*)a)->used;
+  const struct timespec* q = &((const CacheFile*)b)->used;
+  if (p->tv_sec != q->tv_sec) return p->tv_sec < q->tv_sec ? -1 : 1;
+  return (p->tv_nsec > q->tv_nsec) - (p->tv_nsec < q->tv_nsec);
+}
+
+// Remove the least recently used files from the cache until it is within
+// its size limit, but not those with keys key[0..n-1].
+static void cacheEvict(const uint64_t key[], int n) {
+  DIR* d = opendir(cacheDir);
+  if (d == NULL) return;
+  CacheFile* file = NULL;
+  size_t count = 0, cap = 0;
+  long long total = 0;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    char* end;
+    uint64_t k = strtoull(e->d_name, &end, 16);
+    if (end != e->d_name + 16 || strcmp(end, ".pgm") != 0) continue;   // not ours
+    char path[PATH_MAX];
+    struct stat st;
+    cachePath(path, sizeof(path), k);
+    if (stat(path, &st) != 0) continue;
+    total += st.st_size;
+    int pending = 0;
+    for (int i = 0; i < n; i++) pending |= key[i] == k;
+    if (pending) continue;
+    if (count == cap) {
+      cap = cap == 0 ? 64 : 2*cap;
+      CacheFile* p = realloc(file, cap*sizeof(CacheFile));
+      if (p == NULL) break;
+      file = p;
+    }
+    strcpy(file[count].name, e->d_name);
+    file[count].size = st.st_size;
+    file[count].used = st.st_mtim;
+    count++;
+  }
+  closedir(d);
+  if (count > 0) qsort(file, count, sizeof(CacheFile), cmpUsed);
+  for (size_t i = 0; i < count && total > cacheLimit; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, file[i].name);
+    if (unlink(path) == 0) total -= file[i].size;
+  }
+  free(file);
+}
+
+// Save img in the cache with key, then evict old files, except those with
+// keys key[0..n-1].  Failures only mean that img is not cached.
+static void cacheStore(Image img, uint64_t key, const uint64_t keys[], int n) {
+  char path[PATH_MAX], tmp[PATH_MAX];
+  cachePath(path, sizeof(path), key);
+  // Write to a temporary file first, so that readers never see a partial one
+  snprintf(tmp, sizeof(tmp), "%s/tmp.%ld", cacheDir, (long)getpid());
+  int errsave = errno;
+  if (ImageSave(img, tmp) && rename(tmp, path) == 0) {
+    cacheEvict(keys, n);
+  } else {
+    unlink(tmp);
+  }
+  errno = errsave;
+}
+
+// Apply the operations in av[k], ..., av[ac-1] to the image buffer
+// img[0], ..., img[*pn-1], appending new images to it.
+// Returns 0 on success, or an error code (index into errors[]).
+static int runPipeline(int k, int ac, char* av[], Image img[], int* pn) {
+  int err = 0;
+  int x, y, w, h;
+  int n = *pn;          // number of images created
+  uint64_t key[N];      // their keys in the cache
+  Image blurred[N];     // last blursave result from each image, or NULL
+
+  for (int i = 0; i < N; i++) blurred[i] = NULL;
+  for (int i = 0; cacheDir != NULL && i < n; i++) key[i] = ImageHash(img[i], 0);
 
   while (k < ac) {
+    TraceBegin(av[k], "op");
+    int slot = -1;        // where the result to cache goes
+    uint64_t newKey = 0;  // and its key
+    int store = 0;        // whether to save it
+    if (cacheDir != NULL) {
+      int op = cacheOp(av[k]);
+      int inputs = op < 0 ? 0 : cacheOps[op].inputs;
+      if (op >= 0 && cacheOps[op].cache != UNCACHED && k + cacheOps[op].operands < ac &&
+          n >= inputs && (!cacheOps[op].creates || n < N)) {
+        newKey = opKey(op, cacheOps[op].operands > 0 ? av[k+1] : "", key + n - inputs, inputs);
+        slot = cacheOps[op].creates ? n : n-1;
+        store = cacheOps[op].cache == CACHED && newKey != 0;
+        if (store && cacheHas(newKey)) {
+          fprintf(stderr, "Found %s result in cache -> I%d\n", av[k], slot);
+          if (slot < n) ImageDestroy(&img[slot]);   // (loaded when needed)
+          else n++;
+          img[slot] = NULL;
+          key[slot] = newKey;
+          TraceEnd(0);
+          k += 1 + cacheOps[op].operands;
+          continue;
+        }
+      }
+      // The operation will run: load the images it reads
+      if (n >= inputs && !cacheFetch(img, key, n - inputs, n)) { err = 4; break; }
+    }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
+      ImageStatistics st;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      ImageStatsFull(img[n-1], &st);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      printf("# Gray level range: [%hhu, %hhu]\n", st.min, st.max);
+      printf("# Mean: %.3f\n# Std deviation: %.3f\n", st.mean, sqrt(st.variance));
+      printf("# Histogram (16 levels per bin):");
+      for (int b = 0; b < 16; b++) {
+        size_t count = 0;
+        for (int v = 16*b; v < 16*b + 16; v++) count += st.hist[v];
+        printf(" %zu", count);
+      }
+      printf("\n");
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
@@ -137,13 +512,21 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
       ImageBrighten(img[n-1], factor);
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Equalizing I%d\n", n-1);
+      ImageEqualize(img[n-1]);
+    } else if (strcmp(av[k], "stretch") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Stretching I%d\n", n-1);
+      ImageStretch(img[n-1]);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
+      img[n] = ImageCreateSparse(w, h, PixMax);   // (usually a canvas for pastes)
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
@@ -153,6 +536,24 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "turn") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double degrees;
+      int len = 0;
+      if (sscanf(av[k], "%lf%n", &degrees, &len) != 1) { err = 5; break; }
+      if (!isfinite(degrees)) { err = 5; break; }   // precondition check!
+      ResizeMode mode;
+      if (strcmp(av[k] + len, "") == 0 || strcmp(av[k] + len, ",bilinear") == 0) {
+        mode = ResizeBilinear;
+      } else if (strcmp(av[k] + len, ",nearest") == 0) {
+        mode = ResizeNearest;
+      } else { err = 5; break; }
+      fprintf(stderr, "Turning I%d %g degrees -> I%d\n", n-1, degrees, n);
+      img[n] = ImageRotateAngle(img[n-1], degrees, mode);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -170,6 +571,29 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      int len = 0;
+      if (sscanf(av[k], "%d,%d%n", &w, &h, &len) != 2) { err = 5; break; }
+      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+      ResizeMode mode;
+      const char* m = av[k] + len;
+      if (*m == '\0') {
+        int shrink = w <= ImageWidth(img[n-1]) && h <= ImageHeight(img[n-1]);
+        mode = shrink ? ResizeArea : ResizeBilinear;
+      } else if (strcmp(m, ",nearest") == 0) {
+        mode = ResizeNearest;
+      } else if (strcmp(m, ",bilinear") == 0) {
+        mode = ResizeBilinear;
+      } else if (strcmp(m, ",area") == 0) {
+        mode = ResizeArea;
+      } else { err = 5; break; }
+      fprintf(stderr, "Resizing I%d (%d,%d) -> I%d\n", n-1, w, h, n);
+      img[n] = ImageResize(img[n-1], w, h, mode);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -179,6 +603,26 @@ int main(int ac, char* av[]) {
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
+    } else if (strcmp(av[k], "pastemask") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 3) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-3]);
+      h = ImageHeight(img[n-3]);
+      if (ImageWidth(img[n-2]) != w || ImageHeight(img[n-2]) != h) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(stderr, "Pasting I%d masked by I%d at I%d (%d,%d)\n", n-3, n-2, n-1, x, y);
+      ImagePasteMasked(img[n-1], x, y, img[n-3], img[n-2]);
+    } else if (strcmp(av[k], "pastekey") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      uint8 key;
+      if (sscanf(av[k], "%d,%d,%hhu", &x, &y, &key) != 3) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      fprintf(stderr, "Pasting I%d keyed by %d at I%d (%d,%d)\n", n-2, key, n-1, x, y);
+      ImagePasteKeyed(img[n-1], x, y, img[n-2], key);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -206,33 +650,381 @@ int main(int ac, char* av[]) {
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (!ImageBlur(img[n-1], dx, dy)) { err = 4; break; }
 
       InstrPrint();
       InstrReset();
 
+    } else if (strcmp(av[k], "blursave") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[++k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      k++;
+      fprintf(stderr, "Saving %s <- I%d blurred with %dx%d mean filter\n", av[k], n-1, 2*dx+1, 2*dy+1);
+      // Keep the result with the image, to update it the next time
+      Image* out = &blurred[n-1];
+      w = ImageWidth(img[n-1]);
+      h = ImageHeight(img[n-1]);
+      if (*out != NULL && (ImageWidth(*out) != w || ImageHeight(*out) != h)) ImageDestroy(out);
+      if (*out == NULL && (*out = ImageCreate(w, h, ImageMaxval(img[n-1]))) == NULL) { err = 4; break; }
+      if (!ImageBlurUpdate(img[n-1], *out, dx, dy)) { err = 4; break; }
+      if (saveImage(*out, av[k]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Median filter I%d with %dx%d window\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageMedian(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Applying %s to I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int (*morph)(Image, int, int) =
+          op[0] == 'e' ? ImageErode : op[0] == 'd' ? ImageDilate :
+          op[0] == 'o' ? ImageOpen : ImageClose;
+      if (!morph(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      Kernel kernel = parseKernel(av[k]);
+      if (kernel == NULL) { err = 5; break; }
+      fprintf(stderr, "Convolving I%d with %s kernel %s\n", n-1,
+              KernelSeparable(kernel) ? "separable" : "non-separable", av[k]);
+      int ok = ImageConvolve(img[n-1], kernel, border);
+      KernelDestroy(&kernel);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (!(sigma > 0.0 && sigma <= 100.0)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Convolving I%d with Gaussian sigma=%g\n", n-1, sigma);
+      Kernel kernel = KernelGaussian(sigma);
+      if (kernel == NULL) { err = 4; break; }
+      int ok = ImageConvolve(img[n-1], kernel, border);
+      KernelDestroy(&kernel);
+      if (!ok) { err = 4; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (saveImage(img[n-1], av[k]) == 0) { err = 4; break; }
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      // FILE@X,Y,W,H loads just that region of FILE
+      char* at = strrchr(av[k], '@');
+      char end;
+      if (at != NULL && sscanf(at+1, "%d,%d,%d,%d%c", &x, &y, &w, &h, &end) == 4) {
+        *at = '\0';
+        fprintf(stderr, "Loading %s (%d,%d,%d,%d) -> I%d\n", av[k], x, y, w, h, n);
+        img[n] = ImageLoadRegion(av[k], x, y, w, h);
+        *at = '@';
+      } else {
+        fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+        img[n] = loadImage(av[k]);
+      }
       if (img[n] == NULL) { err = 4; break; }
+      if (cacheDir != NULL) key[n] = fileKey(img[n], av[k]);
       n++;
     }
+    if (slot >= 0) {
+      key[slot] = newKey;
+      if (store) cacheStore(img[slot], newKey, key, n);
+    }
+    TraceEnd(0);
     k++;
   }
+  if (err != 0) TraceEnd(0);   // the failed operation
+  for (int i = 0; i < N; i++) if (blurred[i] != NULL) ImageDestroy(&blurred[i]);
+  // The caller gets CURR
+  if (err == 0 && cacheDir != NULL && !cacheFetch(img, key, n - 1, n)) err = 4;
+  
+  *pn = n;
+  return err;
+}
+
+
+// Frame mode
+//
+// A reader thread parses frames from the input stream and a writer thread
+// saves the results to the output stream, while the main thread runs the
+// pipeline.  Frames flow between them through two small bounded queues,
+// so I/O on one frame overlaps processing of its neighbours.
+
+#define QCAP 4   // frames in flight per queue
+
+// A bounded blocking queue of images.
+// Closing the queue (from either side) wakes up everyone: QueueGet drains
+// what is left and then returns NULL, QueuePut refuses new images.
+typedef struct {
+  Image item[QCAP];
+  int head;
+  int count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} Queue;
+
+static void QueueInit(Queue* q) {
+  q->head = q->count = q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+}
+
+// Append img to q, waiting for room.  Returns 0 if q was closed.
+static int QueuePut(Queue* q, Image img) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == QCAP && !q->closed) pthread_cond_wait(&q->changed, &q->lock);
+  int ok = !q->closed;
+  if (ok) {
+    q->item[(q->head + q->count++) % QCAP] = img;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Remove the oldest image from q, waiting for one.
+// Returns NULL when q is closed and empty.
+static Image QueueGet(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->changed, &q->lock);
+  Image img = NULL;
+  if (q->count > 0) {
+    img = q->item[q->head];
+    q->head = (q->head + 1) % QCAP;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return img;
+}
+
+static void QueueClose(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Destroy the images left in a closed queue.
+static void QueueDestroy(Queue* q) {
+  Image img;
+  while ((img = QueueGet(q)) != NULL) ImageDestroy(&img);
+  pthread_cond_destroy(&q->changed);
+  pthread_mutex_destroy(&q->lock);
+}
+
+// State of a reader or writer thread.
+typedef struct {
+  FILE* f;
+  Queue* q;
+  int err;            // error code, as in runPipeline
+  int errnum;         // errno when it failed
+  const char* cause;  // ImageErrMsg() when it failed
+} Stage;
+
+static void* readerMain(void* arg) {
+  Stage* s = arg;
+  while (!ImageEndOfStream(s->f)) {
+    Image img = ImageLoadFrame(s->f);
+    if (img == NULL) {
+      s->err = 4; s->errnum = errno; s->cause = ImageErrMsg();
+      break;
+    }
+    if (!QueuePut(s->q, img)) {   // consumer gave up
+      ImageDestroy(&img);
+      break;
+    }
+  }
+  QueueClose(s->q);
+  InstrMerge();
+  return NULL;
+}
+
+static void* writerMain(void* arg) {
+  Stage* s = arg;
+  Image img;
+  while ((img = QueueGet(s->q)) != NULL) {
+    if (ImageSaveFrame(img, s->f) == 0 || fflush(s->f) != 0) {
+      s->err = 4; s->errnum = errno; s->cause = ImageErrMsg();
+      QueueClose(s->q);   // make the producer stop
+    }
+    ImageDestroy(&img);
+  }
+  InstrMerge();
+  return NULL;
+}
+
+// Open stream out for writing frames: a file, or stdout for "-".
+// What operations print (info, locate, toc, ...) goes to stdout, so in the
+// latter case the frames get their own descriptor for it, and stdout is
+// redirected to stderr until closeOutput.
+// Returns NULL on failure (errno set).
+static FILE* openOutput(const char* out) {
+  if (strcmp(out, "-") != 0) return fopen(out, "wb");
+  fflush(stdout);
+  int fd = dup(STDOUT_FILENO);
+  FILE* f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (f == NULL) {
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+  return f;
+}
+
+// Close stream f, opened by openOutput(out), restoring stdout.
+static void closeOutput(FILE* f, const char* out) {
+  if (strcmp(out, "-") == 0) {
+    fflush(stdout);
+    dup2(fileno(f), STDOUT_FILENO);
+  }
+  fclose(f);
+}
+
+// Run the pipeline av[k..ac-1] on every frame of stream in, writing the
+// results to stream out.
+// Returns 0 on success, or an error code with errno and *cause set.
+static int runFrames(const char* in, const char* out,
+                     int k, int ac, char* av[], const char** cause) {
+  FILE* fin = strcmp(in, "-") == 0 ? stdin : fopen(in, "rb");
+  if (fin == NULL) { *cause = in; return 8; }
+  FILE* fout = openOutput(out);
+  if (fout == NULL) { *cause = out; if (fin != stdin) fclose(fin); return 8; }
+
+  Queue inq, outq;
+  QueueInit(&inq);
+  QueueInit(&outq);
+  Stage reader = { fin, &inq, 0, 0, NULL };
+  Stage writer = { fout, &outq, 0, 0, NULL };
+  pthread_t rt, wt;
+  pthread_create(&rt, NULL, readerMain, &reader);
+  pthread_create(&wt, NULL, writerMain, &writer);
+
+  int err = 0;
+  int nframes = 0;
+  Image frame;
+  while (err == 0 && (frame = QueueGet(&inq)) != NULL) {
+    fprintf(stderr, "Frame %d\n", nframes++);
+    Image img[N];
+    img[0] = frame;
+    int n = 1;
+    TraceBegin("frame", "frame");
+    err = runPipeline(k, ac, av, img, &n);
+    TraceEnd(0);
+    *cause = ImageErrMsg();
+    // Destroy the other images before CURR goes to the writer: if CURR is
+    // a view of one of them (from rotate or mirror), this makes it an
+    // ordinary image here, not while the writer reads it.
+    Image curr = err == 0 ? img[--n] : NULL;
+    while (n > 0) ImageDestroy(&img[--n]);
+    if (curr != NULL && !QueuePut(&outq, curr)) {
+      ImageDestroy(&curr);
+      err = -1;   // writer failed: reported below
+    }
+  }
+
+  int errnum = errno;
+  QueueClose(&inq);
+  QueueClose(&outq);
+  pthread_join(rt, NULL);
+  pthread_join(wt, NULL);
+  QueueDestroy(&inq);
+  QueueDestroy(&outq);
+  if (fin != stdin) fclose(fin);
+  closeOutput(fout, out);
+
+  // Report the first failure, in stream order
+  if (err <= 0 && reader.err) { err = reader.err; errnum = reader.errnum; *cause = reader.cause; }
+  if (err <= 0 && writer.err) { err = writer.err; errnum = writer.errnum; *cause = writer.cause; }
+  errno = errnum;
+  return err;
+}
+
+
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  int err = 0;
+  const char* cause = NULL;
+
+  // The image buffer
+  Image img[N];     // the images
+  int n = 0;          // number of images created
+
+  int k = 1;
+
+  InstrCalibrate();
+
+  // Options
+  const char* frameIn = NULL;
+  const char* frameOut = NULL;
+  while (k < ac && strncmp(av[k], "--", 2) == 0) {
+    if (strcmp(av[k], "--frames") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      frameIn = av[k+1];
+      frameOut = av[k+2];
+      k += 3;
+    } else if (strcmp(av[k], "--border") == 0) {
+      if (k + 1 >= ac) { err = 1; break; }
+      if (strcmp(av[k+1], "clamp") == 0) border = BorderClamp;
+      else if (strcmp(av[k+1], "mirror") == 0) border = BorderMirror;
+      else if (strcmp(av[k+1], "zero") == 0) border = BorderZero;
+      else { err = 5; break; }
+      k += 2;
+    } else if (strcmp(av[k], "--cache") == 0) {
+      if (k + 1 >= ac) { err = 1; break; }
+      cacheDir = av[k+1];
+      int errsave = errno;
+      if (mkdir(cacheDir, 0777) != 0 && errno != EEXIST) { err = 8; cause = cacheDir; break; }
+      errno = errsave;   // (an existing DIR is fine)
+      k += 2;
+    } else if (strcmp(av[k], "--cache-size") == 0) {
+      if (k + 1 >= ac) { err = 1; break; }
+      int mb;
+      if (sscanf(av[k+1], "%d", &mb) != 1 || mb < 0) { err = 5; break; }
+      cacheLimit = (long long)mb << 20;
+      k += 2;
+    } else if (strcmp(av[k], "--trace") == 0) {
+      if (k + 1 >= ac) { err = 1; break; }
+      if (!TraceOpen(av[k+1])) { err = 8; cause = av[k+1]; break; }
+      k += 2;
+    } else {
+      err = 5;
+      break;
+    }
+  }
+
+  if (err == 0 && frameIn != NULL) {
+    err = runFrames(frameIn, frameOut, k, ac, av, &cause);
+  } else if (err == 0) {
+    err = runPipeline(k, ac, av, img, &n);
+  }
   
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
+  TraceClose();
 
-  error(err, errno, errors[err], ImageErrMsg());
+  error(err, errno, errors[err], cause != NULL ? cause : ImageErrMsg());
   return 0;
 }
 
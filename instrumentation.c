@@ -20,8 +20,10 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -43,6 +45,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 /*
 
 // funções para iniciar o tempo e para-lo
@@ -84,10 +94,18 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // the performance counter is a wall clock already
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+_Thread_local unsigned long long InstrCount[NUMCOUNTERS];  ///extern
+
+// Counters merged from other threads, under instrLock
+static unsigned long long instrMerged[NUMCOUNTERS];
+static pthread_mutex_t instrLock = PTHREAD_MUTEX_INITIALIZER;
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -119,19 +137,41 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of the calling thread, and those merged from other
+/// threads) to zero and store cpu_time.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+  pthread_mutex_lock(&instrLock);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    InstrCount[i] = 0ull;
+    instrMerged[i] = 0ull;
+  }
+  pthread_mutex_unlock(&instrLock);
   InstrTime = cpu_time();
 }
 
+/// Merge the counters of the calling thread into those that InstrPrint
+/// adds, and reset them.
+void InstrMerge(void) { ///
+  pthread_mutex_lock(&instrLock);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    instrMerged[i] += InstrCount[i];
+    InstrCount[i] = 0ull;
+  }
+  pthread_mutex_unlock(&instrLock);
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  // counts of this thread and of those merged:
+  unsigned long long count[NUMCOUNTERS];
+  pthread_mutex_lock(&instrLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    count[i] = InstrCount[i] + instrMerged[i];
+  pthread_mutex_unlock(&instrLock);
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
@@ -141,7 +181,111 @@ void InstrPrint(void) { ///
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15llu", count[i]);
   puts("");
 }
 
+
+/// Tracing
+
+// Trace file, or NULL when tracing is off
+static FILE* traceFile = NULL;
+// Origin of trace timestamps
+static double traceStart;
+// Number of events written (to place the commas)
+static unsigned long traceEvents;
+// Held while writing an event
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread ids in traces are small numbers, in order of first use.
+static unsigned long traceThreads = 0;
+static _Thread_local unsigned long traceTid = 0;
+
+// Open spans of this thread
+#define TRACEDEPTH 64
+typedef struct {
+  const char* name;
+  const char* cat;
+  double start;
+  unsigned long long count[NUMCOUNTERS];
+} Span;
+static _Thread_local Span traceStack[TRACEDEPTH];
+static _Thread_local int traceDepth = 0;
+
+/// Start tracing to file filename.
+int TraceOpen(const char* filename) { ///
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return 0;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  traceStart = wall_time();
+  traceEvents = 0;
+  traceFile = f;
+  return 1;
+}
+
+/// Stop tracing, completing and closing the file.
+void TraceClose(void) { ///
+  FILE* f = traceFile;
+  if (f == NULL) return;
+  traceFile = NULL;
+  fprintf(f, "\n]}\n");
+  fclose(f);
+}
+
+/// Begin a span called name, of category cat, on the calling thread.
+void TraceBegin(const char* name, const char* cat) { ///
+  if (traceFile == NULL) return;
+  if (traceDepth < TRACEDEPTH) {
+    Span* s = &traceStack[traceDepth];
+    s->name = name;
+    s->cat = cat;
+    for (int i = 0; i < NUMCOUNTERS; i++) s->count[i] = InstrCount[i];
+    s->start = wall_time();
+  }
+  traceDepth++;
+}
+
+// Write string str to f, escaped as a JSON string.
+static void jsonString(FILE* f, const char* str) {
+  putc_unlocked('"', f);
+  for (; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+    else if (c < 0x20) fprintf(f, "\\u%04x", c);
+    else putc_unlocked(c, f);
+  }
+  putc_unlocked('"', f);
+}
+
+/// End the innermost span of the calling thread, which touched bytes bytes.
+void TraceEnd(unsigned long long bytes) { ///
+  FILE* f = traceFile;
+  if (traceDepth == 0) return;
+  traceDepth--;
+  if (f == NULL || traceDepth >= TRACEDEPTH) return;
+  double end = wall_time();
+  Span* s = &traceStack[traceDepth];
+  if (traceTid == 0) traceTid = __atomic_add_fetch(&traceThreads, 1, __ATOMIC_RELAXED);
+
+  // A complete ("X") event, written as a whole while holding traceLock
+  pthread_mutex_lock(&traceLock);
+  fprintf(f, "%s\n{\"name\": ", traceEvents++ == 0 ? "" : ",");
+  jsonString(f, s->name);
+  fprintf(f, ", \"cat\": ");
+  jsonString(f, s->cat);
+  fprintf(f, ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %lu, "
+          "\"args\": {\"bytes\": %llu",
+          1e6 * (s->start - traceStart), 1e6 * (end - s->start),
+          (long)getpid(), traceTid, bytes);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) {
+      // (If counters were reset inside the span, count from the reset.)
+      unsigned long long c = InstrCount[i];
+      fprintf(f, ", ");
+      jsonString(f, InstrName[i]);
+      fprintf(f, ": %llu", c >= s->count[i] ? c - s->count[i] : c);
+    }
+  }
+  fprintf(f, "}}");
+  pthread_mutex_unlock(&traceLock);
+}
@@ -25,11 +25,16 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall clock time in seconds (from an arbitrary origin)
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (64 bits, even where long is 32).
+/// Each thread has its own, so threads count their own operations (and
+/// the spans of a thread record only its counts) without racing.
+extern _Thread_local unsigned long long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -45,10 +50,48 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of the calling thread, and those merged from other
+/// threads) to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print time and counters: those of the calling thread plus those merged
+/// from other threads.
 void InstrPrint(void) ;
 
+/// Merge the counters of the calling thread into those that InstrPrint
+/// adds, and reset them.  Other threads that count operations should
+/// call this when they are done, so that their counts are printed.
+void InstrMerge(void) ;
+
+/// Tracing
+///
+/// Spans (named intervals of time) may be recorded and written to a file in
+/// the Chrome trace_event JSON format, to be viewed in chrome://tracing or
+/// ui.perfetto.dev.  Each span records its thread, start and duration,
+/// the bytes it touched and the change of each named counter.
+/// Spans nest, per thread.  While tracing is off, they cost next to nothing.
+///
+/// TraceOpen("trace.json");
+/// ...
+/// TraceBegin("blur", "kernel");
+/// ...
+/// TraceEnd(2*w*h);  // bytes touched
+/// ...
+/// TraceClose();
+
+/// Start tracing to file filename.
+/// Returns nonzero on success, 0 on failure (errno set).
+int TraceOpen(const char* filename) ;
+
+/// Stop tracing, completing and closing the file.
+void TraceClose(void) ;
+
+/// Begin a span called name, of category cat, on the calling thread.
+/// (name and cat must remain valid until the span ends.)
+void TraceBegin(const char* name, const char* cat) ;
+
+/// End the innermost span of the calling thread, which touched bytes bytes.
+void TraceEnd(unsigned long long bytes) ;
+
 #endif
 